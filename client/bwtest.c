@@ -37,6 +37,9 @@ static int print_update_row(void *context, uint64_t wal_pos, Oid relid,
         const void *key_bin, size_t key_len, avro_value_t *key_val,
         const void *old_bin, size_t old_len, avro_value_t *old_val,
         const void *new_bin, size_t new_len, avro_value_t *new_val);
+static int print_update_delta(void *context, uint64_t wal_pos, Oid relid,
+        const void *key_bin, size_t key_len, avro_value_t *key_val,
+        const uint8_t *changed, size_t changed_len, avro_value_t *new_val);
 static int print_delete_row(void *context, uint64_t wal_pos, Oid relid,
         const void *key_bin, size_t key_len, avro_value_t *key_val,
         const void *old_bin, size_t old_len, avro_value_t *old_val);
@@ -55,7 +58,14 @@ void usage() {
             "                          The slot is automatically created on first use.\n"
             "  -u, --allow-unkeyed     Allow export of tables that don't have a primary key.\n"
             "                          This is disallowed by default, because updates and\n"
-            "                          deletes need a primary key to identify their row.\n",
+            "                          deletes need a primary key to identify their row.\n"
+            "  -D, --delta-updates     For tables with REPLICA IDENTITY FULL, receive only\n"
+            "                          the columns whose values were changed by an update.\n"
+            "  -T, --unchanged-toast   Receive a marker instead of the value of an out-of-line\n"
+            "                          (TOASTed) column that was not modified by an update.\n"
+            "  -o, --old-values=full|key\n"
+            "                          Receive the whole old row with updates and deletes\n"
+            "                          (full, the default), or only the old key (key).\n",
             progname, DEFAULT_REPLICATION_SLOT);
     exit(1);
 }
@@ -65,6 +75,9 @@ void parse_options(client_context_t context, int argc, char **argv) {
         {"postgres",      required_argument, NULL, 'd'},
         {"slot",          required_argument, NULL, 's'},
         {"allow-unkeyed", no_argument,       NULL, 'u'},
+        {"delta-updates", no_argument,       NULL, 'D'},
+        {"unchanged-toast", no_argument,     NULL, 'T'},
+        {"old-values",    required_argument, NULL, 'o'},
         {NULL,            0,                 NULL,  0 }
     };
 
@@ -72,7 +85,7 @@ void parse_options(client_context_t context, int argc, char **argv) {
 
     int option_index;
     while (true) {
-        int c = getopt_long(argc, argv, "d:s:u", options, &option_index);
+        int c = getopt_long(argc, argv, "d:s:uDTo:", options, &option_index);
         if (c == -1) break;
 
         switch (c) {
@@ -85,6 +98,15 @@ void parse_options(client_context_t context, int argc, char **argv) {
             case 'u':
                 context->allow_unkeyed = true;
                 break;
+            case 'D':
+                context->repl.delta_updates = true;
+                break;
+            case 'T':
+                context->repl.unchanged_toast = true;
+                break;
+            case 'o':
+                context->repl.old_values = strdup(optarg);
+                break;
             default:
                 usage();
         }
@@ -177,6 +199,34 @@ static int print_update_row(void *context, uint64_t wal_pos, Oid relid,
     return err;
 }
 
+static int print_update_delta(void *context, uint64_t wal_pos, Oid relid,
+        const void *key_bin, size_t key_len, avro_value_t *key_val,
+        const uint8_t *changed, size_t changed_len, avro_value_t *new_val) {
+    int err = 0;
+    size_t num_fields;
+    char *key_json = NULL, *field_json;
+    const char *table_name = avro_schema_name(avro_value_get_schema(new_val)), *field_name;
+    avro_value_t field_val;
+
+    if (key_val) check(err, avro_value_to_json(key_val, 1, &key_json));
+    printf("update to %s: key %s:", table_name, key_json ? key_json : "(?)");
+    if (key_json) free(key_json);
+
+    check(err, avro_value_get_size(new_val, &num_fields));
+    for (size_t field = 0; field < num_fields; field++) {
+        if (!(changed[field / 8] & (1 << (field % 8)))) continue;
+
+        check(err, avro_value_get_by_index(new_val, field, &field_val, &field_name));
+        check(err, avro_value_to_json(&field_val, 1, &field_json));
+        printf(" %s=%s", field_name, field_json);
+        free(field_json);
+    }
+    printf("\n");
+
+    checkpoint(context, wal_pos);
+    return err;
+}
+
 static int print_delete_row(void *context, uint64_t wal_pos, Oid relid,
         const void *key_bin, size_t key_len, avro_value_t *key_val,
         const void *old_bin, size_t old_len, avro_value_t *old_val) {
@@ -218,6 +268,7 @@ client_context_t init_client() {
     frame_reader->on_table_schema = print_table_schema;
     frame_reader->on_insert_row   = print_insert_row;
     frame_reader->on_update_row   = print_update_row;
+    frame_reader->on_update_delta = print_update_delta;
     frame_reader->on_delete_row   = print_delete_row;
 
     client_context_t context = db_client_new();
@@ -1,7 +1,9 @@
 #include "connect.h"
 #include "replication.h"
 
+#include <errno.h>
 #include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
@@ -9,6 +11,10 @@
 
 #include <internal/pqexpbuffer.h>
 
+/* Size of the chunks into which a parallel snapshot splits large tables, if not
+ * given by the client: 131072 pages is 1 GB with the default page size. */
+#define DEFAULT_SNAPSHOT_CHUNK_PAGES 131072
+
 /* Wrap around a function call to bail on error. */
 #define check(err, call) { err = call; if (err) return err; }
 
@@ -25,16 +31,32 @@
 
 void client_error(client_context_t context, char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
 int exec_sql(client_context_t context, char *query);
+int exec_sql_conn(client_context_t context, PGconn *conn, char *query);
 int client_connect(client_context_t context);
 void client_sql_disconnect(client_context_t context);
 int replication_slot_exists(client_context_t context, bool *exists);
 int snapshot_start(client_context_t context);
+int snapshot_export_new(client_context_t context);
+int snapshot_import(client_context_t context, PGconn *conn);
+int snapshot_plan_chunks(client_context_t context);
+int snapshot_check_chunks(client_context_t context);
+int snapshot_export_next(client_context_t context, snapshot_worker *worker);
 int snapshot_poll(client_context_t context);
+int snapshot_poll_worker(client_context_t context, snapshot_worker *worker);
+int snapshot_finish(client_context_t context);
+void snapshot_disconnect(client_context_t context);
+int snapshot_chunk_complete(client_context_t context, snapshot_chunk *chunk);
+int snapshot_state_load(client_context_t context, bool *resume);
+int snapshot_state_write(client_context_t context);
+int snapshot_state_update(client_context_t context);
 int snapshot_tuple(client_context_t context, PGresult *res, int row_number);
+void append_text_array(PQExpBuffer buf, int count, char **items);
+void free_string_list(int count, char **items);
 
 /* k4m: make active table list */
 int client_sql_connect(client_context_t context);
 int update_repl_table_entry(client_context_t context, client_context_t ctx);
+int restart_filtered_stream(client_context_t context);
 int received_reload_signal;
 /* k4m: make active table list */
 
@@ -50,17 +72,28 @@ client_context_t db_client_new() {
 
 /* Closes any network connections, if applicable, and frees the client_context struct. */
 void db_client_free(client_context_t context) {
+    snapshot_disconnect(context);
     client_sql_disconnect(context);
+    if (context->snapshot_chunks) free(context->snapshot_chunks);
+    if (context->snapshot_state_file) free(context->snapshot_state_file);
     if (context->repl.conn) PQfinish(context->repl.conn);
     if (context->repl.snapshot_name) free(context->repl.snapshot_name);
     if (context->repl.output_plugin) free(context->repl.output_plugin);
     if (context->repl.slot_name) free(context->repl.slot_name);
+    free_string_list(context->repl.num_row_filters, context->repl.row_filters);
+    free_string_list(context->repl.num_include_columns, context->repl.include_columns);
+    free_string_list(context->repl.num_exclude_columns, context->repl.exclude_columns);
     if (context->error_policy) free(context->error_policy);
     if (context->app_name) free(context->app_name);
     if (context->conninfo) free(context->conninfo);
     free(context);
 }
 
+void free_string_list(int count, char **items) {
+    for (int i = 0; i < count; i++) free(items[i]);
+    if (items) free(items);
+}
+
 void db_client_set_error_policy(client_context_t context, const char *policy) {
     if (context->error_policy) free(context->error_policy);
     context->error_policy = strdup(policy);
@@ -71,10 +104,11 @@ void db_client_set_error_policy(client_context_t context, const char *policy) {
  * context->app_name as client name), and checks whether replication slot
  * context->repl.slot_name already exists. If yes, sets up the context to start
  * receiving the stream of changes from that slot. If no, creates the slot, and
- * initiates the consistent snapshot. */
+ * initiates the consistent snapshot. If the slot exists, but context->snapshot_state_file
+ * shows that its snapshot did not complete, the snapshot is resumed first. */
 int db_client_start(client_context_t context) {
     int err = 0;
-    bool slot_exists=false;
+    bool slot_exists=false, resume_snapshot=false;
 
     check(err, client_connect(context));
     checkRepl(err, context, replication_stream_check(&context->repl));
@@ -82,7 +116,21 @@ int db_client_start(client_context_t context) {
 
     if (slot_exists) {
         context->slot_created = false;
+
+        if (context->snapshot_state_file) {
+            check(err, snapshot_state_load(context, &resume_snapshot));
+        }
+        if (resume_snapshot) {
+            context->taking_snapshot = true;
+            check(err, snapshot_start(context));
+            return err;
+        }
     } else {
+        /* The state file is written before the slot is created, so that if the client
+         * dies at any point before the snapshot completes, the snapshot is resumed. */
+        if (context->snapshot_state_file && !context->skip_snapshot) {
+            check(err, snapshot_state_write(context));
+        }
         checkRepl(err, context, replication_slot_create(&context->repl));
         context->slot_created = true;
 
@@ -96,6 +144,12 @@ int db_client_start(client_context_t context) {
         }
     }
 
+    /* The server-side table filter is taken from the active table list, so it must
+     * be loaded before streaming starts. */
+    if (context->repl.filter_tables) {
+        check(err, update_repl_table_entry(context, context));
+    }
+
     client_sql_disconnect(context);
     context->taking_snapshot = false;
 
@@ -130,14 +184,7 @@ int db_client_poll(client_context_t context) {
         }
         /* k4m: make active table list  */
 
-        /* To make PQgetResult() non-blocking, check PQisBusy() first */
-        if (PQisBusy(context->sql_conn)) {
-            context->status = 0;
-            return err;
-        }
-
         check(err, snapshot_poll(context));
-        context->status = 1;
 
         /* If the snapshot is finished, switch over to the replication stream */
         if (!context->sql_conn) {
@@ -158,6 +205,8 @@ int db_client_poll(client_context_t context) {
 		}
 		/* k4m: make active table list  */
 
+        check(err, restart_filtered_stream(context));
+
         checkRepl(err, context, replication_stream_poll(&context->repl));
         context->status = context->repl.status;
         return err;
@@ -181,6 +230,13 @@ int db_client_wait(client_context_t context) {
         FD_SET(sql_fd, &input_mask);
     }
 
+    /* Additional connections of a parallel snapshot (the first one is sql_conn) */
+    for (int i = 1; context->snapshot_workers && i < context->snapshot_connections; i++) {
+        int worker_fd = PQsocket(context->snapshot_workers[i].conn);
+        if (worker_fd > max_fd) max_fd = worker_fd;
+        FD_SET(worker_fd, &input_mask);
+    }
+
     struct timeval timeout;
     timeout.tv_sec = 1;
     timeout.tv_usec = 0;
@@ -206,6 +262,13 @@ int db_client_wait(client_context_t context) {
                 PQerrorMessage(context->sql_conn));
         return EIO;
     }
+    for (int i = 1; context->snapshot_workers && i < context->snapshot_connections; i++) {
+        PGconn *conn = context->snapshot_workers[i].conn;
+        if (!PQconsumeInput(conn)) {
+            client_error(context, "Could not receive snapshot data: %s", PQerrorMessage(conn));
+            return EIO;
+        }
+    }
     return 0;
 }
 
@@ -221,12 +284,18 @@ void client_error(client_context_t context, char *fmt, ...) {
 
 /* Executes a SQL command that returns no results. */
 int exec_sql(client_context_t context, char *query) {
-    PGresult *res = PQexec(context->sql_conn, query);
+    return exec_sql_conn(context, context->sql_conn, query);
+}
+
+
+/* Executes a SQL command that returns no results, on the given connection. */
+int exec_sql_conn(client_context_t context, PGconn *conn, char *query) {
+    PGresult *res = PQexec(conn, query);
     if (PQresultStatus(res) == PGRES_COMMAND_OK) {
         PQclear(res);
         return 0;
     } else {
-        client_error(context, "Query failed: %s: %s", query, PQerrorMessage(context->sql_conn));
+        client_error(context, "Query failed: %s: %s", query, PQerrorMessage(conn));
         PQclear(res);
         return EIO;
     }
@@ -351,69 +420,424 @@ int replication_slot_exists(client_context_t context, bool *exists) {
 
 
 /* Initiates the non-blocking capture of a consistent snapshot of the database,
- * using the exported snapshot context->repl.snapshot_name. */
+ * using the exported snapshot context->repl.snapshot_name. When a snapshot is resumed
+ * after the client restarted, the snapshot exported with the slot no longer exists,
+ * so a new one is exported (see snapshot_export_new), and only the chunks that were
+ * not completed before are exported again. If
+ * context->snapshot_connections is greater than 1, that many connections import the
+ * same snapshot, and the tables are handed out to them one at a time, largest first.
+ * Tables larger than context->snapshot_chunk_pages are split into page ranges, which
+ * are handed out in the same way. Each query sends the schema of its table before any
+ * rows, so rows never reach the frame reader ahead of their schema. */
 int snapshot_start(client_context_t context) {
-    if (!context->repl.snapshot_name || context->repl.snapshot_name[0] == '\0') {
+    int err = 0;
+    int count = context->snapshot_connections > 1 ? context->snapshot_connections : 1;
+
+    if (!context->slot_created) {
+        check(err, snapshot_export_new(context));
+    } else if (!context->repl.snapshot_name || context->repl.snapshot_name[0] == '\0') {
         client_error(context, "snapshot_name must be set in client context");
         return EINVAL;
     }
 
+    context->snapshot_workers = calloc(count, sizeof(snapshot_worker)); if(context->snapshot_workers == NULL) return ENOMEM;
+    context->snapshot_connections = count;
+    context->snapshot_workers[0].conn = context->sql_conn;
+
+    for (int i = 1; i < count; i++) {
+        PGconn *conn = PQconnectdb(context->conninfo);
+        context->snapshot_workers[i].conn = conn;
+        if (PQstatus(conn) != CONNECTION_OK) {
+            client_error(context, "Snapshot connection failed: %s", PQerrorMessage(conn));
+            return EIO;
+        }
+    }
+
+    /* When the snapshot was exported by sql_conn, it is already in use there */
+    for (int i = context->slot_created ? 0 : 1; i < count; i++) {
+        check(err, snapshot_import(context, context->snapshot_workers[i].conn));
+    }
+
+    if (context->snapshot_chunks) {
+        /* Resuming: the chunks were loaded from the state file */
+        check(err, snapshot_check_chunks(context));
+    } else if (count > 1 || context->snapshot_state_file) {
+        check(err, snapshot_plan_chunks(context));
+        if (context->snapshot_state_file) check(err, snapshot_state_update(context));
+    } else {
+        /* A single connection exports all tables with one query */
+        context->snapshot_chunks = malloc(sizeof(snapshot_chunk)); if(context->snapshot_chunks == NULL) return ENOMEM;
+        context->snapshot_chunks[0].relid = InvalidOid;
+        context->snapshot_chunks[0].relfilenode = InvalidOid;
+        context->snapshot_chunks[0].start_page = 0;
+        context->snapshot_chunks[0].end_page = -1;
+        context->snapshot_chunks[0].exported = false;
+        context->snapshot_chunks[0].completed = false;
+        context->snapshot_chunks[0].pending_rows = 0;
+        context->num_snapshot_chunks = 1;
+    }
+    context->next_snapshot_chunk = 0;
+    context->current_chunk = NULL;
+    context->fragment_worker = NULL;
+    context->poll_worker = 0;
+
+    for (int i = 0; i < count; i++) {
+        check(err, snapshot_export_next(context, &context->snapshot_workers[i]));
+    }
+
+    // Invoke the begin-transaction callback with xid==0 to indicate start of snapshot
+    begin_txn_cb begin_txn = context->repl.frame_reader->on_begin_txn;
+    void *cb_context = context->repl.frame_reader->cb_context;
+    if (begin_txn) {
+        check(err, begin_txn(cb_context, context->repl.start_lsn, 0));
+    }
+    return 0;
+}
+
+/* Starts a transaction on sql_conn, and exports its snapshot as
+ * context->repl.snapshot_name, for use by the other snapshot connections. This is used
+ * when resuming a snapshot. The new snapshot is later than the position from which the
+ * slot streams changes, so the changes made in between are streamed again after the
+ * snapshot. They are already reflected in the chunks exported now, but replaying them
+ * brings those rows back to the same final state. */
+int snapshot_export_new(client_context_t context) {
     int err = 0;
     check(err, exec_sql(context, "BEGIN"));
     check(err, exec_sql(context, "SET TRANSACTION ISOLATION LEVEL REPEATABLE READ"));
 
+    PGresult *res = PQexec(context->sql_conn, "SELECT pg_export_snapshot()");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) != 1) {
+        client_error(context, "Could not export snapshot: %s", PQerrorMessage(context->sql_conn));
+        PQclear(res);
+        return EIO;
+    }
+
+    if (context->repl.snapshot_name) free(context->repl.snapshot_name);
+    context->repl.snapshot_name = strdup(PQgetvalue(res, 0, 0));
+    PQclear(res);
+    return err;
+}
+
+/* Starts a transaction on the given connection that reads the exported snapshot
+ * context->repl.snapshot_name. */
+int snapshot_import(client_context_t context, PGconn *conn) {
+    int err = 0;
+    check(err, exec_sql_conn(context, conn, "BEGIN"));
+    check(err, exec_sql_conn(context, conn, "SET TRANSACTION ISOLATION LEVEL REPEATABLE READ"));
+
     PQExpBuffer query = createPQExpBuffer();
     appendPQExpBuffer(query, "SET TRANSACTION SNAPSHOT '%s'", context->repl.snapshot_name);
-    check(err, exec_sql(context, query->data));
+    err = exec_sql_conn(context, conn, query->data);
     destroyPQExpBuffer(query);
+    return err;
+}
+
+/* Lists the tables to be exported by a parallel snapshot, largest first by relpages,
+ * so that the biggest tables don't start last and hold up the end of the snapshot.
+ * A table of more than context->snapshot_chunk_pages pages is split into chunks of
+ * that many pages; relpages is only an estimate, so the last chunk extends to the end
+ * of the table. The selection matches get_table_list() in the extension, which checks
+ * each table again as it is exported. The tables are all locked up front, as
+ * bottledwater_export does, so that none can be dropped or altered before a
+ * connection gets round to it. */
+int snapshot_plan_chunks(client_context_t context) {
+    int err = 0;
+    PGresult *res = PQexec(context->sql_conn,
+            "SELECT c.oid, pg_catalog.quote_ident(n.nspname) || '.' || pg_catalog.quote_ident(c.relname), c.relpages, "
+            "pg_catalog.pg_relation_filenode(c.oid) "
+            "FROM pg_catalog.pg_class c "
+            "JOIN pg_catalog.pg_namespace n ON n.oid = c.relnamespace "
+            "WHERE c.relkind = 'r' AND "
+            "n.nspname NOT LIKE 'pg_%' AND n.nspname != 'information_schema' AND "
+            "c.relpersistence = 'p' "
+            "ORDER BY c.relpages DESC, c.oid");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        client_error(context, "Could not list tables for snapshot: %s",
+                PQerrorMessage(context->sql_conn));
+        PQclear(res);
+        return EIO;
+    }
+
+    int64_t chunk_pages = context->snapshot_chunk_pages > 0 ?
+        context->snapshot_chunk_pages : DEFAULT_SNAPSHOT_CHUNK_PAGES;
+    int count = PQntuples(res), num_chunks = 0;
 
-    Oid argtypes[] = { 25, 16, 25 }; // 25 == TEXTOID, 16 == BOOLOID
+    for (int i = 0; i < count; i++) {
+        int64_t relpages = strtoll(PQgetvalue(res, i, 2), NULL, 10);
+        num_chunks += relpages > chunk_pages ? (relpages + chunk_pages - 1) / chunk_pages : 1;
+    }
+
+    context->snapshot_chunks = malloc((num_chunks > 0 ? num_chunks : 1) * sizeof(snapshot_chunk)); if(context->snapshot_chunks == NULL) return ENOMEM;
+    context->num_snapshot_chunks = 0;
+
+    PQExpBuffer lock = createPQExpBuffer();
+    appendPQExpBufferStr(lock, "LOCK TABLE ");
+    for (int i = 0; i < count; i++) {
+        Oid relid = (Oid) strtoul(PQgetvalue(res, i, 0), NULL, 10);
+        int64_t relpages = strtoll(PQgetvalue(res, i, 2), NULL, 10);
+        Oid relfilenode = (Oid) strtoul(PQgetvalue(res, i, 3), NULL, 10);
+        int64_t start_page = 0;
+
+        do {
+            snapshot_chunk *chunk = &context->snapshot_chunks[context->num_snapshot_chunks++];
+            chunk->relid = relid;
+            chunk->relfilenode = relfilenode;
+            chunk->start_page = start_page;
+            start_page += chunk_pages;
+            chunk->end_page = start_page < relpages ? start_page : -1;
+            chunk->exported = false;
+            chunk->completed = false;
+            chunk->pending_rows = 0;
+        } while (start_page < relpages);
+
+        if (i > 0) appendPQExpBufferStr(lock, ", ");
+        appendPQExpBufferStr(lock, PQgetvalue(res, i, 1));
+    }
+    appendPQExpBufferStr(lock, " IN ACCESS SHARE MODE");
+    PQclear(res);
+
+    if (count > 0) err = exec_sql(context, lock->data);
+    destroyPQExpBuffer(lock);
+    return err;
+}
+
+/* Checks the chunks loaded from the snapshot state file against the tables as they are
+ * now, when a snapshot is resumed. The tables are first locked, as snapshot_plan_chunks
+ * does when the snapshot is planned. A table that has been dropped is left out; if it
+ * was recreated, the new table has a different oid, and was created after the slot, so
+ * its rows are streamed from the slot. A table whose storage has been rewritten since
+ * the snapshot was planned (by VACUUM FULL, CLUSTER, TRUNCATE or a rewriting ALTER
+ * TABLE) no longer has its rows on the same pages, so the page ranges of its chunks are
+ * meaningless: all its chunks are replaced by one chunk for the whole table, which is
+ * exported again even if parts of it were completed. */
+int snapshot_check_chunks(client_context_t context) {
+    int err = 0;
+    PQExpBuffer relids = createPQExpBuffer();
+    appendPQExpBufferChar(relids, '{');
+    for (int i = 0; i < context->num_snapshot_chunks; i++) {
+        if (i > 0) appendPQExpBufferChar(relids, ',');
+        appendPQExpBuffer(relids, "%u", context->snapshot_chunks[i].relid);
+    }
+    appendPQExpBufferChar(relids, '}');
+
+    Oid argtypes[] = { 1028 }; // 1028 == OIDARRAYOID
+    const char *args[] = { relids->data };
+
+    PGresult *res = PQexecParams(context->sql_conn,
+            "SELECT pg_catalog.quote_ident(n.nspname) || '.' || pg_catalog.quote_ident(c.relname) "
+            "FROM pg_catalog.pg_class c "
+            "JOIN pg_catalog.pg_namespace n ON n.oid = c.relnamespace "
+            "WHERE c.oid = ANY($1) AND c.relkind = 'r'",
+            1, argtypes, args, NULL, NULL, 0);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        client_error(context, "Could not list tables for snapshot: %s",
+                PQerrorMessage(context->sql_conn));
+        PQclear(res);
+        destroyPQExpBuffer(relids);
+        return EIO;
+    }
+
+    PQExpBuffer lock = createPQExpBuffer();
+    appendPQExpBufferStr(lock, "LOCK TABLE ");
+    for (int i = 0; i < PQntuples(res); i++) {
+        if (i > 0) appendPQExpBufferStr(lock, ", ");
+        appendPQExpBufferStr(lock, PQgetvalue(res, i, 0));
+    }
+    appendPQExpBufferStr(lock, " IN ACCESS SHARE MODE");
+    if (PQntuples(res) > 0) err = exec_sql(context, lock->data);
+    destroyPQExpBuffer(lock);
+    PQclear(res);
+    if (err) {
+        destroyPQExpBuffer(relids);
+        return err;
+    }
+
+    /* pg_relation_filenode reads the current catalog rather than the snapshot, so once
+     * the locks are held, a rewrite that committed after the snapshot is seen too. */
+    res = PQexecParams(context->sql_conn,
+            "SELECT c.oid, pg_catalog.pg_relation_filenode(c.oid) "
+            "FROM pg_catalog.pg_class c WHERE c.oid = ANY($1) AND c.relkind = 'r'",
+            1, argtypes, args, NULL, NULL, 0);
+    destroyPQExpBuffer(relids);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        client_error(context, "Could not check tables for snapshot: %s",
+                PQerrorMessage(context->sql_conn));
+        PQclear(res);
+        return EIO;
+    }
+
+    /* The chunks of a table are next to each other, so the chunks are filtered in place */
+    int kept = 0;
+    for (int i = 0; i < context->num_snapshot_chunks; i++) {
+        snapshot_chunk chunk = context->snapshot_chunks[i];
+        Oid relfilenode = InvalidOid;
+
+        for (int row = 0; row < PQntuples(res); row++) {
+            if ((Oid) strtoul(PQgetvalue(res, row, 0), NULL, 10) == chunk.relid) {
+                relfilenode = (Oid) strtoul(PQgetvalue(res, row, 1), NULL, 10);
+                break;
+            }
+        }
+        if (relfilenode == InvalidOid) continue; /* table was dropped */
+
+        if (relfilenode != chunk.relfilenode) {
+            /* Only keep the first chunk of the table, extended to the whole table */
+            if (kept > 0 && context->snapshot_chunks[kept - 1].relid == chunk.relid) continue;
+            chunk.relfilenode = relfilenode;
+            chunk.start_page = 0;
+            chunk.end_page = -1;
+            chunk.completed = false;
+        }
+        context->snapshot_chunks[kept++] = chunk;
+    }
+    context->num_snapshot_chunks = kept;
+    PQclear(res);
+
+    return snapshot_state_update(context);
+}
+
+/* Sends the query that exports the next chunk of context->snapshot_chunks on the
+ * worker's connection, or marks the worker as idle if there are no chunks left. */
+int snapshot_export_next(client_context_t context, snapshot_worker *worker) {
+    while (context->next_snapshot_chunk < context->num_snapshot_chunks &&
+            context->snapshot_chunks[context->next_snapshot_chunk].completed) {
+        context->next_snapshot_chunk++;
+    }
+    if (context->next_snapshot_chunk >= context->num_snapshot_chunks) {
+        worker->exporting = false;
+        worker->chunk = NULL;
+        return 0;
+    }
+    snapshot_chunk *chunk = &context->snapshot_chunks[context->next_snapshot_chunk++];
+
+    PQExpBuffer row_filters = createPQExpBuffer();
+    PQExpBuffer include_columns = createPQExpBuffer();
+    PQExpBuffer exclude_columns = createPQExpBuffer();
+    append_text_array(row_filters, context->repl.num_row_filters, context->repl.row_filters);
+    append_text_array(include_columns, context->repl.num_include_columns, context->repl.include_columns);
+    append_text_array(exclude_columns, context->repl.num_exclude_columns, context->repl.exclude_columns);
+
+    char relation[16], start_page[24], end_page[24];
+    snprintf(relation, sizeof(relation), "%u", chunk->relid);
+    snprintf(start_page, sizeof(start_page), "%lld", (long long) chunk->start_page);
+    snprintf(end_page, sizeof(end_page), "%lld", (long long) chunk->end_page);
+
+    // --batch-bytes also sets the size of snapshot frames; otherwise the server default applies
+    char batch_bytes[16];
+    snprintf(batch_bytes, sizeof(batch_bytes), "%d", context->repl.batch_bytes);
+
+    Oid argtypes[] = { 25, 16, 25, 1009, 1009, 1009, 25, 26, 20, 20, 23 }; // 25 == TEXTOID, 16 == BOOLOID, 1009 == TEXTARRAYOID, 26 == OIDOID, 20 == INT8OID, 23 == INT4OID
     const char *args[] = {
         "%",
         context->allow_unkeyed ? "t" : "f",
-        context->error_policy
+        context->error_policy,
+        row_filters->data,
+        include_columns->data,
+        exclude_columns->data,
+        context->repl.compression ? context->repl.compression : PROTOCOL_COMPRESSION_NONE,
+        relation,
+        start_page,
+        end_page,
+        batch_bytes
     };
 
-    if (!PQsendQueryParams(context->sql_conn,
-                "SELECT bottledwater_export(table_pattern := $1, allow_unkeyed := $2, error_policy := $3)",
-                3, argtypes, args, NULL, NULL, 1)) { // The final 1 requests results in binary format
+    PQExpBuffer query = createPQExpBuffer();
+    appendPQExpBufferStr(query,
+            "SELECT bottledwater_export(table_pattern := $1, allow_unkeyed := $2, "
+            "error_policy := $3, row_filters := $4, include_columns := $5, exclude_columns := $6, "
+            "compression := $7, relation := $8, start_page := $9, end_page := $10");
+    if (context->repl.batch_bytes > 0) appendPQExpBufferStr(query, ", batch_bytes := $11");
+    appendPQExpBufferChar(query, ')');
+
+    int sent = PQsendQueryParams(worker->conn, query->data,
+            context->repl.batch_bytes > 0 ? 11 : 10,
+            argtypes, args, NULL, NULL, 1); // The final 1 requests results in binary format
+
+    destroyPQExpBuffer(query);
+    destroyPQExpBuffer(row_filters);
+    destroyPQExpBuffer(include_columns);
+    destroyPQExpBuffer(exclude_columns);
+
+    if (!sent) {
         client_error(context, "Could not dispatch snapshot fetch: %s",
-                PQerrorMessage(context->sql_conn));
+                PQerrorMessage(worker->conn));
         return EIO;
     }
 
-    if (!PQsetSingleRowMode(context->sql_conn)) {
+    if (!PQsetSingleRowMode(worker->conn)) {
         client_error(context, "Could not activate single-row mode");
         return EIO;
     }
 
-    // Invoke the begin-transaction callback with xid==0 to indicate start of snapshot
-    begin_txn_cb begin_txn = context->repl.frame_reader->on_begin_txn;
-    void *cb_context = context->repl.frame_reader->cb_context;
-    if (begin_txn) {
-        check(err, begin_txn(cb_context, context->repl.start_lsn, 0));
-    }
+    worker->exporting = true;
+    worker->chunk = chunk;
     return 0;
 }
 
-/* Reads the next result row from the snapshot query, parses and processes it.
- * Blocks until a new row is available, if necessary. */
+/* Formats a list of strings as a Postgres array literal, quoting every element. */
+void append_text_array(PQExpBuffer buf, int count, char **items) {
+    appendPQExpBufferChar(buf, '{');
+    for (int i = 0; i < count; i++) {
+        if (i > 0) appendPQExpBufferChar(buf, ',');
+        appendPQExpBufferChar(buf, '"');
+        for (const char *p = items[i]; *p; p++) {
+            if (*p == '"' || *p == '\\') appendPQExpBufferChar(buf, '\\');
+            appendPQExpBufferChar(buf, *p);
+        }
+        appendPQExpBufferChar(buf, '"');
+    }
+    appendPQExpBufferChar(buf, '}');
+}
+
+/* Checks the snapshot connections in turn, and processes the next result row from the
+ * first one that has a row ready. Does not block: context->status is set to 1 if a row
+ * was processed, and 0 if none was available. While a frame is being reassembled from
+ * fragments, only the connection that sent it is read, so that fragments from different
+ * connections never get mixed up. Once all connections are done, the snapshot is
+ * finished. */
 int snapshot_poll(client_context_t context) {
+    int err = 0, count = context->snapshot_connections;
+    bool exporting = false;
+
+    context->status = 0;
+
+    for (int i = 0; i < count; i++) {
+        int index = (context->poll_worker + i) % count;
+        snapshot_worker *worker = &context->snapshot_workers[index];
+
+        if (!worker->exporting) continue;
+        exporting = true;
+
+        if (context->fragment_worker && context->fragment_worker != worker) continue;
+
+        /* To make PQgetResult() non-blocking, check PQisBusy() first */
+        if (PQisBusy(worker->conn)) continue;
+
+        context->poll_worker = (index + 1) % count;
+        context->status = 1;
+        return snapshot_poll_worker(context, worker);
+    }
+
+    if (!exporting) {
+        check(err, snapshot_finish(context));
+        context->status = 1;
+    }
+    return err;
+}
+
+/* Reads the next result row from a worker's snapshot query, parses and processes it.
+ * When the query has returned all its rows, the worker moves on to the next chunk. */
+int snapshot_poll_worker(client_context_t context, snapshot_worker *worker) {
     int err = 0;
-    PGresult *res = PQgetResult(context->sql_conn);
+    PGresult *res = PQgetResult(worker->conn);
 
     /* null result indicates that there are no more rows */
     if (!res) {
-        check(err, exec_sql(context, "COMMIT"));
-        client_sql_disconnect(context);
-
-        // Invoke the commit callback with xid==0 to indicate end of snapshot
-        commit_txn_cb on_commit = context->repl.frame_reader->on_commit_txn;
-        void *cb_context = context->repl.frame_reader->cb_context;
-        if (on_commit) {
-            check(err, on_commit(cb_context, context->repl.start_lsn, 0));
+        worker->chunk->exported = true;
+        if (worker->chunk->pending_rows == 0) {
+            check(err, snapshot_chunk_complete(context, worker->chunk));
         }
-        return 0;
+        return snapshot_export_next(context, worker);
     }
 
     ExecStatusType status = PQresultStatus(res);
@@ -426,13 +850,188 @@ int snapshot_poll(client_context_t context) {
     }
 
     int tuples = PQntuples(res);
+    context->current_chunk = worker->chunk;
     for (int tuple = 0; tuple < tuples; tuple++) {
         check(err, snapshot_tuple(context, res, tuple));
     }
+    context->current_chunk = NULL;
     PQclear(res);
+
+    /* The frame reader holds on to fragments until the last one of a frame arrives */
+    context->fragment_worker = context->repl.frame_reader->fragment_len > 0 ? worker : NULL;
+    return err;
+}
+
+/* Commits the snapshot transactions and closes the snapshot connections, then invokes
+ * the commit callback to indicate the end of the snapshot. */
+int snapshot_finish(client_context_t context) {
+    int err = 0;
+    for (int i = 0; i < context->snapshot_connections; i++) {
+        check(err, exec_sql_conn(context, context->snapshot_workers[i].conn, "COMMIT"));
+    }
+    snapshot_disconnect(context);
+    client_sql_disconnect(context);
+
+    // Invoke the commit callback with xid==0 to indicate end of snapshot
+    commit_txn_cb on_commit = context->repl.frame_reader->on_commit_txn;
+    void *cb_context = context->repl.frame_reader->cb_context;
+    if (on_commit) {
+        check(err, on_commit(cb_context, context->repl.start_lsn, 0));
+    }
+    return 0;
+}
+
+/* Closes the connections that were opened in addition to sql_conn for a parallel
+ * snapshot. The list of chunks is kept until the client is freed, since the
+ * application may still be writing their rows. */
+void snapshot_disconnect(client_context_t context) {
+    if (context->snapshot_workers) {
+        for (int i = 1; i < context->snapshot_connections; i++) {
+            if (context->snapshot_workers[i].conn) PQfinish(context->snapshot_workers[i].conn);
+        }
+        free(context->snapshot_workers);
+        context->snapshot_workers = NULL;
+    }
+    context->fragment_worker = NULL;
+}
+
+/* Called by the application once it has durably written a row of the snapshot that it
+ * received while context->current_chunk was the given chunk (having incremented the
+ * chunk's pending_rows at the time). When all rows of an exported chunk have been
+ * written, the chunk is complete. */
+int db_client_snapshot_row_written(client_context_t context, snapshot_chunk *chunk) {
+    chunk->pending_rows--;
+    if (chunk->exported && chunk->pending_rows == 0) {
+        return snapshot_chunk_complete(context, chunk);
+    }
+    return 0;
+}
+
+/* Marks a chunk as complete, and records this in the snapshot state file (if any), so
+ * that the chunk is not exported again if the snapshot is resumed. */
+int snapshot_chunk_complete(client_context_t context, snapshot_chunk *chunk) {
+    chunk->completed = true;
+    if (!context->snapshot_state_file) return 0;
+    return snapshot_state_update(context);
+}
+
+/* Reads context->snapshot_state_file, if it exists, which means that a snapshot of the
+ * replication slot was started but did not complete. In that case, sets *resume to
+ * true, and fills in context->snapshot_chunks with the chunks that were planned, if
+ * the client got that far, and which of them were completed. The file has the format:
+ *
+ *   slot <slot name>
+ *   chunk <relid> <relfilenode> <start page> <end page> <completed (0 or 1)>
+ *   ...                                                                          */
+int snapshot_state_load(client_context_t context, bool *resume) {
+    const char *path = context->snapshot_state_file;
+    FILE *file = fopen(path, "r");
+    int err = 0;
+
+    *resume = false;
+    if (!file) {
+        if (errno == ENOENT) return 0;
+        err = errno;
+        client_error(context, "Could not open snapshot state file %s: %s", path, strerror(err));
+        return err;
+    }
+
+    char slot_name[256];
+    if (fscanf(file, "slot %255s", slot_name) != 1) {
+        client_error(context, "Snapshot state file %s is malformed", path);
+        fclose(file);
+        return EINVAL;
+    }
+    if (strcmp(slot_name, context->repl.slot_name) != 0) {
+        client_error(context, "Snapshot state file %s belongs to replication slot \"%s\", not \"%s\"",
+                path, slot_name, context->repl.slot_name);
+        fclose(file);
+        return EINVAL;
+    }
+
+    unsigned int relid, relfilenode;
+    long long start_page, end_page;
+    int completed, fields, capacity = 0;
+
+    while ((fields = fscanf(file, " chunk %u %u %lld %lld %d", &relid, &relfilenode,
+                    &start_page, &end_page, &completed)) == 5) {
+        if (context->num_snapshot_chunks == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            context->snapshot_chunks = realloc(context->snapshot_chunks, capacity * sizeof(snapshot_chunk));
+            if(context->snapshot_chunks == NULL) { fclose(file); return ENOMEM; }
+        }
+        snapshot_chunk *chunk = &context->snapshot_chunks[context->num_snapshot_chunks++];
+        chunk->relid = (Oid) relid;
+        chunk->relfilenode = (Oid) relfilenode;
+        chunk->start_page = start_page;
+        chunk->end_page = end_page;
+        chunk->exported = false;
+        chunk->completed = (completed != 0);
+        chunk->pending_rows = 0;
+    }
+
+    if (fields != EOF) {
+        client_error(context, "Snapshot state file %s is malformed", path);
+        err = EINVAL;
+    }
+    fclose(file);
+
+    *resume = (err == 0);
     return err;
 }
 
+/* Writes the replication slot name and the list of chunks, and which of them are
+ * complete, to context->snapshot_state_file. The file is written under a temporary name
+ * and renamed into place, so that a crash leaves either the old or the new state. */
+int snapshot_state_write(client_context_t context) {
+    PQExpBuffer temp_path = createPQExpBuffer();
+    appendPQExpBuffer(temp_path, "%s.tmp", context->snapshot_state_file);
+
+    int err = 0;
+    FILE *file = fopen(temp_path->data, "w");
+    if (!file) {
+        err = errno;
+        client_error(context, "Could not create snapshot state file %s: %s", temp_path->data, strerror(err));
+        destroyPQExpBuffer(temp_path);
+        return err;
+    }
+
+    fprintf(file, "slot %s\n", context->repl.slot_name);
+    for (int i = 0; i < context->num_snapshot_chunks; i++) {
+        snapshot_chunk *chunk = &context->snapshot_chunks[i];
+        fprintf(file, "chunk %u %u %lld %lld %d\n", chunk->relid, chunk->relfilenode,
+                (long long) chunk->start_page, (long long) chunk->end_page, chunk->completed ? 1 : 0);
+    }
+
+    if (fflush(file) != 0 || fsync(fileno(file)) != 0) err = errno;
+    if (fclose(file) != 0 && !err) err = errno;
+    if (!err && rename(temp_path->data, context->snapshot_state_file) != 0) err = errno;
+
+    if (err) {
+        client_error(context, "Could not write snapshot state file %s: %s",
+                context->snapshot_state_file, strerror(err));
+    }
+    destroyPQExpBuffer(temp_path);
+    return err;
+}
+
+/* Records the progress of the snapshot in context->snapshot_state_file. Once every
+ * chunk is complete, the file is removed instead, since a restart then has nothing
+ * left to resume. */
+int snapshot_state_update(client_context_t context) {
+    for (int i = 0; i < context->num_snapshot_chunks; i++) {
+        if (!context->snapshot_chunks[i].completed) return snapshot_state_write(context);
+    }
+
+    if (unlink(context->snapshot_state_file) != 0 && errno != ENOENT) {
+        int err = errno;
+        client_error(context, "Could not remove snapshot state file %s: %s",
+                context->snapshot_state_file, strerror(err));
+        return err;
+    }
+    return 0;
+}
+
 /* Processes one tuple of the snapshot query result set. */
 int snapshot_tuple(client_context_t context, PGresult *res, int row_number) {
     if (PQnfields(res) != 1) {
@@ -490,6 +1089,22 @@ int update_repl_table_entry(client_context_t context, client_context_t ctx) {
 }
 /* k4m: make active table list */
 
+/* If tables have been added to the active table list since streaming started, the
+ * server is still filtering them out, so the stream is restarted with the new list.
+ * The restart waits for the end of the current transaction, so that the frame reader
+ * never sees a partial transaction again. */
+int restart_filtered_stream(client_context_t context) {
+    int err = 0;
+    frame_reader_t reader = context->repl.frame_reader;
+
+    if (!replication_stream_filter_stale(&context->repl)) return err;
+    if (reader->in_transaction || reader->fragment_len > 0) return err;
+
+    checkRepl(err, context, replication_stream_stop(&context->repl));
+    checkRepl(err, context, replication_stream_start(&context->repl, context->error_policy));
+    return err;
+}
+
 /* Establishes one network connections to a Postgres server one for SQL
  * for a short time, and update replication table entry */
 
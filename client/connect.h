@@ -5,6 +5,24 @@
 
 #define CLIENT_CONTEXT_ERROR_LEN 512
 
+/* A table, or a range of its pages, that is exported by one snapshot query */
+typedef struct {
+    Oid relid;          /* InvalidOid = all tables */
+    Oid relfilenode;    /* Storage of the table when the chunk was planned; changed by rewrites */
+    int64_t start_page; /* First page of the range */
+    int64_t end_page;   /* Page after the last one in the range, or -1 for the end of the table */
+    bool exported;      /* The query exporting the chunk has returned all its rows */
+    bool completed;     /* All rows of the chunk have been durably written by the application */
+    int pending_rows;   /* Rows received by the application, not yet reported as written */
+} snapshot_chunk;
+
+/* A SQL connection over which part of the initial snapshot is exported */
+typedef struct {
+    PGconn *conn;
+    bool exporting;        /* A bottledwater_export query is in progress on conn */
+    snapshot_chunk *chunk; /* The chunk that the query is exporting */
+} snapshot_worker;
+
 typedef struct {
     char *conninfo, *app_name;
     char *error_policy;
@@ -14,6 +32,15 @@ typedef struct {
     bool skip_snapshot;
     bool taking_snapshot;
     bool slot_created;
+    int snapshot_connections;          /* Number of connections over which the snapshot is exported */
+    int snapshot_chunk_pages;          /* Tables larger than this are exported in chunks of this many pages */
+    char *snapshot_state_file;         /* If set, snapshot progress is recorded here, so it can be resumed */
+    snapshot_worker *snapshot_workers; /* One per snapshot connection; the first uses sql_conn */
+    snapshot_worker *fragment_worker;  /* Worker whose fragmented frame is being reassembled, if any */
+    int poll_worker;                   /* Worker that is checked first on the next poll */
+    snapshot_chunk *snapshot_chunks;   /* Tables and page ranges to export, largest tables first */
+    int num_snapshot_chunks, next_snapshot_chunk;
+    snapshot_chunk *current_chunk;     /* Chunk whose rows are being passed to the frame reader */
     int status; /* 1 = message was processed on last poll; 0 = no data available right now; -1 = stream ended */
     char error[CLIENT_CONTEXT_ERROR_LEN];
 } client_context;
@@ -26,5 +53,6 @@ void db_client_set_error_policy(client_context_t context, const char *policy);
 int db_client_start(client_context_t context);
 int db_client_poll(client_context_t context);
 int db_client_wait(client_context_t context);
+int db_client_snapshot_row_written(client_context_t context, snapshot_chunk *chunk);
 
 #endif /* CONNECT_H */
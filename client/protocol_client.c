@@ -5,6 +5,7 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <zlib.h>
 
 #define check(err, call) { err = call; if (err) return err; }
 
@@ -47,7 +48,12 @@ int process_frame_commit_txn(avro_value_t *record_val, frame_reader_t reader, ui
 int process_frame_table_schema(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos);
 int process_frame_insert(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos);
 int process_frame_update(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos);
+int process_frame_update_delta(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos);
 int process_frame_delete(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos);
+int process_frame_fragment(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos);
+int process_frame_compressed(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos);
+int parse_reassembled_frame(frame_reader_t reader, uint64_t wal_pos);
+int parse_decompressed_frame(frame_reader_t reader, uint64_t wal_pos);
 schema_list_entry *schema_list_lookup(frame_reader_t reader, int64_t relid);
 schema_list_entry *schema_list_replace(frame_reader_t reader, int64_t relid);
 schema_list_entry *schema_list_entry_new(frame_reader_t reader);
@@ -61,6 +67,49 @@ int parse_frame(frame_reader_t reader, uint64_t wal_pos, char *buf, int buflen)
     int err = 0;
     check(err, read_entirely(reader, &reader->frame_value, reader->avro_reader, buf, buflen));
     check(err, process_frame(&reader->frame_value, reader, wal_pos));
+
+    if (reader->fragments_complete) {
+        check(err, parse_reassembled_frame(reader, wal_pos));
+    }
+    if (reader->decompress_pending) {
+        check(err, parse_decompressed_frame(reader, wal_pos));
+    }
+    return err;
+}
+
+/* Called when all fragments of a frame have been received. The concatenated
+ * fragment data is parsed and processed like any other frame. */
+int parse_reassembled_frame(frame_reader_t reader, uint64_t wal_pos) {
+    int err = 0;
+    size_t len = reader->fragment_len;
+
+    reader->fragment_len = 0;
+    reader->fragments_complete = 0;
+
+    check(err, read_entirely(reader, &reader->frame_value, reader->avro_reader, reader->fragment_buf, len));
+    check(err, process_frame(&reader->frame_value, reader, wal_pos));
+
+    /* Don't hold on to the memory of an unusually large frame. */
+    free(reader->fragment_buf);
+    reader->fragment_buf = NULL;
+    reader->fragment_capacity = 0;
+    return err;
+}
+
+/* Called after a frame containing a compressed message has been processed. The
+ * decompressed data is parsed and processed like any other frame. The buffer is kept
+ * for the next compressed frame, since with compression enabled most frames are. */
+int parse_decompressed_frame(frame_reader_t reader, uint64_t wal_pos) {
+    int err = 0;
+
+    reader->decompress_pending = 0;
+    check(err, read_entirely(reader, &reader->frame_value, reader->avro_reader,
+                reader->decompress_buf, reader->decompress_len));
+    check(err, process_frame(&reader->frame_value, reader, wal_pos));
+
+    if (reader->decompress_pending) {
+        return frame_reader_handle(reader, EINVAL, "Received compressed message inside a compressed frame");
+    }
     return err;
 }
 
@@ -94,9 +143,18 @@ int process_frame(avro_value_t *frame_val, frame_reader_t reader, uint64_t wal_p
             case PROTOCOL_MSG_UPDATE:
                 check(err, process_frame_update(&record_val, reader, wal_pos));
                 break;
+            case PROTOCOL_MSG_UPDATE_DELTA:
+                check(err, process_frame_update_delta(&record_val, reader, wal_pos));
+                break;
             case PROTOCOL_MSG_DELETE:
                 check(err, process_frame_delete(&record_val, reader, wal_pos));
                 break;
+            case PROTOCOL_MSG_FRAGMENT:
+                check(err, process_frame_fragment(&record_val, reader, wal_pos));
+                break;
+            case PROTOCOL_MSG_COMPRESSED:
+                check(err, process_frame_compressed(&record_val, reader, wal_pos));
+                break;
             default:
                 return frame_reader_handle(reader, EINVAL,
                         "Unknown message type %d", msg_type);
@@ -112,6 +170,7 @@ int process_frame_begin_txn(avro_value_t *record_val, frame_reader_t reader, uin
 
     check_avro(err, reader, avro_value_get_by_index(record_val, 0, &xid_val, NULL));
     check_avro(err, reader, avro_value_get_long(&xid_val, &xid));
+    reader->in_transaction = 1;
 
     if (reader->on_begin_txn) {
         check_handle(err, reader, reader->on_begin_txn(reader->cb_context, wal_pos, (uint32_t) xid),
@@ -127,6 +186,7 @@ int process_frame_commit_txn(avro_value_t *record_val, frame_reader_t reader, ui
 
     check_avro(err, reader, avro_value_get_by_index(record_val, 0, &xid_val, NULL));
     check_avro(err, reader, avro_value_get_long(&xid_val, &xid));
+    reader->in_transaction = 0;
 
     if (reader->on_commit_txn) {
         check_handle(err, reader, reader->on_commit_txn(reader->cb_context, wal_pos, (uint32_t) xid),
@@ -271,6 +331,73 @@ int process_frame_update(avro_value_t *record_val, frame_reader_t reader, uint64
     return err;
 }
 
+/* Processes an update in which only the changed columns were sent (the output
+ * plugin's delta_updates option). The changed fields are decoded into the
+ * corresponding fields of the entry's row value, and the other fields are left as
+ * they were. */
+int process_frame_update_delta(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos) {
+    int err = 0, key_present=0;
+    avro_value_t relid_val, key_val, changed_val, fields_val, branch_val, field_val;
+    int64_t relid=0;
+    const void *key_bin = NULL, *fields_bin = NULL;
+    const uint8_t *changed = NULL;
+    size_t key_len = 0, changed_len = 0, fields_len = 0, num_fields = 0;
+
+    check_avro(err, reader, avro_value_get_by_index(record_val, 0, &relid_val,    NULL));
+    check_avro(err, reader, avro_value_get_by_index(record_val, 1, &key_val,      NULL));
+    check_avro(err, reader, avro_value_get_by_index(record_val, 2, &changed_val,  NULL));
+    check_avro(err, reader, avro_value_get_by_index(record_val, 3, &fields_val,   NULL));
+    check_avro(err, reader, avro_value_get_long(&relid_val, &relid));
+    check_avro(err, reader, avro_value_get_discriminant(&key_val, &key_present));
+    check_avro(err, reader, avro_value_get_bytes(&changed_val, (const void **) &changed, &changed_len));
+    check_avro(err, reader, avro_value_get_bytes(&fields_val, &fields_bin, &fields_len));
+
+    CHECK_ACTIVE_SCHEMA(err, reader, relid);
+
+    schema_list_entry *entry = schema_list_lookup(reader, relid);
+    if (!entry) {
+        return frame_reader_handle(reader, EINVAL,
+                "Received update for unknown relid %" PRIu64, relid);
+    }
+
+    if (!reader->on_update_delta) {
+        return frame_reader_handle(reader, EINVAL,
+                "Received update delta for relid %" PRIu64 ", but deltas are not handled", relid);
+    }
+
+    if (key_present) {
+        check_avro(err, reader, avro_value_get_current_branch(&key_val, &branch_val));
+        check_avro(err, reader, avro_value_get_bytes(&branch_val, &key_bin, &key_len));
+        check(err, read_entirely(reader, &entry->key_value, entry->avro_reader, key_bin, key_len));
+    }
+
+    check_avro(err, reader, avro_value_get_size(&entry->row_value, &num_fields));
+    if (changed_len != (num_fields + 7) / 8) {
+        return frame_reader_handle(reader, EINVAL,
+                "Update delta for relid %" PRIu64 " has a bitmap of %zu bytes, but the row has %zu fields",
+                relid, changed_len, num_fields);
+    }
+
+    avro_reader_memory_set_source(entry->avro_reader, fields_bin, fields_len);
+    for (size_t field = 0; field < num_fields; field++) {
+        if (!(changed[field / 8] & (1 << (field % 8)))) continue;
+
+        check_avro(err, reader, avro_value_get_by_index(&entry->row_value, field, &field_val, NULL));
+        check_avro(err, reader, avro_value_read(entry->avro_reader, &field_val));
+    }
+
+    if (avro_skip(entry->avro_reader, 1) != ENOSPC) {
+        return frame_reader_handle(reader, EINVAL, "Unexpected trailing bytes at the end of buffer");
+    }
+
+    check_handle(err, reader,
+            reader->on_update_delta(reader->cb_context, wal_pos, relid,
+                key_bin, key_len, key_bin ? &entry->key_value : NULL,
+                changed, changed_len, &entry->row_value),
+            "error in update_delta callback for relid %" PRIu64, relid);
+    return err;
+}
+
 int process_frame_delete(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos) {
     int err = 0, key_present=0, old_present=0;
     avro_value_t relid_val, key_val, old_val, branch_val;
@@ -316,6 +443,86 @@ int process_frame_delete(avro_value_t *record_val, frame_reader_t reader, uint64
     return err;
 }
 
+/* Appends the data of a fragment to the frame being reassembled. The buffer grows
+ * geometrically, so reassembly takes time and memory linear in the frame size. */
+int process_frame_fragment(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos) {
+    int err = 0, last = 0;
+    avro_value_t data_val, last_val;
+    const void *data = NULL;
+    size_t data_len = 0;
+
+    check_avro(err, reader, avro_value_get_by_index(record_val, 0, &data_val, NULL));
+    check_avro(err, reader, avro_value_get_by_index(record_val, 1, &last_val, NULL));
+    check_avro(err, reader, avro_value_get_bytes(&data_val, &data, &data_len));
+    check_avro(err, reader, avro_value_get_boolean(&last_val, &last));
+
+    if (reader->fragments_complete) {
+        return frame_reader_handle(reader, EINVAL, "Received fragment after the last fragment of a frame");
+    }
+
+    if (reader->fragment_len + data_len > reader->fragment_capacity) {
+        size_t capacity = reader->fragment_capacity ? reader->fragment_capacity : data_len;
+        while (capacity < reader->fragment_len + data_len) capacity *= 2;
+
+        reader->fragment_buf = realloc(reader->fragment_buf, capacity);
+        check_alloc(reader->fragment_buf);
+        reader->fragment_capacity = capacity;
+    }
+
+    memcpy(reader->fragment_buf + reader->fragment_len, data, data_len);
+    reader->fragment_len += data_len;
+    reader->fragments_complete = last;
+    return err;
+}
+
+/* Decompresses the frame contained in a compressed message into decompress_buf. It is
+ * parsed once the enclosing frame has been processed, since the frame value is still in
+ * use until then. */
+int process_frame_compressed(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos) {
+    int err = 0, codec = 0;
+    avro_value_t codec_val, length_val, data_val;
+    int64_t length = 0;
+    const void *data = NULL;
+    size_t data_len = 0;
+    uLongf decompressed_len;
+
+    check_avro(err, reader, avro_value_get_by_index(record_val, 0, &codec_val,  NULL));
+    check_avro(err, reader, avro_value_get_by_index(record_val, 1, &length_val, NULL));
+    check_avro(err, reader, avro_value_get_by_index(record_val, 2, &data_val,   NULL));
+    check_avro(err, reader, avro_value_get_int(&codec_val, &codec));
+    check_avro(err, reader, avro_value_get_long(&length_val, &length));
+    check_avro(err, reader, avro_value_get_bytes(&data_val, &data, &data_len));
+
+    if (codec != PROTOCOL_CODEC_ZLIB) {
+        return frame_reader_handle(reader, EINVAL, "Unknown compression codec %d", codec);
+    }
+    if (reader->decompress_pending) {
+        return frame_reader_handle(reader, EINVAL, "Received more than one compressed message in a frame");
+    }
+    if (length < 0) {
+        return frame_reader_handle(reader, EINVAL, "Invalid length %" PRId64 " of compressed frame", length);
+    }
+
+    if (length > reader->decompress_capacity) {
+        size_t capacity = reader->decompress_capacity ? reader->decompress_capacity : length;
+        while (capacity < length) capacity *= 2;
+
+        reader->decompress_buf = realloc(reader->decompress_buf, capacity);
+        check_alloc(reader->decompress_buf);
+        reader->decompress_capacity = capacity;
+    }
+
+    decompressed_len = length;
+    err = uncompress((Bytef *) reader->decompress_buf, &decompressed_len, data, data_len);
+    if (err != Z_OK || decompressed_len != length) {
+        return frame_reader_handle(reader, EINVAL, "Could not decompress frame (zlib error %d)", err);
+    }
+
+    reader->decompress_len = length;
+    reader->decompress_pending = 1;
+    return 0;
+}
+
 frame_reader_t frame_reader_new() {
     frame_reader_t reader = malloc(sizeof(frame_reader));
     check_alloc(reader);
@@ -393,6 +600,8 @@ void frame_reader_free(frame_reader_t reader) {
     avro_value_decref(&reader->frame_value);
     avro_value_iface_decref(reader->frame_iface);
     avro_schema_decref(reader->frame_schema);
+    free(reader->fragment_buf);
+    free(reader->decompress_buf);
 
     for (int i = 0; i < reader->num_schemas; i++) {
         schema_list_entry *entry = reader->schemas[i];
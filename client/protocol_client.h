@@ -33,6 +33,16 @@ typedef int (*update_row_cb)(void *, uint64_t, Oid,
         const void *, size_t, avro_value_t *,
         const void *, size_t, avro_value_t *);
 
+/* Parameters: context, wal_pos, relid,
+ *             key_bin, key_len, key_val,
+ *             changed, changed_len, new_val
+ * changed is a bitmap of the fields of new_val that were changed by the update (bit
+ * i % 8 of byte i / 8 is set if field i changed). Only those fields of new_val are
+ * valid; the other fields contain arbitrary values. */
+typedef int (*update_delta_cb)(void *, uint64_t, Oid,
+        const void *, size_t, avro_value_t *,
+        const uint8_t *, size_t, avro_value_t *);
+
 /* Parameters: context, wal_pos, relid,
  *             key_bin, key_len, key_val,
  *             old_bin, old_len, old_val */
@@ -79,6 +89,7 @@ typedef struct {
     table_schema_cb on_table_schema; /* Called when there is a new schema for a particular relation */
     insert_row_cb on_insert_row;     /* Called when a row is inserted into a relation */
     update_row_cb on_update_row;     /* Called when a row in a relation is updated */
+    update_delta_cb on_update_delta; /* Called when a row is updated, and only the changed columns were sent */
     delete_row_cb on_delete_row;     /* Called when a row in a relation is deleted */
     keepalive_cb on_keepalive;       /* Called when server sends a keepalive message */
     error_handler_cb on_error;       /* Called when a frame cannot be read or when a callback returns a nonzero error code */
@@ -89,6 +100,15 @@ typedef struct {
     avro_value_iface_t *frame_iface; /* Avro generic interface for the frame schema */
     avro_value_t frame_value;        /* Avro value for a frame */
     avro_reader_t avro_reader;       /* In-memory buffer reader */
+    char *fragment_buf;              /* Data of a fragmented frame, reassembled so far */
+    size_t fragment_len;             /* Number of bytes of fragment_buf in use */
+    size_t fragment_capacity;        /* Allocated size of fragment_buf */
+    int fragments_complete;          /* Set when the last fragment of a frame has been received */
+    char *decompress_buf;            /* Data of a compressed frame, after decompression */
+    size_t decompress_len;           /* Number of bytes of decompress_buf in use */
+    size_t decompress_capacity;      /* Allocated size of decompress_buf */
+    int decompress_pending;          /* Set when decompress_buf contains a frame that has not yet been parsed */
+    int in_transaction;              /* Set between the begin and commit events of a transaction */
     char error[FRAME_READER_ERROR_LEN]; /* Buffer for error messages */
 	int64_t active_schema_list[MAX_TABLE_CNT];	/* k4m: send only active schema to kafka */
     int num_active_schemas;          			/* k4m: send only active schema to kafka */
@@ -17,6 +17,8 @@
 // #define DEBUG 1
 
 int replication_stream_finish(replication_stream_t stream);
+void append_list_option(PQExpBuffer query, const char *name, int count, char **values);
+void append_string_literal(PQExpBuffer query, const char *str);
 int parse_keepalive_message(replication_stream_t stream, char *buf, int buflen);
 int parse_xlogdata_message(replication_stream_t stream, char *buf, int buflen);
 int send_checkpoint(replication_stream_t stream, int64 now);
@@ -145,11 +147,46 @@ int replication_stream_check(replication_stream_t stream) {
  * starting from position stream->start_lsn. */
 int replication_stream_start(replication_stream_t stream, const char *error_policy) {
     PQExpBuffer query = createPQExpBuffer();
-    appendPQExpBuffer(query, "START_REPLICATION SLOT \"%s\" LOGICAL %X/%X (\"error_policy\" '%s')",
+    appendPQExpBuffer(query, "START_REPLICATION SLOT \"%s\" LOGICAL %X/%X (\"error_policy\" '%s'",
             stream->slot_name,
             (uint32) (stream->start_lsn >> 32), (uint32) stream->start_lsn,
             error_policy);
 
+    if (stream->batch_bytes > 0) {
+        appendPQExpBuffer(query, ", \"batch_bytes\" '%d'", stream->batch_bytes);
+    }
+    if (stream->batch_rows > 0) {
+        appendPQExpBuffer(query, ", \"batch_rows\" '%d'", stream->batch_rows);
+    }
+    if (stream->old_values) {
+        appendPQExpBuffer(query, ", \"old_values\" '%s'", stream->old_values);
+    }
+    if (stream->delta_updates) {
+        appendPQExpBufferStr(query, ", \"delta_updates\" 'true'");
+    }
+    if (stream->unchanged_toast) {
+        appendPQExpBufferStr(query, ", \"unchanged_toast\" 'true'");
+    }
+    if (stream->compression) {
+        appendPQExpBuffer(query, ", \"compression\" '%s'", stream->compression);
+    }
+    append_list_option(query, "row_filter", stream->num_row_filters, stream->row_filters);
+    append_list_option(query, "include_columns", stream->num_include_columns, stream->include_columns);
+    append_list_option(query, "exclude_columns", stream->num_exclude_columns, stream->exclude_columns);
+
+    /* Let the server skip changes to tables that we would only discard */
+    if (stream->filter_tables) {
+        frame_reader_t reader = stream->frame_reader;
+        appendPQExpBufferStr(query, ", \"include_relids\" '");
+        for (int i = 0; i < reader->num_active_schemas; i++) {
+            appendPQExpBuffer(query, "%s%" PRId64, i > 0 ? "," : "", reader->active_schema_list[i]);
+            stream->included_relids[i] = reader->active_schema_list[i];
+        }
+        appendPQExpBufferChar(query, '\'');
+        stream->num_included_relids = reader->num_active_schemas;
+    }
+    appendPQExpBufferChar(query, ')');
+
     PGresult *res = PQexec(stream->conn, query->data);
 
     if (PQresultStatus(res) != PGRES_COPY_BOTH) {
@@ -166,6 +203,60 @@ int replication_stream_start(replication_stream_t stream, const char *error_poli
 }
 
 
+/* Stops streaming, so that it can be started again with replication_stream_start()
+ * (for example with a different table filter). Any data that the server sends until it
+ * acknowledges the end of the stream is discarded; streaming resumes after the last
+ * transaction that the frame reader processed (commit_lsn), so the server sends that
+ * data again after the restart. Resuming from fsync_lsn instead would repeat any
+ * transactions that were processed but not yet acknowledged by the application. This
+ * should only be called between transactions, as the frame reader would otherwise see
+ * the beginning of the current transaction twice. */
+int replication_stream_stop(replication_stream_t stream) {
+    char *buf = NULL;
+    int ret;
+
+    if (PQputCopyEnd(stream->conn, NULL) <= 0 || PQflush(stream->conn) != 0) {
+        repl_error(stream, "Could not end replication stream: %s", PQerrorMessage(stream->conn));
+        return EIO;
+    }
+
+    while ((ret = PQgetCopyData(stream->conn, &buf, 0)) > 0) {
+        PQfreemem(buf);
+        buf = NULL;
+    }
+
+    if (ret == -2) {
+        repl_error(stream, "Could not read from replication stream: %s", PQerrorMessage(stream->conn));
+        return EIO;
+    }
+
+    if (stream->commit_lsn > stream->start_lsn) stream->start_lsn = stream->commit_lsn;
+    return replication_stream_finish(stream);
+}
+
+
+/* Returns true if the frame reader's active list contains tables that the server was
+ * not asked to decode when streaming started, in which case the stream needs to be
+ * restarted to receive changes to those tables. Tables that were removed from the list
+ * don't require a restart, as the frame reader discards their changes anyway. */
+bool replication_stream_filter_stale(replication_stream_t stream) {
+    frame_reader_t reader = stream->frame_reader;
+    if (!stream->filter_tables) return false;
+
+    for (int i = 0; i < reader->num_active_schemas; i++) {
+        bool found = false;
+        for (int j = 0; j < stream->num_included_relids; j++) {
+            if (stream->included_relids[j] == reader->active_schema_list[i]) {
+                found = true;
+                break;
+            }
+        }
+        if (!found) return true;
+    }
+    return false;
+}
+
+
 /* Finish off after the server stopped sending us COPY data. */
 int replication_stream_finish(replication_stream_t stream) {
     PGresult *res = PQgetResult(stream->conn);
@@ -324,6 +415,12 @@ int parse_xlogdata_message(replication_stream_t stream, char *buf, int buflen) {
     int err = parse_frame(stream->frame_reader, wal_pos, buf + hdrlen, buflen - hdrlen);
     if (err) {
         repl_error(stream, "Error parsing frame data: %s", stream->frame_reader->error);
+
+    } else if (!stream->frame_reader->in_transaction && stream->frame_reader->fragment_len == 0) {
+        /* A frame that leaves the reader between transactions ends with a commit, and
+         * is sent at the end of that transaction's commit record. The server skips
+         * transactions that committed before the position at which streaming starts. */
+        stream->commit_lsn = Max(wal_pos, stream->commit_lsn);
     }
 
     stream->recvd_lsn = Max(wal_pos, stream->recvd_lsn);
@@ -369,6 +466,28 @@ int send_checkpoint(replication_stream_t stream, int64 now) {
 }
 
 
+/* Appends an output plugin option to a START_REPLICATION command once for each of
+ * the given values (the plugin accepts these options several times). */
+void append_list_option(PQExpBuffer query, const char *name, int count, char **values) {
+    for (int i = 0; i < count; i++) {
+        appendPQExpBuffer(query, ", \"%s\" ", name);
+        append_string_literal(query, values[i]);
+    }
+}
+
+
+/* Appends a string to a replication command as a quoted literal. The replication
+ * command parser understands doubled quotes, but not backslash escapes. */
+void append_string_literal(PQExpBuffer query, const char *str) {
+    appendPQExpBufferChar(query, '\'');
+    for (const char *p = str; *p; p++) {
+        if (*p == '\'') appendPQExpBufferChar(query, '\'');
+        appendPQExpBufferChar(query, *p);
+    }
+    appendPQExpBufferChar(query, '\'');
+}
+
+
 /* Updates the stream's statically allocated error buffer with a message. */
 void repl_error(replication_stream_t stream, char *fmt, ...) {
     va_list args;
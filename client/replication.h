@@ -15,6 +15,19 @@ typedef struct {
     XLogRecPtr start_lsn;
     XLogRecPtr recvd_lsn;
     XLogRecPtr fsync_lsn;
+    XLogRecPtr commit_lsn;  /* End of the last transaction that the frame reader processed completely */
+    int batch_bytes, batch_rows; /* Output plugin batching thresholds (0 = not set) */
+    const char *old_values; /* Output plugin old_values option (NULL = server default) */
+    bool delta_updates;     /* If true, updates may contain only the changed columns */
+    bool unchanged_toast;   /* If true, TOASTed values not modified by an update are sent as a marker */
+    const char *compression; /* Compression of frames, for the snapshot and stream (NULL = none) */
+    int num_row_filters, num_include_columns, num_exclude_columns;
+    char **row_filters;     /* Row filters of the form table:expression, applied by the server */
+    char **include_columns; /* Column projections of the form table:column,column,... */
+    char **exclude_columns;
+    bool filter_tables; /* If true, the server only decodes tables in frame_reader's active list */
+    int num_included_relids; /* Tables that the server was asked to decode when streaming started */
+    int64_t included_relids[MAX_TABLE_CNT];
     int64 last_checkpoint;
     frame_reader_t frame_reader;
     int status; /* 1 = message was processed on last poll; 0 = no data available right now; -1 = stream ended */
@@ -27,6 +40,8 @@ int replication_slot_create(replication_stream_t stream);
 int replication_slot_drop(replication_stream_t stream);
 int replication_stream_check(replication_stream_t stream);
 int replication_stream_start(replication_stream_t stream, const char *error_policy);
+int replication_stream_stop(replication_stream_t stream);
+bool replication_stream_filter_stale(replication_stream_t stream);
 int replication_stream_poll(replication_stream_t stream);
 int replication_stream_keepalive(replication_stream_t stream);
 
@@ -0,0 +1,28 @@
+-- Complain if script is sourced in psql, rather than via ALTER EXTENSION.
+\echo Use "ALTER EXTENSION bottledwater UPDATE TO '0.2'" to load this file. \quit
+
+-- Version 0.2 adds arguments to bottledwater_export. Since that changes the
+-- function's signature, the old function has to be dropped rather than replaced.
+DROP FUNCTION bottledwater_export(text, boolean, bottledwater_error_policy);
+
+CREATE FUNCTION bottledwater_export(
+        table_pattern text    DEFAULT '%',
+        allow_unkeyed boolean DEFAULT false,
+        error_policy bottledwater_error_policy DEFAULT 'exit',
+        -- each element has the form 'table:expression'
+        row_filters text[] DEFAULT '{}',
+        -- each element has the form 'table:column,column,...'
+        include_columns text[] DEFAULT '{}',
+        exclude_columns text[] DEFAULT '{}',
+        -- 'none' or 'zlib'
+        compression text DEFAULT 'none',
+        -- approximate size in bytes of each returned frame; 0 returns one row per frame
+        batch_bytes integer DEFAULT 65536,
+        -- if nonzero, export only the table with this oid (still subject to table_pattern)
+        relation oid DEFAULT 0,
+        -- with relation, export only the rows on pages start_page up to (but not including)
+        -- end_page; an end_page of -1 means up to the end of the table
+        start_page bigint DEFAULT 0,
+        end_page bigint DEFAULT -1
+    ) RETURNS setof bytea
+    AS 'bottledwater', 'bottledwater_export' LANGUAGE C VOLATILE STRICT;
@@ -0,0 +1,41 @@
+-- Complain if script is sourced in psql, rather than via CREATE EXTENSION.
+\echo Use "CREATE EXTENSION bottledwater" to load this file. \quit
+
+CREATE OR REPLACE FUNCTION bottledwater_key_schema(name) RETURNS text
+    AS 'bottledwater', 'bottledwater_key_schema' LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE FUNCTION bottledwater_row_schema(name) RETURNS text
+    AS 'bottledwater', 'bottledwater_row_schema' LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE FUNCTION bottledwater_frame_schema() RETURNS text
+    AS 'bottledwater', 'bottledwater_frame_schema' LANGUAGE C VOLATILE STRICT;
+
+DROP DOMAIN IF EXISTS bottledwater_error_policy;
+CREATE DOMAIN bottledwater_error_policy AS text
+    CONSTRAINT bottledwater_error_policy_valid CHECK (VALUE IN (
+        -- these values should match the constants defined in protocol.h
+        'log',
+        'exit'
+    ));
+
+CREATE OR REPLACE FUNCTION bottledwater_export(
+        table_pattern text    DEFAULT '%',
+        allow_unkeyed boolean DEFAULT false,
+        error_policy bottledwater_error_policy DEFAULT 'exit',
+        -- each element has the form 'table:expression'
+        row_filters text[] DEFAULT '{}',
+        -- each element has the form 'table:column,column,...'
+        include_columns text[] DEFAULT '{}',
+        exclude_columns text[] DEFAULT '{}',
+        -- 'none' or 'zlib'
+        compression text DEFAULT 'none',
+        -- approximate size in bytes of each returned frame; 0 returns one row per frame
+        batch_bytes integer DEFAULT 65536,
+        -- if nonzero, export only the table with this oid (still subject to table_pattern)
+        relation oid DEFAULT 0,
+        -- with relation, export only the rows on pages start_page up to (but not including)
+        -- end_page; an end_page of -1 means up to the end of the table
+        start_page bigint DEFAULT 0,
+        end_page bigint DEFAULT -1
+    ) RETURNS setof bytea
+    AS 'bottledwater', 'bottledwater_export' LANGUAGE C VOLATILE STRICT;
@@ -1,11 +1,13 @@
 #include "io_util.h"
+#include "oid2avro.h"
+
+#include "utils/memutils.h"
 
 #define INIT_BUFFER_LENGTH 16384
-#define MAX_BUFFER_LENGTH 1048576
 
 
 /* Allocates a fixed-length buffer and tries to write something to it using the Avro writer API.
- * If it doesn't fit, increases the buffer size and tries again. The actual writing operation
+ * If it doesn't fit, doubles the buffer size (up to MaxAllocSize) and tries again. The actual writing operation
  * is given as a callback; the context argument is passed to the callback. On success (return
  * value 0), output is set to a palloc'ed byte array of the right size. The VARSIZE of the
  * output array does not include a terminating null byte, but we guarantee that the following
@@ -14,7 +16,7 @@ int try_writing(bytea **output, try_writing_cb cb, void *context) {
     int size = INIT_BUFFER_LENGTH, err = ENOSPC;
     avro_writer_t writer;
 
-    while (err == ENOSPC && size <= MAX_BUFFER_LENGTH) {
+    while (err == ENOSPC) {
         *output = (bytea *) palloc(size);
         writer = avro_writer_memory(VARDATA(*output), size - VARHDRSZ);
         err = (*cb)(writer, context);
@@ -24,11 +26,13 @@ int try_writing(bytea **output, try_writing_cb cb, void *context) {
             err = avro_write(writer, "\x00", 1);
         }
 
+        avro_writer_free(writer);
+
         if (err == ENOSPC) {
-            size *= 4;
             pfree(*output);
+            if (size == MaxAllocSize) break;
+            size = Min((Size) size * 2, MaxAllocSize);
         }
-        avro_writer_free(writer);
     }
 
     return err;
@@ -39,7 +43,93 @@ int write_schema_json(avro_writer_t writer, void *context) {
     return avro_schema_to_json((avro_schema_t) context, writer);
 }
 
+/* try_writing_cb function that encodes the Avro schema of a table's rows or key as a
+ * JSON string, including logical type annotations (see table_schema_to_json()). The
+ * context must point to a table_schema_json struct. */
+int write_table_schema_json(avro_writer_t writer, void *context) {
+    table_schema_json *table = (table_schema_json *) context;
+    return table_schema_to_json(table->schema, table->tupdesc, writer);
+}
+
 /* try_writing_cb function that encodes a value using Avro binary encoding. */
 int write_avro_binary(avro_writer_t writer, void *context) {
     return avro_value_write(writer, (avro_value_t *) context);
 }
+
+
+/* Avro memory writer that is pointed at the free space of a StringInfo buffer
+ * by append_avro_value(). Allocated on first use, and reused thereafter. */
+static avro_writer_t buffer_writer = NULL;
+
+int write_avro_into_buffer(StringInfo buf, avro_value_t *value, size_t size);
+
+
+/* Appends a long (or int) to a buffer in Avro binary encoding, i.e. as a zig-zag
+ * encoded variable-length integer. */
+void append_avro_long(StringInfo buf, int64 value) {
+    uint64 n = ((uint64) value << 1) ^ (uint64) (value >> 63);
+    char bytes[10];
+    int len = 0;
+
+    while (n & ~((uint64) 0x7F)) {
+        bytes[len++] = (char) ((n & 0x7F) | 0x80);
+        n >>= 7;
+    }
+    bytes[len++] = (char) n;
+
+    appendBinaryStringInfo(buf, bytes, len);
+}
+
+/* Appends a byte array to a buffer in Avro binary encoding (its length, followed by
+ * the bytes themselves). Strings are encoded in the same way. */
+void append_avro_bytes(StringInfo buf, const char *data, int len) {
+    append_avro_long(buf, len);
+    appendBinaryStringInfo(buf, data, len);
+}
+
+/* Appends the Avro binary encoding of a value to a buffer. The encoded size is
+ * computed first, so that the buffer can be grown once and the value encoded
+ * straight into it, without an intermediate copy. */
+int append_avro_value(StringInfo buf, avro_value_t *value) {
+    int err = 0;
+    size_t size;
+
+    check(err, avro_value_sizeof(value, &size));
+    return write_avro_into_buffer(buf, value, size);
+}
+
+/* Appends a value to a buffer as an Avro "bytes" field whose content is the binary
+ * encoding of the value. This is how rows and keys are embedded in a frame. */
+int append_avro_value_bytes(StringInfo buf, avro_value_t *value) {
+    int err = 0, start = buf->len;
+    size_t size;
+
+    check(err, avro_value_sizeof(value, &size));
+    append_avro_long(buf, size);
+
+    err = write_avro_into_buffer(buf, value, size);
+    if (err) {
+        buf->len = start;
+        buf->data[start] = '\0';
+    }
+    return err;
+}
+
+/* Encodes a value, whose encoded size is already known, at the end of a buffer. */
+int write_avro_into_buffer(StringInfo buf, avro_value_t *value, size_t size) {
+    int err = 0;
+
+    if (size >= MaxAllocSize - buf->len) return ENOSPC;
+    enlargeStringInfo(buf, (int) size);
+
+    if (!buffer_writer) {
+        buffer_writer = avro_writer_memory(NULL, 0);
+        if (!buffer_writer) return ENOMEM;
+    }
+    avro_writer_memory_set_dest(buffer_writer, buf->data + buf->len, size);
+    check(err, avro_value_write(buffer_writer, value));
+
+    buf->len += size;
+    buf->data[buf->len] = '\0';
+    return err;
+}
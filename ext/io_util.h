@@ -3,6 +3,8 @@
 
 #include "avro.h"
 #include "postgres.h"
+#include "lib/stringinfo.h"
+#include "access/tupdesc.h"
 
 #define check(err, call) { err = call; if (err) return err; }
 
@@ -12,7 +14,20 @@
 typedef int (*try_writing_cb)(avro_writer_t, void *);
 
 int try_writing(bytea **output, try_writing_cb cb, void *context);
+
+/* Context for write_table_schema_json */
+typedef struct {
+    avro_schema_t schema;  /* Schema generated by schema_for_table_row() */
+    TupleDesc tupdesc;     /* Tuple descriptor of the relation from which the schema was generated */
+} table_schema_json;
+
 int write_schema_json(avro_writer_t writer, void *context);
+int write_table_schema_json(avro_writer_t writer, void *context);
 int write_avro_binary(avro_writer_t writer, void *context);
 
+void append_avro_long(StringInfo buf, int64 value);
+void append_avro_bytes(StringInfo buf, const char *data, int len);
+int append_avro_value(StringInfo buf, avro_value_t *value);
+int append_avro_value_bytes(StringInfo buf, avro_value_t *value);
+
 #endif /* IO_UTIL_H */
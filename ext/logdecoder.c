@@ -8,6 +8,10 @@
 #include "utils/builtins.h"
 #include "utils/memutils.h"
 
+/* After a batch is flushed, its buffer is kept for the next batch, unless it has grown
+ * to more than this (or twice batch_bytes, if larger), e.g. because of one huge row. */
+#define MAX_RETAINED_BATCH_BYTES 65536
+
 /* Entry point when Postgres loads the plugin */
 extern void _PG_init(void);
 extern void _PG_output_plugin_init(OutputPluginCallbacks *cb);
@@ -20,15 +24,34 @@ static void output_avro_change(LogicalDecodingContext *ctx, ReorderBufferTXN *tx
 
 typedef struct {
     MemoryContext memctx; /* reset after every change event, to prevent leaks */
-    avro_schema_t frame_schema;
-    avro_value_iface_t *frame_iface;
-    avro_value_t frame_value;
     schema_cache_t schema_cache;
     error_policy_t error_policy;
+    old_values_t old_values;  /* how much of the old row to send with updates and deletes */
+    bool delta_updates;   /* send only the changed columns of updated rows, where possible */
+    int compression;      /* codec with which frames are compressed (PROTOCOL_CODEC_*) */
+    bool txn_started;     /* true once the begin message of the current transaction has been sent */
+    int frame_start;      /* offset in ctx->out at which the current frame begins */
+    int batch_bytes;      /* if nonzero, flush a batch of messages once it reaches this size */
+    int batch_rows;       /* if nonzero, flush a batch of messages once it has this many rows */
+    int batched_rows;     /* number of row changes in the current batch */
+    StringInfoData batch; /* messages that have not yet been sent (only used when batching) */
+    bool include_all;     /* if false, only tables in include_relids are decoded */
+    int num_include_relids, num_exclude_relids;
+    Oid *include_relids;  /* sorted array of tables to decode (if include_all is false) */
+    Oid *exclude_relids;  /* sorted array of tables not to decode */
 } plugin_state;
 
-void reset_frame(plugin_state *state);
-int write_frame(LogicalDecodingContext *ctx, plugin_state *state);
+int parse_batch_option(DefElem *elem);
+old_values_t parse_old_values_option(DefElem *elem);
+bool parse_bool_option(DefElem *elem);
+int parse_relids_option(DefElem *elem, Oid **relids_out);
+int relid_cmp(const void *a, const void *b);
+bool table_is_filtered(plugin_state *state, Oid relid);
+StringInfo start_frame(LogicalDecodingContext *ctx);
+void end_frame(LogicalDecodingContext *ctx, bool end_of_txn);
+void flush_batch(LogicalDecodingContext *ctx);
+void write_frame(LogicalDecodingContext *ctx);
+void write_frame_fragments(LogicalDecodingContext *ctx);
 
 
 void _PG_init() {
@@ -54,10 +77,19 @@ static void output_avro_startup(LogicalDecodingContext *ctx, OutputPluginOptions
     state->memctx = AllocSetContextCreate(ctx->context, "Avro decoder context",
             ALLOCSET_DEFAULT_MINSIZE, ALLOCSET_DEFAULT_INITSIZE, ALLOCSET_DEFAULT_MAXSIZE);
 
-    state->frame_schema = schema_for_frame();
-    state->frame_iface = avro_generic_class_from_schema(state->frame_schema);
-    avro_generic_value_new(state->frame_iface, &state->frame_value);
     state->schema_cache = schema_cache_new(ctx->context);
+    state->batch_bytes = 0;
+    state->batch_rows = 0;
+    state->batched_rows = 0;
+    state->old_values = OLD_VALUES_FULL;
+    state->delta_updates = false;
+    state->compression = PROTOCOL_CODEC_NONE;
+    state->txn_started = false;
+    state->include_all = true;
+    state->num_include_relids = 0;
+    state->num_exclude_relids = 0;
+    state->include_relids = NULL;
+    state->exclude_relids = NULL;
 
     foreach(option, ctx->output_plugin_options) {
         DefElem *elem = lfirst(option);
@@ -71,6 +103,46 @@ static void output_avro_startup(LogicalDecodingContext *ctx, OutputPluginOptions
             } else {
                 state->error_policy = parse_error_policy(strVal(elem->arg));
             }
+        } else if (strcmp(elem->defname, "batch_bytes") == 0) {
+            state->batch_bytes = parse_batch_option(elem);
+        } else if (strcmp(elem->defname, "batch_rows") == 0) {
+            state->batch_rows = parse_batch_option(elem);
+        } else if (strcmp(elem->defname, "old_values") == 0) {
+            state->old_values = parse_old_values_option(elem);
+        } else if (strcmp(elem->defname, "delta_updates") == 0) {
+            state->delta_updates = parse_bool_option(elem);
+        } else if (strcmp(elem->defname, "compression") == 0) {
+            if (elem->arg == NULL) {
+                ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                        errmsg("No value specified for parameter \"%s\"",
+                            elem->defname)));
+            }
+            state->compression = parse_compression(strVal(elem->arg));
+        } else if (strcmp(elem->defname, "unchanged_toast") == 0) {
+            state->schema_cache->unchanged_toast = parse_bool_option(elem);
+        } else if (strcmp(elem->defname, "include_relids") == 0) {
+            state->include_all = false;
+            state->num_include_relids = parse_relids_option(elem, &state->include_relids);
+        } else if (strcmp(elem->defname, "exclude_relids") == 0) {
+            state->num_exclude_relids = parse_relids_option(elem, &state->exclude_relids);
+        } else if (strcmp(elem->defname, "row_filter") == 0) {
+            /* May be given several times, once for each table whose rows are filtered */
+            if (elem->arg == NULL) {
+                ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                        errmsg("No value specified for parameter \"%s\"",
+                            elem->defname)));
+            }
+            schema_cache_add_row_filter(state->schema_cache, strVal(elem->arg));
+        } else if (strcmp(elem->defname, "include_columns") == 0 ||
+                strcmp(elem->defname, "exclude_columns") == 0) {
+            /* Likewise, once for each table whose columns are projected */
+            if (elem->arg == NULL) {
+                ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                        errmsg("No value specified for parameter \"%s\"",
+                            elem->defname)));
+            }
+            schema_cache_add_projection(state->schema_cache, strVal(elem->arg),
+                    strcmp(elem->defname, "include_columns") == 0);
         } else {
             ereport(INFO, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
                     errmsg("Parameter \"%s\" = \"%s\" is unknown",
@@ -78,6 +150,118 @@ static void output_avro_startup(LogicalDecodingContext *ctx, OutputPluginOptions
                         elem->arg ? strVal(elem->arg) : "(null)")));
         }
     }
+
+    if (state->batch_bytes || state->batch_rows) {
+        /* The batch outlives the per-event memory context. */
+        MemoryContext oldctx = MemoryContextSwitchTo(ctx->context);
+        initStringInfo(&state->batch);
+        MemoryContextSwitchTo(oldctx);
+    }
+}
+
+/* Parses the value of the batch_bytes or batch_rows option, which must be a
+ * non-negative integer (zero disables the threshold). */
+int parse_batch_option(DefElem *elem) {
+    int value;
+
+    if (elem->arg == NULL) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("No value specified for parameter \"%s\"",
+                    elem->defname)));
+    }
+
+    value = pg_atoi(strVal(elem->arg), sizeof(int32), 0);
+    if (value < 0) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("Parameter \"%s\" must not be negative", elem->defname)));
+    }
+    return value;
+}
+
+/* Parses the value of a boolean option. As for the standard test_decoding plugin,
+ * an option given without a value is taken to be true. */
+bool parse_bool_option(DefElem *elem) {
+    bool value;
+
+    if (elem->arg == NULL) return true;
+
+    if (!parse_bool(strVal(elem->arg), &value)) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("Could not parse value \"%s\" for parameter \"%s\"",
+                    strVal(elem->arg), elem->defname)));
+    }
+    return value;
+}
+
+/* Parses the value of the old_values option (see PROTOCOL_OLD_VALUES_* in protocol.h). */
+old_values_t parse_old_values_option(DefElem *elem) {
+    if (elem->arg == NULL) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("No value specified for parameter \"%s\"",
+                    elem->defname)));
+    }
+
+    if (strcmp(strVal(elem->arg), PROTOCOL_OLD_VALUES_FULL) == 0) {
+        return OLD_VALUES_FULL;
+    } else if (strcmp(strVal(elem->arg), PROTOCOL_OLD_VALUES_KEY) == 0) {
+        return OLD_VALUES_KEY;
+    }
+
+    ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+            errmsg("Parameter \"%s\" must be %s or %s", elem->defname,
+                PROTOCOL_OLD_VALUES_FULL, PROTOCOL_OLD_VALUES_KEY)));
+    return OLD_VALUES_FULL;
+}
+
+/* Parses the value of the include_relids or exclude_relids option, which is a
+ * comma-separated list of table OIDs (possibly empty). Sets *relids_out to a sorted
+ * array of the OIDs, allocated in the current memory context, and returns its length. */
+int parse_relids_option(DefElem *elem, Oid **relids_out) {
+    List *items;
+    ListCell *item;
+    char *value;
+    int count = 0;
+
+    if (elem->arg == NULL) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("No value specified for parameter \"%s\"",
+                    elem->defname)));
+    }
+
+    value = pstrdup(strVal(elem->arg));
+    if (!SplitIdentifierString(value, ',', &items)) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("Parameter \"%s\" must be a comma-separated list of OIDs",
+                    elem->defname)));
+    }
+
+    *relids_out = palloc(Max(list_length(items), 1) * sizeof(Oid));
+    foreach(item, items) {
+        (*relids_out)[count++] = DatumGetObjectId(
+                DirectFunctionCall1(oidin, CStringGetDatum((char *) lfirst(item))));
+    }
+    qsort(*relids_out, count, sizeof(Oid), relid_cmp);
+
+    list_free(items);
+    pfree(value);
+    return count;
+}
+
+int relid_cmp(const void *a, const void *b) {
+    Oid left = *(const Oid *) a, right = *(const Oid *) b;
+    return (left < right) ? -1 : (left > right) ? 1 : 0;
+}
+
+/* Returns true if changes to the given table should not be decoded, according to the
+ * include_relids and exclude_relids options. This is checked before the schema cache
+ * lookup, so filtered tables cost neither encoding nor schema generation. */
+bool table_is_filtered(plugin_state *state, Oid relid) {
+    if (!state->include_all &&
+            !bsearch(&relid, state->include_relids, state->num_include_relids, sizeof(Oid), relid_cmp)) {
+        return true;
+    }
+    return state->num_exclude_relids > 0 &&
+        bsearch(&relid, state->exclude_relids, state->num_exclude_relids, sizeof(Oid), relid_cmp) != NULL;
 }
 
 static void output_avro_shutdown(LogicalDecodingContext *ctx) {
@@ -85,39 +269,37 @@ static void output_avro_shutdown(LogicalDecodingContext *ctx) {
     MemoryContextDelete(state->memctx);
 
     schema_cache_free(state->schema_cache);
-    avro_value_decref(&state->frame_value);
-    avro_value_iface_decref(state->frame_iface);
-    avro_schema_decref(state->frame_schema);
 }
 
+/* The begin message is deferred until the transaction's first change is sent (see
+ * output_avro_change), so that transactions in which nothing is sent to the client
+ * (e.g. because they only touched filtered tables or the catalogs) are omitted from
+ * the stream altogether. */
 static void output_avro_begin_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn) {
     plugin_state *state = ctx->output_plugin_private;
-    MemoryContext oldctx = MemoryContextSwitchTo(state->memctx);
-    reset_frame(state);
-
-    if (update_frame_with_begin_txn(&state->frame_value, txn)) {
-        elog(ERROR, "output_avro_begin_txn: Avro conversion failed: %s", avro_strerror());
-    }
-    if (write_frame(ctx, state)) {
-        elog(ERROR, "output_avro_begin_txn: writing Avro binary failed: %s", avro_strerror());
-    }
-
-    MemoryContextSwitchTo(oldctx);
-    MemoryContextReset(state->memctx);
+    state->txn_started = false;
 }
 
+/* Sends the commit message, unless the transaction was omitted. The client still
+ * confirms the position of an omitted transaction: when the client's confirmed
+ * position lags behind what has been decoded, the walsender sends a keepalive, which
+ * the client acknowledges once it has no transactions pending. */
 static void output_avro_commit_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
         XLogRecPtr commit_lsn) {
     plugin_state *state = ctx->output_plugin_private;
-    MemoryContext oldctx = MemoryContextSwitchTo(state->memctx);
-    reset_frame(state);
+    MemoryContext oldctx;
+    StringInfo frame;
+
+    if (!state->txn_started) return;
+    state->txn_started = false;
 
-    if (update_frame_with_commit_txn(&state->frame_value, txn, commit_lsn)) {
+    oldctx = MemoryContextSwitchTo(state->memctx);
+    frame = start_frame(ctx);
+
+    if (update_frame_with_commit_txn(frame, txn, commit_lsn)) {
         elog(ERROR, "output_avro_commit_txn: Avro conversion failed: %s", avro_strerror());
     }
-    if (write_frame(ctx, state)) {
-        elog(ERROR, "output_avro_commit_txn: writing Avro binary failed: %s", avro_strerror());
-    }
+    end_frame(ctx, true);
 
     MemoryContextSwitchTo(oldctx);
     MemoryContextReset(state->memctx);
@@ -128,8 +310,22 @@ static void output_avro_change(LogicalDecodingContext *ctx, ReorderBufferTXN *tx
     int err = 0;
     HeapTuple oldtuple = NULL, newtuple = NULL;
     plugin_state *state = ctx->output_plugin_private;
-    MemoryContext oldctx = MemoryContextSwitchTo(state->memctx);
-    reset_frame(state);
+    MemoryContext oldctx;
+    StringInfo frame;
+    int frame_len, change_len;
+
+    if (table_is_filtered(state, RelationGetRelid(rel))) return;
+
+    oldctx = MemoryContextSwitchTo(state->memctx);
+    frame = start_frame(ctx);
+    frame_len = frame->len;
+
+    /* The begin message is written speculatively, and discarded below if this change
+     * turns out not to produce anything. */
+    if (!state->txn_started && update_frame_with_begin_txn(frame, txn)) {
+        elog(ERROR, "output_avro_change: Avro conversion failed: %s", avro_strerror());
+    }
+    change_len = frame->len;
 
     switch (change->action) {
         case REORDER_BUFFER_CHANGE_INSERT:
@@ -137,7 +333,7 @@ static void output_avro_change(LogicalDecodingContext *ctx, ReorderBufferTXN *tx
                 elog(ERROR, "output_avro_change: insert action without a tuple");
             }
             newtuple = &change->data.tp.newtuple->tuple;
-            err = update_frame_with_insert(&state->frame_value, state->schema_cache, rel,
+            err = update_frame_with_insert(frame, state->schema_cache, rel,
                     RelationGetDescr(rel), newtuple);
             break;
 
@@ -149,14 +345,16 @@ static void output_avro_change(LogicalDecodingContext *ctx, ReorderBufferTXN *tx
                 oldtuple = &change->data.tp.oldtuple->tuple;
             }
             newtuple = &change->data.tp.newtuple->tuple;
-            err = update_frame_with_update(&state->frame_value, state->schema_cache, rel, oldtuple, newtuple);
+            err = update_frame_with_update(frame, state->schema_cache, rel, oldtuple, newtuple,
+                    state->old_values, state->delta_updates);
             break;
 
         case REORDER_BUFFER_CHANGE_DELETE:
             if (change->data.tp.oldtuple) {
                 oldtuple = &change->data.tp.oldtuple->tuple;
             }
-            err = update_frame_with_delete(&state->frame_value, state->schema_cache, rel, oldtuple);
+            err = update_frame_with_delete(frame, state->schema_cache, rel, oldtuple,
+                    state->old_values);
             break;
 
         default:
@@ -171,30 +369,118 @@ static void output_avro_change(LogicalDecodingContext *ctx, ReorderBufferTXN *tx
          * failed (so potentially it'll be an empty frame)
          */
     }
-    if (write_frame(ctx, state)) {
-        error_policy_handle(state->error_policy, "output_avro_change: writing Avro binary failed", avro_strerror());
+
+    /* If the row was rejected by the table's row filter, there is nothing to send.
+     * The write prepared by start_frame (if any) is simply abandoned, along with any
+     * begin message we wrote. */
+    if (err || frame->len > change_len) {
+        state->txn_started = true;
+        state->batched_rows++;
+        end_frame(ctx, false);
+    } else {
+        truncate_frame(frame, frame_len);
     }
 
     MemoryContextSwitchTo(oldctx);
     MemoryContextReset(state->memctx);
 }
 
-void reset_frame(plugin_state *state) {
-    if (avro_value_reset(&state->frame_value)) {
-        elog(ERROR, "Avro value reset failed: %s", avro_strerror());
-    }
+/* Returns the buffer into which the messages for a change event should be encoded
+ * by the update_frame_with_* functions. Normally that is ctx->out, prepared for a new
+ * frame. When batching, messages are instead appended to the current batch, and are
+ * copied to ctx->out in one frame when the batch is flushed. */
+StringInfo start_frame(LogicalDecodingContext *ctx) {
+    plugin_state *state = ctx->output_plugin_private;
+    if (state->batch_bytes || state->batch_rows) return &state->batch;
+
+    OutputPluginPrepareWrite(ctx, true);
+
+    /* When streaming, ctx->out now contains a header written by the walsender. */
+    state->frame_start = ctx->out->len;
+    return ctx->out;
 }
 
-int write_frame(LogicalDecodingContext *ctx, plugin_state *state) {
-    int err = 0;
-    bytea *output = NULL;
+/* Called after the messages for a change event have been encoded. Sends the frame,
+ * unless we are batching and the batch is not yet full. A batch is always flushed at
+ * the end of a transaction, so that the client sees each commit without delay. */
+void end_frame(LogicalDecodingContext *ctx, bool end_of_txn) {
+    plugin_state *state = ctx->output_plugin_private;
 
-    check(err, try_writing(&output, &write_avro_binary, &state->frame_value));
+    if (!state->batch_bytes && !state->batch_rows) {
+        write_frame(ctx);
+    } else if (end_of_txn ||
+            (state->batch_bytes && state->batch.len >= state->batch_bytes) ||
+            (state->batch_rows && state->batched_rows >= state->batch_rows)) {
+        flush_batch(ctx);
+    }
+}
+
+/* Sends all messages in the current batch to the client as one frame. */
+void flush_batch(LogicalDecodingContext *ctx) {
+    plugin_state *state = ctx->output_plugin_private;
 
     OutputPluginPrepareWrite(ctx, true);
-    appendBinaryStringInfo(ctx->out, VARDATA(output), VARSIZE(output) - VARHDRSZ);
-    OutputPluginWrite(ctx, true);
+    state->frame_start = ctx->out->len;
+    appendBinaryStringInfo(ctx->out, state->batch.data, state->batch.len);
+    write_frame(ctx);
+
+    if (state->batch.maxlen > Max(MAX_RETAINED_BATCH_BYTES, 2 * state->batch_bytes)) {
+        /* Don't hold on to the memory of an unusually large batch for the life of the
+         * walsender. The batch outlives the per-event memory context. */
+        MemoryContext oldctx = MemoryContextSwitchTo(ctx->context);
+        pfree(state->batch.data);
+        initStringInfo(&state->batch);
+        MemoryContextSwitchTo(oldctx);
+    } else {
+        resetStringInfo(&state->batch);
+    }
+    state->batched_rows = 0;
+}
+
+/* Terminates the frame in ctx->out, compresses it if enabled, and sends it to the
+ * client. A frame that is still too large after compression is sent in fragments. */
+void write_frame(LogicalDecodingContext *ctx) {
+    plugin_state *state = ctx->output_plugin_private;
+    close_frame(ctx->out);
+    compress_frame(ctx->out, state->frame_start, state->compression);
+
+    if (ctx->out->len - state->frame_start > PROTOCOL_MAX_FRAGMENT_LENGTH) {
+        write_frame_fragments(ctx);
+    } else {
+        OutputPluginWrite(ctx, true);
+    }
+}
+
+/* Sends the oversized frame in ctx->out to the client as a sequence of fragments,
+ * each of which is a separate write. The frame's buffer is detached from ctx->out,
+ * so that the walsender only ever needs to copy one fragment at a time. */
+void write_frame_fragments(LogicalDecodingContext *ctx) {
+    plugin_state *state = ctx->output_plugin_private;
+    StringInfoData whole = *ctx->out;
+    MemoryContext oldctx;
+    int offset = state->frame_start;
+    bool last = false;
+
+    /* ctx->out must remain valid after this change event, so it is reallocated in
+     * the decoding context rather than our per-event memory context. */
+    oldctx = MemoryContextSwitchTo(ctx->context);
+    initStringInfo(ctx->out);
+    MemoryContextSwitchTo(oldctx);
+
+    /* The first write was already prepared in start_frame, so keep its header. */
+    appendBinaryStringInfo(ctx->out, whole.data, state->frame_start);
+
+    while (!last) {
+        int len = Min(whole.len - offset, PROTOCOL_MAX_FRAGMENT_LENGTH);
+        last = (offset + len == whole.len);
+
+        if (offset > state->frame_start) OutputPluginPrepareWrite(ctx, last);
+        update_frame_with_fragment(ctx->out, whole.data + offset, len, last);
+        close_frame(ctx->out);
+        OutputPluginWrite(ctx, last);
+
+        offset += len;
+    }
 
-    pfree(output);
-    return err;
+    pfree(whole.data);
 }
@@ -6,20 +6,40 @@
 #include "access/sysattr.h"
 #include "catalog/heap.h"
 #include "catalog/pg_class.h"
+#include "catalog/pg_enum.h"
 #include "catalog/pg_type.h"
 #include "lib/stringinfo.h"
+#include "libpq/pqformat.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/cash.h"
+#include "utils/catcache.h"
 #include "utils/date.h"
 #include "utils/datetime.h"
+#include "utils/inet.h"
 #include "utils/lsyscache.h"
 #include "utils/numeric.h"
+#include "utils/syscache.h"
 #include "utils/timestamp.h"
+#include "utils/typcache.h"
+#include "utils/uuid.h"
+
+/* NUMERIC values are translated into Avro decimals from the binary format produced by
+ * numeric_send(), which (unlike the on-disk layout, which is private to numeric.c) is
+ * part of the client protocol: ndigits, weight, sign and dscale as 16-bit integers,
+ * followed by ndigits base-10000 digits, most significant first. */
+#define NBASE       10000
+#define DEC_DIGITS  4
+#define NUMERIC_NEG 0x4000
+#define NUMERIC_NAN 0xC000
 
 #ifndef HAVE_INT64_TIMESTAMP
 #error Expecting timestamps to be represented as integers, not as floating-point.
 #endif
 
+/* Index of the union branch for decimal and array values that are encoded as strings */
+#define STRING_BRANCH 2
+
 typedef struct {
     avro_schema_t date_schema;         /* Predefined data type for "date" */
     avro_schema_t time_tz_schema;      /* Predefined data type for "time with time zone" */
@@ -27,10 +47,27 @@ typedef struct {
     avro_schema_t datetime_tz_schema;  /* Predefined data type for "timestamp with time zone" */
     avro_schema_t interval_schema;     /* Predefined data type for "interval" */
     avro_schema_t special_time_schema; /* Predefined data type for enum of +infinity, -infinity */
+    avro_schema_t uuid_schema;         /* Predefined data type for "uuid" */
+    avro_schema_t unchanged_schema;    /* Predefined marker for an unchanged TOASTed value */
+    List *named_schemas;               /* Schemas generated for user-defined enum and composite types (named_schema) */
+    int err;                           /* Nonzero if a type could not be given a valid schema (see avro_strerror) */
 } predef_schema;
 
-avro_schema_t schema_for_oid(predef_schema *predef, Oid typid);
-avro_schema_t schema_for_numeric(predef_schema *predef);
+typedef struct {
+    Oid typid;                         /* OID of a user-defined enum or composite type */
+    avro_schema_t schema;              /* Avro enum or record schema generated for that type */
+} named_schema;
+
+typedef struct {
+    Oid oid;                           /* OID of the enum value (as stored in a column) */
+    float4 sortorder;                  /* Position of the value in the enum's ordering */
+    char *label;                       /* Textual label of the value */
+} enum_label;
+
+avro_schema_t schema_for_oid(predef_schema *predef, Oid typid, int32 typmod);
+avro_schema_t schema_for_numeric(predef_schema *predef, int32 typmod);
+bool numeric_is_decimal(Oid typid, int32 typmod);
+int write_json(avro_writer_t writer, const char *str);
 avro_schema_t schema_for_date(predef_schema *predef);
 avro_schema_t schema_for_time_tz(predef_schema *predef);
 //avro_schema_t schema_for_timestamp(predef_schema *predef, bool with_tz);
@@ -38,15 +75,62 @@ avro_schema_t schema_for_interval(predef_schema *predef);
 void schema_for_date_fields(avro_schema_t record_schema);
 void schema_for_time_fields(avro_schema_t record_schema);
 avro_schema_t schema_for_special_times(predef_schema *predef, avro_schema_t record_schema);
-
-int update_avro_with_datum(avro_value_t *output_val, Oid typid, Datum pg_datum);
+avro_schema_t schema_for_other(predef_schema *predef, Oid typid, int32 typmod);
+avro_schema_t schema_for_array(predef_schema *predef, Oid elemtype, int32 typmod);
+avro_schema_t schema_for_uuid(predef_schema *predef);
+avro_schema_t schema_for_unchanged_toast(predef_schema *predef);
+avro_schema_t schema_for_enum(predef_schema *predef, Oid typid);
+avro_schema_t schema_for_composite(predef_schema *predef, Oid typid);
+void type_avro_names(Oid typid, char **name_out, char **namespace_out);
+avro_schema_t named_schema_link(predef_schema *predef, Oid typid);
+void named_schema_add(predef_schema *predef, Oid typid, avro_schema_t schema);
+enum_label *enum_labels_for_type(Oid typid, int *count_out);
+int enum_label_cmp(const void *a, const void *b);
+int type_schema_to_json(avro_schema_t union_schema, Oid typid, int32 typmod, avro_writer_t writer);
+int write_decimal_json(avro_writer_t writer, int32 typmod);
+int write_union_end_json(avro_schema_t union_schema, avro_writer_t writer);
+
+column_encoder_fn encoder_for_oid(Oid typid, int32 typmod, bool *handles_union);
+void column_encoder_init(column_encoder *column, Oid typid, int32 typmod);
+void column_encoder_free(column_encoder *column);
+bool column_encoder_changed(column_encoder *column);
+void column_encoder_type_relids(column_encoder *column, List **relids);
+int encode_bool(avro_value_t *output_val, column_encoder *column, Datum datum);
+int encode_float4(avro_value_t *output_val, column_encoder *column, Datum datum);
+int encode_float8(avro_value_t *output_val, column_encoder *column, Datum datum);
+int encode_int2(avro_value_t *output_val, column_encoder *column, Datum datum);
+int encode_int4(avro_value_t *output_val, column_encoder *column, Datum datum);
+int encode_int8(avro_value_t *output_val, column_encoder *column, Datum datum);
+int encode_cash(avro_value_t *output_val, column_encoder *column, Datum datum);
+int encode_oid(avro_value_t *output_val, column_encoder *column, Datum datum);
+int encode_xid(avro_value_t *output_val, column_encoder *column, Datum datum);
+int encode_cid(avro_value_t *output_val, column_encoder *column, Datum datum);
+int encode_numeric(avro_value_t *output_val, column_encoder *column, Datum datum);
+int encode_decimal(avro_value_t *union_val, column_encoder *column, Datum datum);
+int encode_date(avro_value_t *output_val, column_encoder *column, Datum datum);
+int encode_time(avro_value_t *output_val, column_encoder *column, Datum datum);
+int encode_time_tz(avro_value_t *output_val, column_encoder *column, Datum datum);
+int encode_timestamp(avro_value_t *output_val, column_encoder *column, Datum datum);
+int encode_timestamp_tz(avro_value_t *output_val, column_encoder *column, Datum datum);
+int encode_interval(avro_value_t *output_val, column_encoder *column, Datum datum);
+int encode_bytea(avro_value_t *output_val, column_encoder *column, Datum datum);
+int encode_char(avro_value_t *output_val, column_encoder *column, Datum datum);
+int encode_name(avro_value_t *output_val, column_encoder *column, Datum datum);
+int encode_text(avro_value_t *output_val, column_encoder *column, Datum datum);
+int encode_uuid(avro_value_t *output_val, column_encoder *column, Datum datum);
+int encode_inet(avro_value_t *output_val, column_encoder *column, Datum datum);
+int encode_enum(avro_value_t *output_val, column_encoder *column, Datum datum);
+int encode_array(avro_value_t *union_val, column_encoder *column, Datum datum);
+int encode_composite(avro_value_t *output_val, column_encoder *column, Datum datum);
+int encode_other(avro_value_t *output_val, column_encoder *column, Datum datum);
 int update_avro_with_date(avro_value_t *union_val, DateADT date);
 int update_avro_with_time_tz(avro_value_t *record_val, TimeTzADT *timevalue);
 //int update_avro_with_timestamp(avro_value_t *union_val, bool with_tz, Timestamp timestamp);
 int update_avro_with_interval(avro_value_t *record_val, Interval *interval);
 int update_avro_with_bytes(avro_value_t *output_val, bytea *bytes);
+int update_avro_with_text(avro_value_t *output_val, text *str);
 int update_avro_with_char(avro_value_t *output_val, char c);
-int update_avro_with_string(avro_value_t *output_val, Oid typid, Datum pg_datum);
+int update_avro_with_string(avro_value_t *output_val, FmgrInfo *output_func, bool is_varlena, Datum pg_datum);
 
 
 static char *make_avro_safe(const char *raw, bool is_namespace);
@@ -107,7 +191,7 @@ int schema_for_table_key(Relation rel, avro_schema_t *schema_out) {
         return 0;
     }
 
-    err = schema_for_table_row(index_rel, schema_out);
+    err = schema_for_table_row(index_rel, NULL, false, schema_out);
 
     relation_close(index_rel, AccessShareLock);
     return err;
@@ -115,18 +199,24 @@ int schema_for_table_key(Relation rel, avro_schema_t *schema_out) {
 
 
 /* Generates an Avro schema corresponding to a given table (relation) and sets
- * *schema_out to point to it.
+ * *schema_out to point to it. The record has a field for each column in tupdesc that
+ * is not marked as dropped; a column projection is applied by passing a copy of the
+ * table's tuple descriptor in which the omitted columns are marked as dropped. If
+ * tupdesc is NULL, all columns of the table are included.
+ *
+ * If unchanged_toast is true, the schema of each column that may be stored out of
+ * line (see column_is_toastable()) gets an extra union branch, which is used in
+ * place of the value when an update did not modify it (see tuple_to_avro_field()).
  *
  * Returns 0 if successful, nonzero if an error occurred generating the schema.
  * If the table is unkeyed, sets *schema_out to NULL and returns 0. */
-int schema_for_table_row(Relation rel, avro_schema_t *schema_out) {
+int schema_for_table_row(Relation rel, TupleDesc tupdesc, bool unchanged_toast, avro_schema_t *schema_out) {
     char *rel_namespace, *relname, *relname_avro_safe, *rel_namespace_avro_safe;
     char *attname_avro_safe;
     StringInfoData namespace;
-    avro_schema_t record_schema, column_schema;
-    TupleDesc tupdesc;
+    avro_schema_t record_schema, column_schema, marker_schema;
     predef_schema predef;
-    int err = 0;
+    int err = 0, num_columns = 0;
 
     memset(&predef, 0, sizeof(predef_schema));
     initStringInfo(&namespace);
@@ -148,12 +238,17 @@ int schema_for_table_row(Relation rel, avro_schema_t *schema_out) {
         return EINVAL;
     }
 
-    tupdesc = RelationGetDescr(rel);
+    if (!tupdesc) tupdesc = RelationGetDescr(rel);
+
+    for (int i = 0; i < tupdesc->natts; i++) {
+        if (!tupdesc->attrs[i]->attisdropped) num_columns++;
+    }
 
-    if (tupdesc->natts == 0) {
+    if (num_columns == 0) {
         /* Special case for table schemas with no columns.  (You can create
          * such a table via `CREATE TABLE no_columns ()`, but more likely you'd
-         * get there by dropping all the columns from an existing table.)
+         * get there by dropping all the columns from an existing table, or by
+         * excluding all of them from the projection.)
          *
          * We need to special-case this because avro-c doesn't seem to like
          * record schemas with no fields. */
@@ -167,7 +262,13 @@ int schema_for_table_row(Relation rel, avro_schema_t *schema_out) {
         if (attr->attisdropped) continue; /* skip dropped columns */
 
         attname_avro_safe = make_avro_safe(NameStr(attr->attname), false);
-        column_schema = schema_for_oid(&predef, attr->atttypid);
+        column_schema = schema_for_oid(&predef, attr->atttypid, attr->atttypmod);
+
+        if (unchanged_toast && column_is_toastable(attr)) {
+            marker_schema = schema_for_unchanged_toast(&predef);
+            avro_schema_union_append(column_schema, marker_schema);
+            avro_schema_decref(marker_schema);
+        }
 
         err = avro_schema_record_field_append(record_schema, attname_avro_safe, column_schema);
 
@@ -177,94 +278,358 @@ int schema_for_table_row(Relation rel, avro_schema_t *schema_out) {
         if (err) break;
     }
 
+    list_free_deep(predef.named_schemas);
     *schema_out = record_schema;
-    return err;
+    return err ? err : predef.err;
 }
 
 
-/* Translates a Postgres heap tuple (one row of a table) into the Avro schema generated
- * by schema_for_table_row(). */
-int tuple_to_avro_row(avro_value_t *output_val, TupleDesc tupdesc, HeapTuple tuple) {
-    int err = 0, field = 0;
-    check(err, avro_value_reset(output_val));
-
+/* Compiles a plan for translating rows of a table with the given tuple descriptor into
+ * Avro. If attnums is NULL, the plan covers all non-dropped columns, matching the schema
+ * generated by schema_for_table_row(). Otherwise it covers the natts columns whose
+ * (0-based) positions are given in attnums, e.g. the columns of the primary key.
+ *
+ * The encoder function for each column is resolved here, once per schema version,
+ * so that encoding a row doesn't need to dispatch on the column types again. The
+ * plan is palloc'ed in the current memory context. unchanged_toast must match the
+ * argument with which the schema was generated. */
+encode_plan *encode_plan_new(TupleDesc tupdesc, int natts, const AttrNumber *attnums, bool unchanged_toast) {
+    encode_plan *plan = palloc0(sizeof(encode_plan));
+    AttrNumber *tupattnums = palloc(Max(tupdesc->natts, 1) * sizeof(AttrNumber));
+    int tup_i = 0;
+
+    /* Position of each column in a tuple that omits dropped columns */
     for (int i = 0; i < tupdesc->natts; i++) {
-        avro_value_t field_val;
-        bool isnull=false;
-        Datum datum;
+        tupattnums[i] = tup_i;
+        if (!tupdesc->attrs[i]->attisdropped) tup_i++;
+    }
 
-        Form_pg_attribute attr = tupdesc->attrs[i];
-        if (attr->attisdropped) continue; /* skip dropped columns */
+    if (!attnums) natts = tup_i;
 
-        check(err, avro_value_get_by_index(output_val, field, &field_val, NULL));
+    plan->natts = natts;
+    plan->table_natts = tupdesc->natts;
+    plan->columns = palloc0(Max(natts, 1) * sizeof(column_encoder));
 
-        datum = heap_getattr(tuple, i + 1, tupdesc, &isnull);
+    for (int field = 0, i = 0; field < natts; field++, i++) {
+        column_encoder *column = &plan->columns[field];
+        Form_pg_attribute attr;
 
-        if (isnull) {
-            check(err, avro_value_set_branch(&field_val, 0, NULL));
+        if (attnums) {
+            i = attnums[field];
         } else {
-            check(err, update_avro_with_datum(&field_val, attr->atttypid, datum));
+            while (tupdesc->attrs[i]->attisdropped) i++; /* skip dropped columns */
+        }
+
+        if (i < 0 || i >= tupdesc->natts || tupdesc->attrs[i]->attisdropped) {
+            elog(ERROR, "index refers to non-existent attribute number %d", i);
         }
 
-        field++;
+        attr = tupdesc->attrs[i];
+        column->attnum = i;
+        column->tupattnum = tupattnums[i];
+        column_encoder_init(column, attr->atttypid, attr->atttypmod);
+        column->unchanged_toast = unchanged_toast && column_is_toastable(attr);
     }
 
-    return err;
+    pfree(tupattnums);
+    return plan;
+}
+
+/* True if values of the column may be stored out of line in the table's TOAST
+ * relation, in which case logical decoding of an update that didn't modify the
+ * column gives us only a pointer to the old value on disk. */
+bool column_is_toastable(Form_pg_attribute attr) {
+    return attr->attlen == -1 && attr->attstorage != 'p';
+}
+
+/* Frees a plan created by encode_plan_new(). */
+void encode_plan_free(encode_plan *plan) {
+    for (int field = 0; field < plan->natts; field++) {
+        column_encoder_free(&plan->columns[field]);
+    }
+    pfree(plan->columns);
+    pfree(plan);
 }
 
+/* Resolves the encoder function for values of the given type, and looks up any
+ * per-type state that the encoder needs: the output function for types encoded as
+ * strings, the element encoder for arrays, the values of enums, and a nested plan
+ * for the attributes of composite types. Domains are
+ * encoded like their base type. */
+void column_encoder_init(column_encoder *column, Oid typid, int32 typmod) {
+    typid = getBaseTypeAndTypmod(typid, &typmod);
+    column->typid = typid;
+    column->typmod = typmod;
+    column->encode = encoder_for_oid(typid, typmod, &column->handles_union);
+
+    if (column->encode == encode_other || column->encode == encode_array) {
+        Oid output_func;
+        getTypeOutputInfo(typid, &output_func, &column->output_varlena);
+        fmgr_info(output_func, &column->output_func);
+    }
+
+    if (column->encode == encode_array) {
+        /* The type modifier of an array column applies to its elements */
+        column->element = palloc0(sizeof(column_encoder));
+        column_encoder_init(column->element, get_element_type(typid), typmod);
+        get_typlenbyvalalign(column->element->typid, &column->elmlen,
+                &column->elmbyval, &column->elmalign);
+
+    } else if (column->encode == encode_enum) {
+        enum_label *labels = enum_labels_for_type(typid, &column->enum_count);
+        column->enum_oids = palloc(Max(column->enum_count, 1) * sizeof(Oid));
+        for (int i = 0; i < column->enum_count; i++) {
+            column->enum_oids[i] = labels[i].oid;
+            pfree(labels[i].label);
+        }
+        pfree(labels);
+
+    } else if (column->encode == encode_composite) {
+        column->row_tupdesc = lookup_rowtype_tupdesc_copy(typid, -1);
+        column->row_plan = encode_plan_new(column->row_tupdesc, 0, NULL, false);
+        column->row_values = palloc(Max(column->row_tupdesc->natts, 1) * sizeof(Datum));
+        column->row_isnull = palloc(Max(column->row_tupdesc->natts, 1) * sizeof(bool));
+    }
+}
 
-/* Extracts the fields that constitute the primary key/replica identity from a tuple,
- * and translates them into an Avro value in the schema generated by
- * schema_for_table_key(). tupdesc describes the the format of the tuple (which may or
- * may not include dropped columns). rel is the table from which the tuple has come,
- * and key_index is the primary key/replica identity index we're using. */
-int tuple_to_avro_key(avro_value_t *output_val, TupleDesc tupdesc, HeapTuple tuple,
-        Relation rel, Form_pg_index key_index) {
+/* Frees any per-type state allocated by column_encoder_init(). */
+void column_encoder_free(column_encoder *column) {
+    if (column->element) {
+        column_encoder_free(column->element);
+        pfree(column->element);
+    }
+    if (column->enum_oids) pfree(column->enum_oids);
+    if (column->row_plan) {
+        encode_plan_free(column->row_plan);
+        FreeTupleDesc(column->row_tupdesc);
+        pfree(column->row_values);
+        pfree(column->row_isnull);
+    }
+}
+
+/* Returns true if a user-defined type used by the plan has changed since the plan was
+ * compiled, so that the plan and the schema generated alongside it are out of date:
+ * for example, ALTER TYPE ... ADD VALUE on an enum, or ALTER TYPE ... ADD ATTRIBUTE on
+ * a composite type. Such changes don't invalidate the relcache entries of the tables
+ * that use the type, so the schema cache calls this after any change to pg_enum, or
+ * to the relation of a composite type (see encode_plan_type_relids()). */
+bool encode_plan_changed(encode_plan *plan) {
+    for (int field = 0; field < plan->natts; field++) {
+        if (column_encoder_changed(&plan->columns[field])) return true;
+    }
+    return false;
+}
+
+/* Checks the per-type state of one column for encode_plan_changed(). */
+bool column_encoder_changed(column_encoder *column) {
+    if (column->element) return column_encoder_changed(column->element);
+
+    if (column->row_plan) {
+        TupleDesc tupdesc = lookup_rowtype_tupdesc(column->typid, -1);
+        bool changed = !equalTupleDescs(column->row_tupdesc, tupdesc);
+        ReleaseTupleDesc(tupdesc);
+        return changed || encode_plan_changed(column->row_plan);
+    }
+
+    if (column->encode == encode_enum) {
+        int count;
+        enum_label *labels = enum_labels_for_type(column->typid, &count);
+        bool changed = (count != column->enum_count);
+
+        for (int i = 0; i < count; i++) {
+            if (!changed && labels[i].oid != column->enum_oids[i]) changed = true;
+            pfree(labels[i].label);
+        }
+        pfree(labels);
+        return changed;
+    }
+
+    return false;
+}
+
+/* Appends to *relids the Oids of the relations underlying any composite types used
+ * by the plan, including composite types nested in arrays or other composite types.
+ * Altering a composite type invalidates the relcache entry of its relation. */
+void encode_plan_type_relids(encode_plan *plan, List **relids) {
+    for (int field = 0; field < plan->natts; field++) {
+        column_encoder_type_relids(&plan->columns[field], relids);
+    }
+}
+
+/* Collects the relations of composite types for encode_plan_type_relids(). */
+void column_encoder_type_relids(column_encoder *column, List **relids) {
+    if (column->element) column_encoder_type_relids(column->element, relids);
+
+    if (column->row_plan) {
+        *relids = list_append_unique_oid(*relids, get_typ_typrelid(column->typid));
+        encode_plan_type_relids(column->row_plan, relids);
+    }
+}
+
+/* Translates a deformed tuple (as returned by heap_deform_tuple) into an Avro record,
+ * according to a plan created by encode_plan_new(). tupdesc describes the format of
+ * the tuple: during stream replication it includes dropped columns, but the result
+ * set of a snapshot query omits them. */
+int tuple_to_avro_record(avro_value_t *output_val, encode_plan *plan, TupleDesc tupdesc,
+        Datum *values, bool *isnull) {
     int err = 0;
-    TupleDesc rel_tupdesc = RelationGetDescr(rel);
+    bool with_dropped = (tupdesc->natts == plan->table_natts);
     check(err, avro_value_reset(output_val));
 
-    for (int field = 0; field < key_index->indkey.dim1; field++) {
-        Form_pg_attribute attr;
+    for (int field = 0; field < plan->natts; field++) {
+        column_encoder *column = &plan->columns[field];
+        int tup_i = with_dropped ? column->attnum : column->tupattnum;
         avro_value_t field_val;
-        bool isnull=false;
-        Datum datum;
 
-        int attnum = key_index->indkey.values[field] - 1;
+        check(err, avro_value_get_by_index(output_val, field, &field_val, NULL));
+        check(err, tuple_to_avro_field(&field_val, column, values[tup_i], isnull[tup_i]));
+    }
 
-        // rel_tupdesc->attrs[attnum] is the indexed attribute. To figure out which
-        // attribute number in the tuple this corresponds to, we need to see if there
-        // are any columns that are dropped in rel_tupdesc but not in tupdesc.
-        int tup_i = 0;
-        for (int rel_i = 0; rel_i < attnum; rel_i++) {
-            if (!rel_tupdesc->attrs[rel_i]->attisdropped || tupdesc->attrs[tup_i]->attisdropped) tup_i++;
-        }
+    return err;
+}
 
-        if (tup_i >= tupdesc->natts || tupdesc->attrs[tup_i]->attisdropped) {
-            elog(ERROR, "index refers to non-existent attribute number %d", attnum);
-        }
+/* Translates one column value of a deformed tuple into a field of an Avro record,
+ * which is a union of null and the column's type. A value that is an on-disk TOAST
+ * pointer comes from an update that didn't modify the column; if the column's union
+ * has a marker branch for that case (always its last branch, as some types have more
+ * than one non-null branch), it is used rather than fetching the old value. */
+int tuple_to_avro_field(avro_value_t *field_val, column_encoder *column, Datum value, bool isnull) {
+    int err = 0;
+    avro_value_t branch_val;
 
-        attr = tupdesc->attrs[tup_i];
-        check(err, avro_value_get_by_index(output_val, field, &field_val, NULL));
+    if (isnull) {
+        check(err, avro_value_set_branch(field_val, 0, NULL));
+    } else if (column->unchanged_toast && VARATT_IS_EXTERNAL_ONDISK(DatumGetPointer(value))) {
+        size_t num_branches = avro_schema_union_size(avro_value_get_schema(field_val));
+        check(err, avro_value_set_branch(field_val, num_branches - 1, &branch_val));
+        check(err, avro_value_set_enum(&branch_val, 0));
+    } else if (column->handles_union) {
+        check(err, column->encode(field_val, column, value));
+    } else {
+        check(err, avro_value_set_branch(field_val, 1, &branch_val));
+        check(err, column->encode(&branch_val, column, value));
+    }
+    return err;
+}
+
+
+/* Writes the JSON representation of a schema generated by schema_for_table_row() for a
+ * relation with the given tuple descriptor (or by schema_for_composite() for a composite
+ * type). This is equivalent to avro_schema_to_json(), except that columns are annotated
+ * with Avro logical types, which avro-c does not support: NUMERIC columns with a declared
+ * precision and scale use the "decimal" logical type. Fields without an annotation are
+ * written by avro_schema_to_json(). */
+int table_schema_to_json(avro_schema_t record_schema, TupleDesc tupdesc, avro_writer_t writer) {
+    int err = 0, i = 0;
+    const char *namespace = avro_schema_namespace(record_schema);
+
+    check(err, write_json(writer, "{\"type\":\"record\",\"name\":\""));
+    check(err, write_json(writer, avro_schema_name(record_schema)));
+    if (namespace) {
+        check(err, write_json(writer, "\",\"namespace\":\""));
+        check(err, write_json(writer, namespace));
+    }
+    check(err, write_json(writer, "\",\"fields\":["));
+
+    for (int field = 0; field < avro_schema_record_size(record_schema); field++) {
+        avro_schema_t field_schema = avro_schema_record_field_get_by_index(record_schema, field);
+        Form_pg_attribute attr = NULL;
 
-        datum = heap_getattr(tuple, tup_i + 1, tupdesc, &isnull);
+        /* Find the column for this field (there is none for the dummy field of a
+         * table without columns). */
+        while (i < tupdesc->natts && tupdesc->attrs[i]->attisdropped) i++;
+        if (i < tupdesc->natts) attr = tupdesc->attrs[i++];
 
-        if (isnull) {
-            check(err, avro_value_set_branch(&field_val, 0, NULL));
+        if (field > 0) check(err, write_json(writer, ","));
+        check(err, write_json(writer, "{\"name\":\""));
+        check(err, write_json(writer, avro_schema_record_field_name(record_schema, field)));
+        check(err, write_json(writer, "\",\"type\":"));
+
+        if (attr) {
+            check(err, type_schema_to_json(field_schema, attr->atttypid, attr->atttypmod, writer));
         } else {
-            check(err, update_avro_with_datum(&field_val, attr->atttypid, datum));
+            check(err, avro_schema_to_json(field_schema, writer));
         }
+
+        check(err, write_json(writer, "}"));
+    }
+
+    check(err, write_json(writer, "]}"));
+    return err;
+}
+
+/* Writes the JSON representation of a schema generated by schema_for_oid() for the
+ * given type, recursing into arrays and composite types so that any decimals they
+ * contain are annotated too. */
+int type_schema_to_json(avro_schema_t union_schema, Oid typid, int32 typmod, avro_writer_t writer) {
+    int err = 0;
+    avro_schema_t value_schema = avro_schema_union_branch(union_schema, 1);
+
+    typid = getBaseTypeAndTypmod(typid, &typmod);
+
+    if (numeric_is_decimal(typid, typmod)) {
+        check(err, write_json(writer, "[\"null\","));
+        check(err, write_decimal_json(writer, typmod));
+        check(err, write_union_end_json(union_schema, writer));
+
+    } else if (is_avro_array(value_schema)) {
+        check(err, write_json(writer, "[\"null\",{\"type\":\"array\",\"items\":"));
+        check(err, type_schema_to_json(avro_schema_array_items(value_schema),
+                    get_element_type(typid), typmod, writer));
+        check(err, write_json(writer, "}"));
+        check(err, write_union_end_json(union_schema, writer));
+
+    } else if (is_avro_record(value_schema) && get_typtype(typid) == TYPTYPE_COMPOSITE) {
+        /* Only the first occurrence of a composite type is a record; subsequent
+         * occurrences are links, which avro_schema_to_json() writes by name. */
+        TupleDesc tupdesc = lookup_rowtype_tupdesc(typid, -1);
+        err = write_json(writer, "[\"null\",");
+        if (!err) err = table_schema_to_json(value_schema, tupdesc, writer);
+        if (!err) err = write_union_end_json(union_schema, writer);
+        ReleaseTupleDesc(tupdesc);
+
+    } else {
+        check(err, avro_schema_to_json(union_schema, writer));
     }
 
-    return 0;
+    return err;
+}
+
+/* Writes any branches of a union after the first two (i.e. the string branch of decimals
+ * and arrays, and the marker for unchanged TOASTed values, if present), and closes the
+ * union. */
+int write_union_end_json(avro_schema_t union_schema, avro_writer_t writer) {
+    int err = 0;
+
+    for (size_t i = 2; i < avro_schema_union_size(union_schema); i++) {
+        check(err, write_json(writer, ","));
+        check(err, avro_schema_to_json(avro_schema_union_branch(union_schema, i), writer));
+    }
+    return write_json(writer, "]");
+}
+
+int write_json(avro_writer_t writer, const char *str) {
+    return avro_write(writer, (void *) str, strlen(str));
+}
+
+/* Writes the JSON schema of a decimal with the precision and scale of a NUMERIC type modifier. */
+int write_decimal_json(avro_writer_t writer, int32 typmod) {
+    char buf[128];
+    typmod -= VARHDRSZ;
+    snprintf(buf, sizeof(buf),
+            "{\"type\":\"bytes\",\"logicalType\":\"decimal\",\"precision\":%d,\"scale\":%d}",
+            (typmod >> 16) & 0xffff, typmod & 0xffff);
+    return write_json(writer, buf);
 }
 
 
 /* Generates an Avro schema that can be used to encode a Postgres type
- * with the given OID. */
-avro_schema_t schema_for_oid(predef_schema *predef, Oid typid) {
+ * with the given OID and type modifier. Domains use the schema of their base type. */
+avro_schema_t schema_for_oid(predef_schema *predef, Oid typid, int32 typmod) {
     avro_schema_t value_schema, null_schema, union_schema;
 
+    typid = getBaseTypeAndTypmod(typid, &typmod);
+
     switch (typid) {
         /* Numeric-like types */
         case BOOLOID:    /* boolean: 'true'/'false' */
@@ -289,7 +654,7 @@ avro_schema_t schema_for_oid(predef_schema *predef, Oid typid) {
             value_schema = avro_schema_long();
             break;
         case NUMERICOID: /* numeric(p, s), decimal(p, s): arbitrary precision number */
-            value_schema = schema_for_numeric(predef);
+            value_schema = schema_for_numeric(predef, typmod);
             break;
 
         /* Date/time types. We don't bother with abstime, reltime and tinterval (which are based
@@ -324,13 +689,17 @@ avro_schema_t schema_for_oid(predef_schema *predef, Oid typid) {
         case BYTEAOID:   /* bytea: variable-length byte array */
             value_schema = avro_schema_bytes();
             break;
+        case UUIDOID:    /* UUID datatype */
+            value_schema = schema_for_uuid(predef);
+            break;
+        case INETOID:    /* IP address/netmask, host address, netmask optional */
+        case CIDROID:    /* network IP address/netmask, network address */
+            value_schema = avro_schema_bytes();
+            break;
         case BITOID:     /* fixed-length bit string */
         case VARBITOID:  /* variable-length bit string */
-        case UUIDOID:    /* UUID datatype */
         case LSNOID:     /* PostgreSQL LSN datatype */
         case MACADDROID: /* XX:XX:XX:XX:XX:XX, MAC address */
-        case INETOID:    /* IP address/netmask, host address, netmask optional */
-        case CIDROID:    /* network IP address/netmask, network address */
 
         /* Geometric types */
         case POINTOID:   /* geometric point '(x, y)' */
@@ -353,9 +722,13 @@ avro_schema_t schema_for_oid(predef_schema *predef, Oid typid) {
         case TEXTOID:    /* text: variable-length string, no limit specified */
         case BPCHAROID:  /* character(n), char(length): blank-padded string, fixed storage length */
         case VARCHAROID: /* varchar(length): non-blank-padded string, variable storage length */
-        default:
             value_schema = avro_schema_string();
             break;
+
+        /* Arrays, enums and any other types */
+        default:
+            value_schema = schema_for_other(predef, typid, typmod);
+            break;
     }
 
     /* Make a union of value_schema with null. Some types are already a union,
@@ -366,118 +739,574 @@ avro_schema_t schema_for_oid(predef_schema *predef, Oid typid) {
     union_schema = avro_schema_union();
     avro_schema_union_append(union_schema, null_schema);
     avro_schema_union_append(union_schema, value_schema);
+
+    /* Values that don't fit the schema of a decimal or an array are encoded as
+     * strings (see encode_decimal() and encode_array()) */
+    if (numeric_is_decimal(typid, typmod) || is_avro_array(value_schema)) {
+        avro_schema_t string_schema = avro_schema_string();
+        avro_schema_union_append(union_schema, string_schema);
+        avro_schema_decref(string_schema);
+    }
+
     avro_schema_decref(null_schema);
     avro_schema_decref(value_schema);
     return union_schema;
 }
 
 
-/* Translates a Postgres datum into an Avro value. */
-int update_avro_with_datum(avro_value_t *output_val, Oid typid, Datum pg_datum) {
-    int err = 0;
-    avro_value_t branch_val;
+/* Returns the function that translates a non-null Postgres datum of the given type
+ * into an Avro value with the schema generated by schema_for_oid(). Most encoders are
+ * given the non-null branch of the union with null; *handles_union is set to true for
+ * types whose encoder needs to choose the branch itself. */
+column_encoder_fn encoder_for_oid(Oid typid, int32 typmod, bool *handles_union) {
+    *handles_union = false;
 
-    /* Types that handle nullability themselves */
-#if 0
-    if (typid == DATEOID || typid == TIMESTAMPOID || typid == TIMESTAMPTZOID) {
-#else
-    if (typid == DATEOID || typid == TIMESTAMPTZOID) {
-#endif
-        branch_val = *output_val;
-    } else {
-        check(err, avro_value_set_branch(output_val, 1, &branch_val));
+    if (numeric_is_decimal(typid, typmod)) {
+        *handles_union = true;
+        return encode_decimal;
     }
 
     switch (typid) {
-        case BOOLOID:
-            check(err, avro_value_set_boolean(&branch_val, DatumGetBool(pg_datum)));
-            break;
-        case FLOAT4OID:
-            check(err, avro_value_set_float(&branch_val, DatumGetFloat4(pg_datum)));
-            break;
-        case FLOAT8OID:
-            check(err, avro_value_set_double(&branch_val, DatumGetFloat8(pg_datum)));
-            break;
-        case INT2OID:
-            check(err, avro_value_set_int(&branch_val, DatumGetInt16(pg_datum)));
-            break;
-        case INT4OID:
-            check(err, avro_value_set_int(&branch_val, DatumGetInt32(pg_datum)));
-            break;
-        case INT8OID:
-            check(err, avro_value_set_long(&branch_val, DatumGetInt64(pg_datum)));
-            break;
-        case CASHOID:
-            check(err, avro_value_set_long(&branch_val, DatumGetCash(pg_datum)));
-            break;
+        case BOOLOID:        return encode_bool;
+        case FLOAT4OID:      return encode_float4;
+        case FLOAT8OID:      return encode_float8;
+        case INT2OID:        return encode_int2;
+        case INT4OID:        return encode_int4;
+        case INT8OID:        return encode_int8;
+        case CASHOID:        return encode_cash;
         case OIDOID:
-        case REGPROCOID:
-            check(err, avro_value_set_long(&branch_val, DatumGetObjectId(pg_datum)));
-            break;
-        case XIDOID:
-            check(err, avro_value_set_long(&branch_val, DatumGetTransactionId(pg_datum)));
-            break;
-        case CIDOID:
-            check(err, avro_value_set_long(&branch_val, DatumGetCommandId(pg_datum)));
-            break;
-        case NUMERICOID:
-            /* There is no implementation for Decimal type in apache/avro package for c language.
-             * We use logic for "double" type to avoid "0.0" values.
-             */
-            check(err, avro_value_set_double(&branch_val, atof(numeric_normalize(DatumGetNumeric(pg_datum)))));
-            break;
+        case REGPROCOID:     return encode_oid;
+        case XIDOID:         return encode_xid;
+        case CIDOID:         return encode_cid;
+        case NUMERICOID:     return encode_numeric;
         case DATEOID:
-            check(err, update_avro_with_date(output_val, DatumGetDateADT(pg_datum)));
-            break;
-        case TIMEOID:
-            check(err, avro_value_set_long(&branch_val, DatumGetTimeADT(pg_datum)));
-            break;
-        case TIMETZOID:
-            check(err, update_avro_with_time_tz(&branch_val, DatumGetTimeTzADTP(pg_datum)));
-            break;
-        case TIMESTAMPOID:
+            *handles_union = true;
+            return encode_date;
+        case TIMEOID:        return encode_time;
+        case TIMETZOID:      return encode_time_tz;
+        case TIMESTAMPOID:   return encode_timestamp;
+        case TIMESTAMPTZOID: return encode_timestamp_tz;
+        case INTERVALOID:    return encode_interval;
+        case BYTEAOID:       return encode_bytea;
+        case CHAROID:        return encode_char;
+        case NAMEOID:        return encode_name;
+        case TEXTOID:
+        case BPCHAROID:
+        case VARCHAROID:     return encode_text;
+        case UUIDOID:        return encode_uuid;
+        case INETOID:
+        case CIDROID:        return encode_inet;
+        default:
+            if (type_is_enum(typid)) return encode_enum;
+            if (get_typtype(typid) == TYPTYPE_COMPOSITE) return encode_composite;
+            if (OidIsValid(get_element_type(typid))) {
+                *handles_union = true;
+                return encode_array;
+            }
+            return encode_other;
+    }
+}
+
+int encode_bool(avro_value_t *output_val, column_encoder *column, Datum datum) {
+    return avro_value_set_boolean(output_val, DatumGetBool(datum));
+}
+
+int encode_float4(avro_value_t *output_val, column_encoder *column, Datum datum) {
+    return avro_value_set_float(output_val, DatumGetFloat4(datum));
+}
+
+int encode_float8(avro_value_t *output_val, column_encoder *column, Datum datum) {
+    return avro_value_set_double(output_val, DatumGetFloat8(datum));
+}
+
+int encode_int2(avro_value_t *output_val, column_encoder *column, Datum datum) {
+    return avro_value_set_int(output_val, DatumGetInt16(datum));
+}
+
+int encode_int4(avro_value_t *output_val, column_encoder *column, Datum datum) {
+    return avro_value_set_int(output_val, DatumGetInt32(datum));
+}
+
+int encode_int8(avro_value_t *output_val, column_encoder *column, Datum datum) {
+    return avro_value_set_long(output_val, DatumGetInt64(datum));
+}
+
+int encode_cash(avro_value_t *output_val, column_encoder *column, Datum datum) {
+    return avro_value_set_long(output_val, DatumGetCash(datum));
+}
+
+int encode_oid(avro_value_t *output_val, column_encoder *column, Datum datum) {
+    return avro_value_set_long(output_val, DatumGetObjectId(datum));
+}
+
+int encode_xid(avro_value_t *output_val, column_encoder *column, Datum datum) {
+    return avro_value_set_long(output_val, DatumGetTransactionId(datum));
+}
+
+int encode_cid(avro_value_t *output_val, column_encoder *column, Datum datum) {
+    return avro_value_set_long(output_val, DatumGetCommandId(datum));
+}
+
+/* A NUMERIC without a declared precision and scale has no fixed scale, so it can't be
+ * represented as an Avro decimal. We use logic for "double" type to avoid "0.0" values. */
+int encode_numeric(avro_value_t *output_val, column_encoder *column, Datum datum) {
+    return avro_value_set_double(output_val, atof(numeric_normalize(DatumGetNumeric(datum))));
+}
+
+/* Encodes a NUMERIC with declared precision and scale as an Avro decimal: the value
+ * multiplied by 10^scale, as a two's-complement big-endian integer in the minimum number
+ * of bytes. The unscaled value is accumulated directly from the base-10000 digits of the
+ * numeric, as sent by numeric_send(). Values stored in the column have already been
+ * rounded to its scale.
+ *
+ * NaN has no decimal representation, so it is encoded as the string "NaN" in the
+ * STRING_BRANCH of the union instead. */
+int encode_decimal(avro_value_t *union_val, column_encoder *column, Datum datum) {
+    bytea *wire = DatumGetByteaP(DirectFunctionCall1(numeric_send, datum));
+    int32 typmod = column->typmod - VARHDRSZ;
+    int precision = (typmod >> 16) & 0xffff, scale = typmod & 0xffff;
+    int frac_groups = (scale + DEC_DIGITS - 1) / DEC_DIGITS, partial = scale % DEC_DIGITS;
+    int weight, ndigits, sign, len = precision / 2 + 2, start = 0;
+    uint8 buf[NUMERIC_MAX_PRECISION / 2 + 2];
+    StringInfoData msg;
+    avro_value_t output_val;
+    int err = 0;
+
+    msg.data = VARDATA(wire);
+    msg.len = VARSIZE(wire) - VARHDRSZ;
+    msg.maxlen = msg.len;
+    msg.cursor = 0;
+
+    ndigits = (int16) pq_getmsgint(&msg, sizeof(int16));
+    weight = (int16) pq_getmsgint(&msg, sizeof(int16));
+    sign = pq_getmsgint(&msg, sizeof(uint16));
+    pq_getmsgint(&msg, sizeof(uint16)); /* dscale; the column's scale applies instead */
+
+    if (sign == NUMERIC_NAN) {
+        check(err, avro_value_set_branch(union_val, STRING_BRANCH, &output_val));
+        return avro_value_set_string(&output_val, "NaN");
+    }
+
+    memset(buf, 0, len);
+
+    /* The index of the digit increases by one with each iteration, starting at zero (or
+     * below, for the leading zeros of a value less than one), so digits are read in order. */
+    for (int pos = Max(weight, 0); pos >= -frac_groups; pos--) {
+        int index = weight - pos;
+        uint32 digit = (index >= 0 && index < ndigits) ? pq_getmsgint(&msg, sizeof(int16)) : 0;
+        uint32 multiplier = NBASE, carry;
+
+        /* If the scale is not a multiple of DEC_DIGITS, only the leading decimal digits
+         * of the last base-10000 digit are part of the unscaled value. */
+        if (pos == -frac_groups && partial != 0) {
+            multiplier = 1;
+            for (int i = 0; i < partial; i++) multiplier *= 10;
+            digit /= NBASE / multiplier;
+        }
+
+        carry = digit;
+        for (int i = len - 1; i >= 0; i--) {
+            carry += buf[i] * multiplier;
+            buf[i] = carry & 0xff;
+            carry >>= 8;
+        }
+    }
+
+    if (sign == NUMERIC_NEG) {
+        uint32 carry = 1;
+        for (int i = len - 1; i >= 0; i--) {
+            carry += (uint8) ~buf[i];
+            buf[i] = carry & 0xff;
+            carry >>= 8;
+        }
+    }
+
+    /* Strip leading bytes that only repeat the sign bit */
+    while (start < len - 1 &&
+            ((buf[start] == 0x00 && !(buf[start + 1] & 0x80)) ||
+             (buf[start] == 0xff && (buf[start + 1] & 0x80)))) {
+        start++;
+    }
+
+    check(err, avro_value_set_branch(union_val, 1, &output_val));
+    return avro_value_set_bytes(&output_val, buf + start, len - start);
+}
+
+int encode_date(avro_value_t *output_val, column_encoder *column, Datum datum) {
+    return update_avro_with_date(output_val, DatumGetDateADT(datum));
+}
+
+int encode_time(avro_value_t *output_val, column_encoder *column, Datum datum) {
+    return avro_value_set_long(output_val, DatumGetTimeADT(datum));
+}
+
+int encode_time_tz(avro_value_t *output_val, column_encoder *column, Datum datum) {
+    return update_avro_with_time_tz(output_val, DatumGetTimeTzADTP(datum));
+}
+
+/* Timestamps are encoded as microseconds since the Unix epoch. */
+int encode_timestamp(avro_value_t *output_val, column_encoder *column, Datum datum) {
 #if 0
-            check(err, update_avro_with_timestamp(output_val, false, DatumGetTimestamp(pg_datum)));
+    return update_avro_with_timestamp(output_val, false, DatumGetTimestamp(datum));
 #else
-            check(err, avro_value_set_long(&branch_val,
-					DatumGetTimestamp(pg_datum) + (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * USECS_PER_DAY));
+    return avro_value_set_long(output_val,
+            DatumGetTimestamp(datum) + (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * USECS_PER_DAY);
 #endif
-            break;
-        case TIMESTAMPTZOID:
+}
+
+int encode_timestamp_tz(avro_value_t *output_val, column_encoder *column, Datum datum) {
 #if 0
-            check(err, update_avro_with_timestamp(output_val, true, DatumGetTimestampTz(pg_datum)));
+    return update_avro_with_timestamp(output_val, true, DatumGetTimestampTz(datum));
 #else
-            check(err, avro_value_set_long(&branch_val,
-					DatumGetTimestampTz(pg_datum) + (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * USECS_PER_DAY));
+    return avro_value_set_long(output_val,
+            DatumGetTimestampTz(datum) + (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * USECS_PER_DAY);
 #endif
-            break;
-        case INTERVALOID:
-            check(err, update_avro_with_interval(&branch_val, DatumGetIntervalP(pg_datum)));
-            break;
-        case BYTEAOID:
-            check(err, update_avro_with_bytes(&branch_val, DatumGetByteaP(pg_datum)));
-            break;
-        case CHAROID:
-            check(err, update_avro_with_char(&branch_val, DatumGetChar(pg_datum)));
-            break;
-        case NAMEOID:
-            check(err, avro_value_set_string(&branch_val, NameStr(*DatumGetName(pg_datum))));
-            break;
-        case TEXTOID:
-        case BPCHAROID:
-        case VARCHAROID:
-            check(err, avro_value_set_string(&branch_val, TextDatumGetCString(pg_datum)));
-            break;
-        default:
-            check(err, update_avro_with_string(&branch_val, typid, pg_datum));
-            break;
+}
+
+int encode_interval(avro_value_t *output_val, column_encoder *column, Datum datum) {
+    return update_avro_with_interval(output_val, DatumGetIntervalP(datum));
+}
+
+int encode_bytea(avro_value_t *output_val, column_encoder *column, Datum datum) {
+    return update_avro_with_bytes(output_val, DatumGetByteaPP(datum));
+}
+
+int encode_char(avro_value_t *output_val, column_encoder *column, Datum datum) {
+    return update_avro_with_char(output_val, DatumGetChar(datum));
+}
+
+int encode_name(avro_value_t *output_val, column_encoder *column, Datum datum) {
+    return avro_value_set_string(output_val, NameStr(*DatumGetName(datum)));
+}
+
+int encode_text(avro_value_t *output_val, column_encoder *column, Datum datum) {
+    return update_avro_with_text(output_val, DatumGetTextPP(datum));
+}
+
+/* UUIDs are encoded as their 16 raw bytes. */
+int encode_uuid(avro_value_t *output_val, column_encoder *column, Datum datum) {
+    return avro_value_set_fixed(output_val, DatumGetUUIDP(datum)->data, UUID_LEN);
+}
+
+/* inet and cidr values are encoded as the address in network byte order (4 bytes for
+ * IPv4, 16 bytes for IPv6), followed by one byte containing the netmask length. */
+int encode_inet(avro_value_t *output_val, column_encoder *column, Datum datum) {
+    inet *ip = DatumGetInetPP(datum);
+    unsigned char buf[17];
+    int len = ip_addrsize(ip);
+
+    memcpy(buf, ip_addr(ip), len);
+    buf[len] = ip_bits(ip);
+    return avro_value_set_bytes(output_val, buf, len + 1);
+}
+
+/* Enum values are encoded as the Avro enum symbol at the same position as the value
+ * in the enum's sort order. Adding a value to the type invalidates the plan (see
+ * encode_plan_changed()), so a value that is not found here is an error. */
+int encode_enum(avro_value_t *output_val, column_encoder *column, Datum datum) {
+    Oid value = DatumGetObjectId(datum);
+
+    for (int i = 0; i < column->enum_count; i++) {
+        if (column->enum_oids[i] == value) return avro_value_set_enum(output_val, i);
+    }
+
+    avro_set_error("Value %u of enum type %u is not in the schema", value, column->typid);
+    return EINVAL;
+}
+
+/* One-dimensional arrays are encoded as an Avro array of the element type (with null).
+ * An Avro array can't represent multiple dimensions, or subscripts that don't start
+ * at 1, so such arrays are encoded in the STRING_BRANCH of the union instead, using
+ * the array type's output function (e.g. "{{1,2},{3,4}}" or "[0:1]={1,2}"). */
+int encode_array(avro_value_t *union_val, column_encoder *column, Datum datum) {
+    int err = 0, nelems;
+    ArrayType *array = DatumGetArrayTypeP(datum);
+    column_encoder *element = column->element;
+    avro_value_t output_val;
+    Datum *elems;
+    bool *nulls;
+
+    if (ARR_NDIM(array) > 1 || (ARR_NDIM(array) == 1 && ARR_LBOUND(array)[0] != 1)) {
+        err = avro_value_set_branch(union_val, STRING_BRANCH, &output_val);
+        if (!err) err = update_avro_with_string(&output_val, &column->output_func,
+                column->output_varlena, PointerGetDatum(array));
+        if ((Pointer) array != DatumGetPointer(datum)) pfree(array);
+        return err;
     }
 
+    deconstruct_array(array, element->typid, column->elmlen, column->elmbyval,
+            column->elmalign, &elems, &nulls, &nelems);
+
+    err = avro_value_set_branch(union_val, 1, &output_val);
+    if (!err) err = avro_value_reset(&output_val);
+
+    for (int i = 0; i < nelems && !err; i++) {
+        avro_value_t item_val, branch_val;
+
+        err = avro_value_append(&output_val, &item_val, NULL);
+        if (err) break;
+
+        if (nulls[i]) {
+            err = avro_value_set_branch(&item_val, 0, NULL);
+        } else if (element->handles_union) {
+            err = element->encode(&item_val, element, elems[i]);
+        } else {
+            err = avro_value_set_branch(&item_val, 1, &branch_val);
+            if (!err) err = element->encode(&branch_val, element, elems[i]);
+        }
+    }
+
+    pfree(elems);
+    pfree(nulls);
+    if ((Pointer) array != DatumGetPointer(datum)) pfree(array);
     return err;
 }
 
-avro_schema_t schema_for_numeric(predef_schema *predef) {
-    return avro_schema_double(); /* FIXME use decimal logical type: http://avro.apache.org/docs/1.7.7/spec.html#Decimal */
+/* Composite values are deformed directly, and their attributes are encoded into a
+ * nested record using the plan that was compiled for the composite type. */
+int encode_composite(avro_value_t *output_val, column_encoder *column, Datum datum) {
+    int err = 0;
+    HeapTupleHeader header = DatumGetHeapTupleHeader(datum);
+    HeapTupleData tuple;
+
+    tuple.t_len = HeapTupleHeaderGetDatumLength(header);
+    ItemPointerSetInvalid(&tuple.t_self);
+    tuple.t_tableOid = InvalidOid;
+    tuple.t_data = header;
+
+    heap_deform_tuple(&tuple, column->row_tupdesc, column->row_values, column->row_isnull);
+    err = tuple_to_avro_record(output_val, column->row_plan, column->row_tupdesc,
+            column->row_values, column->row_isnull);
+
+    if ((Pointer) header != DatumGetPointer(datum)) pfree(header);
+    return err;
+}
+
+/* Any type that we don't specifically support is encoded as a string, using the
+ * type's output function, which was looked up when the plan was compiled. */
+int encode_other(avro_value_t *output_val, column_encoder *column, Datum datum) {
+    return update_avro_with_string(output_val, &column->output_func, column->output_varlena, datum);
+}
+
+/* NUMERIC columns with a declared precision and scale are encoded as the Avro decimal
+ * logical type (http://avro.apache.org/docs/1.7.7/spec.html#Decimal), i.e. as bytes
+ * containing the two's-complement big-endian unscaled value. avro-c doesn't know about
+ * logical types, so the annotation is added by table_schema_to_json(). schema_for_oid()
+ * adds a string branch to the union for NaN. Unconstrained NUMERIC columns are encoded
+ * as double. */
+avro_schema_t schema_for_numeric(predef_schema *predef, int32 typmod) {
+    if (numeric_is_decimal(NUMERICOID, typmod)) {
+        return avro_schema_bytes();
+    } else {
+        return avro_schema_double();
+    }
+}
+
+/* Returns true if a column of the given type is encoded as an Avro decimal. */
+bool numeric_is_decimal(Oid typid, int32 typmod) {
+    return typid == NUMERICOID && typmod >= (int32) VARHDRSZ;
+}
+
+/* Generates a schema for types that are not known at compile time: arrays become
+ * Avro arrays, enums become Avro enums, and composite types become Avro records.
+ * Anything else is encoded as a string. */
+avro_schema_t schema_for_other(predef_schema *predef, Oid typid, int32 typmod) {
+    Oid elemtype;
+
+    if (type_is_enum(typid)) return schema_for_enum(predef, typid);
+    if (get_typtype(typid) == TYPTYPE_COMPOSITE) return schema_for_composite(predef, typid);
+
+    elemtype = get_element_type(typid);
+    if (OidIsValid(elemtype)) return schema_for_array(predef, elemtype, typmod);
+
+    return avro_schema_string();
+}
+
+/* Array elements may be null, so the items of the Avro array are a union with null.
+ * schema_for_oid() adds a string branch for arrays that don't fit this schema. */
+avro_schema_t schema_for_array(predef_schema *predef, Oid elemtype, int32 typmod) {
+    avro_schema_t items_schema = schema_for_oid(predef, elemtype, typmod);
+    avro_schema_t array_schema = avro_schema_array(items_schema);
+    avro_schema_decref(items_schema);
+    return array_schema;
+}
+
+avro_schema_t schema_for_uuid(predef_schema *predef) {
+    if (predef->uuid_schema) {
+        return avro_schema_link(predef->uuid_schema);
+    } else {
+        predef->uuid_schema = avro_schema_fixed_ns("Uuid", PREDEFINED_SCHEMA_NAMESPACE, UUID_LEN);
+        return predef->uuid_schema;
+    }
+}
+
+/* Marker that is used in place of a TOASTed column value that was not modified by an
+ * update. An enum with a single symbol encodes as just the union branch index. */
+avro_schema_t schema_for_unchanged_toast(predef_schema *predef) {
+    if (predef->unchanged_schema) {
+        return avro_schema_link(predef->unchanged_schema);
+    } else {
+        predef->unchanged_schema = avro_schema_enum_ns("UnchangedToast", PREDEFINED_SCHEMA_NAMESPACE);
+        avro_schema_enum_symbol_append(predef->unchanged_schema, "unchanged");
+        return predef->unchanged_schema;
+    }
+}
+
+/* A user-defined enum type becomes an Avro enum with the same name, in the namespace
+ * corresponding to the type's schema. The labels are sanitised in the same way as
+ * column names, and the symbols are in the enum's sort order. */
+avro_schema_t schema_for_enum(predef_schema *predef, Oid typid) {
+    char *name_avro_safe, *namespace_avro_safe;
+    enum_label *labels;
+    avro_schema_t schema;
+    int count;
+
+    if ((schema = named_schema_link(predef, typid))) return schema;
+
+    type_avro_names(typid, &name_avro_safe, &namespace_avro_safe);
+    schema = avro_schema_enum_ns(name_avro_safe, namespace_avro_safe);
+    free(name_avro_safe);
+    free(namespace_avro_safe);
+
+    labels = enum_labels_for_type(typid, &count);
+    for (int i = 0; i < count; i++) {
+        char *symbol_avro_safe = make_avro_safe(labels[i].label, false);
+
+        /* Sanitising is not injective (e.g. '-' and '_2d_' both become _2d_), and a
+         * duplicate symbol would make the schema invalid */
+        if (avro_schema_enum_get_by_name(schema, symbol_avro_safe) >= 0) {
+            if (!predef->err) {
+                avro_set_error("Labels of enum type %u map to the same Avro symbol %s",
+                        typid, symbol_avro_safe);
+                predef->err = EINVAL;
+            }
+        } else {
+            avro_schema_enum_symbol_append(schema, symbol_avro_safe);
+        }
+        free(symbol_avro_safe);
+        pfree(labels[i].label);
+    }
+    pfree(labels);
+
+    named_schema_add(predef, typid, schema);
+    return schema;
+}
+
+/* A composite type becomes a nested Avro record with the same name, in the namespace
+ * corresponding to the type's schema, with one field for each attribute of the type. */
+avro_schema_t schema_for_composite(predef_schema *predef, Oid typid) {
+    char *name_avro_safe, *namespace_avro_safe, *attname_avro_safe;
+    avro_schema_t record_schema, field_schema;
+    TupleDesc tupdesc;
+    int fields = 0;
+
+    if ((record_schema = named_schema_link(predef, typid))) return record_schema;
+
+    type_avro_names(typid, &name_avro_safe, &namespace_avro_safe);
+    record_schema = avro_schema_record(name_avro_safe, namespace_avro_safe);
+    free(name_avro_safe);
+    free(namespace_avro_safe);
+
+    /* Register the record before generating its fields, so that the fields can
+     * refer to other types defined by the same schema */
+    named_schema_add(predef, typid, record_schema);
+
+    tupdesc = lookup_rowtype_tupdesc(typid, -1);
+
+    for (int i = 0; i < tupdesc->natts; i++) {
+        Form_pg_attribute attr = tupdesc->attrs[i];
+        if (attr->attisdropped) continue; /* skip dropped attributes */
+
+        attname_avro_safe = make_avro_safe(NameStr(attr->attname), false);
+        field_schema = schema_for_oid(predef, attr->atttypid, attr->atttypmod);
+        avro_schema_record_field_append(record_schema, attname_avro_safe, field_schema);
+        avro_schema_decref(field_schema);
+        free(attname_avro_safe);
+        fields++;
+    }
+
+    ReleaseTupleDesc(tupdesc);
+
+    /* As for tables, avro-c doesn't like record schemas with no fields */
+    if (fields == 0) {
+        field_schema = avro_schema_boolean();
+        avro_schema_record_field_append(record_schema, "dummy", field_schema);
+        avro_schema_decref(field_schema);
+    }
+
+    return record_schema;
+}
+
+/* Generates the Avro name and namespace for a user-defined type. The namespace is
+ * derived from the type's schema in the same way as for tables. Both strings are
+ * malloc'ed, and must be freed by the caller. */
+void type_avro_names(Oid typid, char **name_out, char **namespace_out) {
+    HeapTuple type_tuple;
+    Form_pg_type type_struct;
+    StringInfoData namespace;
+    char *type_namespace;
+
+    type_tuple = SearchSysCache1(TYPEOID, ObjectIdGetDatum(typid));
+    if (!HeapTupleIsValid(type_tuple)) {
+        elog(ERROR, "cache lookup failed for type %u", typid);
+    }
+    type_struct = (Form_pg_type) GETSTRUCT(type_tuple);
+
+    initStringInfo(&namespace);
+    appendStringInfoString(&namespace, GENERATED_SCHEMA_NAMESPACE);
+    type_namespace = get_namespace_name(type_struct->typnamespace);
+    if (type_namespace) appendStringInfo(&namespace, ".%s", type_namespace);
+
+    *name_out = make_avro_safe(NameStr(type_struct->typname), false);
+    *namespace_out = make_avro_safe(namespace.data, true);
+
+    pfree(namespace.data);
+    ReleaseSysCache(type_tuple);
+}
+
+/* A named type can only be defined once in a schema. If a schema has already been
+ * generated for the given type, returns a link to it; otherwise returns NULL. */
+avro_schema_t named_schema_link(predef_schema *predef, Oid typid) {
+    ListCell *lc;
+
+    foreach(lc, predef->named_schemas) {
+        named_schema *entry = (named_schema *) lfirst(lc);
+        if (entry->typid == typid) return avro_schema_link(entry->schema);
+    }
+    return NULL;
+}
+
+void named_schema_add(predef_schema *predef, Oid typid, avro_schema_t schema) {
+    named_schema *entry = palloc(sizeof(named_schema));
+    entry->typid = typid;
+    entry->schema = schema;
+    predef->named_schemas = lappend(predef->named_schemas, entry);
+}
+
+/* Returns the values of an enum type in sort order, and sets *count_out to the number
+ * of values. The array and the labels are palloc'ed. */
+enum_label *enum_labels_for_type(Oid typid, int *count_out) {
+    CatCList *list = SearchSysCacheList1(ENUMTYPOIDNAME, ObjectIdGetDatum(typid));
+    enum_label *labels = palloc(Max(list->n_members, 1) * sizeof(enum_label));
+
+    for (int i = 0; i < list->n_members; i++) {
+        HeapTuple tuple = &list->members[i]->tuple;
+        Form_pg_enum enum_struct = (Form_pg_enum) GETSTRUCT(tuple);
+        labels[i].oid = HeapTupleGetOid(tuple);
+        labels[i].sortorder = enum_struct->enumsortorder;
+        labels[i].label = pstrdup(NameStr(enum_struct->enumlabel));
+    }
+
+    *count_out = list->n_members;
+    ReleaseCatCacheList(list);
+
+    qsort(labels, *count_out, sizeof(enum_label), enum_label_cmp);
+    return labels;
+}
+
+int enum_label_cmp(const void *a, const void *b) {
+    float4 left = ((const enum_label *) a)->sortorder, right = ((const enum_label *) b)->sortorder;
+    return (left < right) ? -1 : (left > right) ? 1 : 0;
 }
 
 avro_schema_t schema_for_special_times(predef_schema *predef, avro_schema_t record_schema) {
@@ -760,8 +1589,26 @@ int update_avro_with_interval(avro_value_t *record_val, Interval *interval) {
     return err;
 }
 
+/* Byte arrays are given to Avro by reference to the payload of the varlena, without
+ * copying it. The varlena may have a short header (only detoasted, not unpacked, by the
+ * caller), and must remain valid until the output value has been encoded. */
 int update_avro_with_bytes(avro_value_t *output_val, bytea *bytes) {
-    return avro_value_set_bytes(output_val, VARDATA(bytes), VARSIZE(bytes) - VARHDRSZ);
+    int err = 0;
+    avro_wrapped_buffer_t buf;
+    check(err, avro_wrapped_buffer_new(&buf, VARDATA_ANY(bytes), VARSIZE_ANY_EXHDR(bytes)));
+    return avro_value_give_bytes(output_val, &buf);
+}
+
+/* Strings are not passed by reference: avro-c counts a NUL terminator in the size of a
+ * string, and may read it (e.g. in avro_value_equal_fast()), but the varlena payload isn't
+ * terminated. So every text value is copied once, by text_to_cstring(), into a palloc'ed
+ * buffer, which is then handed to Avro without a second copy. The buffer lives in the
+ * per-change (or per-batch) memory context, which outlives the encoding of the value. */
+int update_avro_with_text(avro_value_t *output_val, text *str) {
+    int err = 0;
+    avro_wrapped_buffer_t buf;
+    check(err, avro_wrapped_buffer_new(&buf, text_to_cstring(str), VARSIZE_ANY_EXHDR(str) + 1));
+    return avro_value_give_string_len(output_val, &buf);
 }
 
 int update_avro_with_char(avro_value_t *output_val, char c) {
@@ -772,21 +1619,17 @@ int update_avro_with_char(avro_value_t *output_val, char c) {
 }
 
 /* For any datatypes that we don't know, this function converts them into a string
- * representation (which is always required by a datatype). */
-int update_avro_with_string(avro_value_t *output_val, Oid typid, Datum pg_datum) {
+ * representation (which is always required by a datatype). As in printtup(), the
+ * caller looks up the type's output function once and passes in the cached info. */
+int update_avro_with_string(avro_value_t *output_val, FmgrInfo *output_func, bool is_varlena, Datum pg_datum) {
     int err = 0;
-    Oid output_func;
-    bool is_varlena = false;
     char *str;
 
-    getTypeOutputInfo(typid, &output_func, &is_varlena);
     if (is_varlena) {
         pg_datum = PointerGetDatum(PG_DETOAST_DATUM(pg_datum));
     }
 
-    /* This looks up the output function by OID on every call. Might be a bit faster
-     * to do cache the output function info (like how printtup() does it). */
-    str = OidOutputFunctionCall(output_func, pg_datum);
+    str = OutputFunctionCall(output_func, pg_datum);
     err = avro_value_set_string(output_val, str);
     pfree(str);
 
@@ -828,10 +1671,9 @@ static char *make_avro_safe(const char *raw, bool is_namespace) {
      * wasteful in the common case, but we expect this will get freed soon, and
      * anyway these are unlikely to be very large strings.
      *
-     * (To be precise, we never need to encode the null terminator byte, and
-     * thus this always wastes at least three bytes.) */
+     * The null terminator needs one more byte. */
     char *pe = NULL;
-    char *encoded = malloc(4 * length); if(!encoded) return NULL; strcpy(encoded, "1");
+    char *encoded = malloc(4 * length + 1); if(!encoded) return NULL;
     pe = encoded;
     for (size_t index = 0; index < length; ++index) {
         const char c = raw[index];
@@ -4,16 +4,58 @@
 #include "avro.h"
 #include "postgres.h"
 #include "access/htup.h"
+#include "fmgr.h"
 #include "utils/rel.h"
 
 #define GENERATED_SCHEMA_NAMESPACE "com.martinkl.bottledwater.dbschema"
 #define PREDEFINED_SCHEMA_NAMESPACE "com.martinkl.bottledwater.datatypes"
 
+typedef struct column_encoder column_encoder;
+typedef struct encode_plan encode_plan;
+
+/* Translates a non-null Postgres datum into an Avro value */
+typedef int (*column_encoder_fn)(avro_value_t *, column_encoder *, Datum);
+
+struct column_encoder {
+    AttrNumber          attnum;        /* 0-based position of the column in a row of the table */
+    AttrNumber          tupattnum;     /* Same as attnum, but not counting dropped columns */
+    Oid                 typid;         /* Type of the column */
+    int32               typmod;        /* Type modifier of the column (e.g. precision and scale of a numeric) */
+    bool                handles_union; /* If true, encode is given the union with null, not its non-null branch */
+    bool                unchanged_toast; /* If true, the last branch of the column's union marks an unchanged TOASTed value */
+    column_encoder_fn   encode;        /* Function that translates a value of this column */
+    FmgrInfo            output_func;   /* Type's output function, for types encoded as strings */
+    bool                output_varlena; /* True if the output function takes a varlena argument */
+    column_encoder     *element;       /* Encoder for the elements, if the column is an array */
+    int16               elmlen;        /* Storage properties of the element type, */
+    bool                elmbyval;      /*   as required by deconstruct_array() */
+    char                elmalign;
+    int                 enum_count;    /* Number of values, if the column is an enum */
+    Oid                *enum_oids;     /* OIDs of the enum values, in order of the Avro enum symbols */
+    TupleDesc           row_tupdesc;   /* Attributes of the type, if the column is a composite type */
+    encode_plan        *row_plan;      /* Plan for translating the attributes into a nested record */
+    Datum              *row_values;    /* Buffers for deforming composite values */
+    bool               *row_isnull;
+};
+
+/* Precompiled plan for translating rows of a table into Avro records */
+struct encode_plan {
+    int                 natts;         /* Number of fields in the Avro record */
+    int                 table_natts;   /* Number of attributes of the table, including dropped ones */
+    column_encoder     *columns;       /* One encoder for each field of the Avro record */
+};
+
 Relation table_key_index(Relation rel);
 int schema_for_table_key(Relation rel, avro_schema_t *schema_out);
-int schema_for_table_row(Relation rel, avro_schema_t *schema_out);
-int tuple_to_avro_row(avro_value_t *output_val, TupleDesc tupdesc, HeapTuple tuple);
-int tuple_to_avro_key(avro_value_t *output_val, TupleDesc tupdesc, HeapTuple tuple,
-        Relation rel, Form_pg_index key_index);
+int schema_for_table_row(Relation rel, TupleDesc tupdesc, bool unchanged_toast, avro_schema_t *schema_out);
+encode_plan *encode_plan_new(TupleDesc tupdesc, int natts, const AttrNumber *attnums, bool unchanged_toast);
+bool column_is_toastable(Form_pg_attribute attr);
+void encode_plan_free(encode_plan *plan);
+bool encode_plan_changed(encode_plan *plan);
+void encode_plan_type_relids(encode_plan *plan, List **relids);
+int table_schema_to_json(avro_schema_t record_schema, TupleDesc tupdesc, avro_writer_t writer);
+int tuple_to_avro_record(avro_value_t *output_val, encode_plan *plan, TupleDesc tupdesc,
+        Datum *values, bool *isnull);
+int tuple_to_avro_field(avro_value_t *field_val, column_encoder *column, Datum value, bool isnull);
 
 #endif /* OID2AVRO_H */
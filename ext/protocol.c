@@ -11,6 +11,9 @@ avro_schema_t schema_for_table_schema(void);
 avro_schema_t schema_for_insert(void);
 avro_schema_t schema_for_update(void);
 avro_schema_t schema_for_delete(void);
+avro_schema_t schema_for_fragment(void);
+avro_schema_t schema_for_update_delta(void);
+avro_schema_t schema_for_compressed(void);
 avro_schema_t nullable_schema(avro_schema_t value_schema);
 
 avro_schema_t schema_for_frame() {
@@ -47,6 +50,21 @@ avro_schema_t schema_for_frame() {
     avro_schema_union_append(union_schema, branch_schema);
     avro_schema_decref(branch_schema);
 
+    assert(avro_schema_union_size(union_schema) == PROTOCOL_MSG_FRAGMENT);
+    branch_schema = schema_for_fragment();
+    avro_schema_union_append(union_schema, branch_schema);
+    avro_schema_decref(branch_schema);
+
+    assert(avro_schema_union_size(union_schema) == PROTOCOL_MSG_UPDATE_DELTA);
+    branch_schema = schema_for_update_delta();
+    avro_schema_union_append(union_schema, branch_schema);
+    avro_schema_decref(branch_schema);
+
+    assert(avro_schema_union_size(union_schema) == PROTOCOL_MSG_COMPRESSED);
+    branch_schema = schema_for_compressed();
+    avro_schema_union_append(union_schema, branch_schema);
+    avro_schema_decref(branch_schema);
+
     array_schema = avro_schema_array(union_schema);
     avro_schema_decref(union_schema);
 
@@ -156,6 +174,67 @@ avro_schema_t schema_for_delete() {
     return record_schema;
 }
 
+avro_schema_t schema_for_fragment() {
+    avro_schema_t record_schema = avro_schema_record("Fragment", PROTOCOL_SCHEMA_NAMESPACE);
+
+    avro_schema_t field_schema = avro_schema_bytes();
+    avro_schema_record_field_append(record_schema, "data", field_schema);
+    avro_schema_decref(field_schema);
+
+    field_schema = avro_schema_boolean();
+    avro_schema_record_field_append(record_schema, "last", field_schema);
+    avro_schema_decref(field_schema);
+
+    return record_schema;
+}
+
+/* An update that contains only the columns whose values were changed. "changed" is a
+ * bitmap of the fields of the row schema (bit i % 8 of byte i / 8 is set if field i
+ * changed), and "changedFields" is the concatenation of the binary encodings of the
+ * changed fields, in field order. */
+avro_schema_t schema_for_update_delta() {
+    avro_schema_t record_schema = avro_schema_record("UpdateDelta", PROTOCOL_SCHEMA_NAMESPACE);
+
+    avro_schema_t field_schema = avro_schema_long();
+    avro_schema_record_field_append(record_schema, "relid", field_schema);
+    avro_schema_decref(field_schema);
+
+    field_schema = nullable_schema(avro_schema_bytes());
+    avro_schema_record_field_append(record_schema, "key", field_schema);
+    avro_schema_decref(field_schema);
+
+    field_schema = avro_schema_bytes();
+    avro_schema_record_field_append(record_schema, "changed", field_schema);
+    avro_schema_decref(field_schema);
+
+    field_schema = avro_schema_bytes();
+    avro_schema_record_field_append(record_schema, "changedFields", field_schema);
+    avro_schema_decref(field_schema);
+
+    return record_schema;
+}
+
+/* A frame that was compressed with the given codec (PROTOCOL_CODEC_*). "length" is the
+ * length of the frame before compression, so that the client can allocate a buffer of
+ * the right size up front. */
+avro_schema_t schema_for_compressed() {
+    avro_schema_t record_schema = avro_schema_record("Compressed", PROTOCOL_SCHEMA_NAMESPACE);
+
+    avro_schema_t field_schema = avro_schema_int();
+    avro_schema_record_field_append(record_schema, "codec", field_schema);
+    avro_schema_decref(field_schema);
+
+    field_schema = avro_schema_long();
+    avro_schema_record_field_append(record_schema, "length", field_schema);
+    avro_schema_decref(field_schema);
+
+    field_schema = avro_schema_bytes();
+    avro_schema_record_field_append(record_schema, "data", field_schema);
+    avro_schema_decref(field_schema);
+
+    return record_schema;
+}
+
 avro_schema_t nullable_schema(avro_schema_t value_schema) {
     avro_schema_t null_schema = avro_schema_null();
     avro_schema_t union_schema = avro_schema_union();
@@ -22,6 +22,31 @@
 #define PROTOCOL_MSG_INSERT         3
 #define PROTOCOL_MSG_UPDATE         4
 #define PROTOCOL_MSG_DELETE         5
+#define PROTOCOL_MSG_FRAGMENT       6
+#define PROTOCOL_MSG_UPDATE_DELTA   7
+#define PROTOCOL_MSG_COMPRESSED     8
+
+/* Frames that are larger than this (in bytes) are split into several smaller frames,
+ * each containing one fragment message. The client concatenates the data of the
+ * fragments, and parses the result as a frame when the last fragment arrives. This
+ * keeps the size of individual messages bounded, even for very large rows. */
+#define PROTOCOL_MAX_FRAGMENT_LENGTH 1048576
+
+/* If compression is enabled, a frame may be replaced by a frame containing one
+ * compressed message, whose data is the compressed encoding of the original frame.
+ * Compression is applied before fragmentation, so the reassembled data of a sequence
+ * of fragments may itself be a compressed frame. Frames shorter than this (in bytes)
+ * are not worth compressing, and are always sent as they are. */
+#define PROTOCOL_MIN_COMPRESS_LENGTH 256
+
+/* Codecs of compressed messages. The value 0 is not used on the wire; it stands for
+ * "no compression" in the option parsing. */
+#define PROTOCOL_CODEC_NONE 0
+#define PROTOCOL_CODEC_ZLIB 1
+
+/* Values of the compression option of the output plugin and bottledwater_export */
+#define PROTOCOL_COMPRESSION_NONE "none"
+#define PROTOCOL_COMPRESSION_ZLIB "zlib"
 
 
 /* Error policies, determining what the snapshot function and output plugin
@@ -44,6 +69,17 @@
 #define PROTOCOL_ERROR_POLICY_LOG "log"
 
 
+/* Values of the output plugin's old_values option, determining how much of the old
+ * version of a row is sent with updates and deletes.
+ */
+/* The default is "full": whenever the old row is known (which depends on the table's
+ * replica identity), it is encoded and sent along with the update or delete. */
+#define PROTOCOL_OLD_VALUES_FULL "full"
+/* Under "key", the old row is not sent. The old key is still decoded, so that an
+ * update which changes the key is sent as a delete of the old key and an insert. */
+#define PROTOCOL_OLD_VALUES_KEY "key"
+
+
 avro_schema_t schema_for_frame(void);
 
 #endif /* PROTOCOL_H */
@@ -1,5 +1,12 @@
 /* Conversion of Postgres server-side structures into the wire protocol, which
- * is emitted by the output plugin and consumed by the client. */
+ * is emitted by the output plugin and consumed by the client.
+ *
+ * Frames are written in Avro binary encoding directly into a StringInfo buffer (in
+ * the output plugin, that is ctx->out), rather than being built up as an Avro value
+ * and serialized afterwards. A frame is a record with one field, an array of messages
+ * (see schema_for_frame() in protocol.c). Each message is written as an array block
+ * containing one element, so we don't need to know the number of messages up front,
+ * and close_frame() writes the empty block that terminates the array. */
 
 #include "protocol_server.h"
 #include "io_util.h"
@@ -7,283 +14,454 @@
 
 #include <stdarg.h>
 #include <string.h>
+#include <zlib.h>
 #include "access/heapam.h"
-
-int extract_tuple_key(schema_cache_entry *entry, Relation rel, TupleDesc tupdesc, HeapTuple tuple, bytea **key_out);
-int update_frame_with_table_schema(avro_value_t *frame_val, schema_cache_entry *entry);
-int update_frame_with_insert_raw(avro_value_t *frame_val, Oid relid, bytea *key_bin, bytea *new_bin);
-int update_frame_with_update_raw(avro_value_t *frame_val, Oid relid, bytea *key_bin, bytea *old_bin, bytea *new_bin);
-int update_frame_with_delete_raw(avro_value_t *frame_val, Oid relid, bytea *key_bin, bytea *old_bin);
+#include "access/htup_details.h"
+#include "catalog/pg_class.h"
+#include "utils/datum.h"
+
+int tuple_to_avro(schema_cache_entry *entry, TupleDesc tupdesc, HeapTuple tuple, avro_value_t *key_val, avro_value_t *row_val);
+int update_frame_with_table_schema(StringInfo frame, schema_cache_entry *entry);
+int update_frame_with_insert_tuple(StringInfo frame, schema_cache_entry *entry, TupleDesc tupdesc, HeapTuple newtuple);
+int update_frame_with_delete_tuple(StringInfo frame, schema_cache_entry *entry, TupleDesc tupdesc, HeapTuple oldtuple, old_values_t old_values);
+int update_frame_with_insert_raw(StringInfo frame, Oid relid, avro_value_t *key_val, avro_value_t *new_val);
+int update_frame_with_update_raw(StringInfo frame, Oid relid, avro_value_t *key_val, avro_value_t *old_val, avro_value_t *new_val);
+int update_frame_with_update_delta(StringInfo frame, schema_cache_entry *entry, Oid relid, TupleDesc tupdesc, avro_value_t *key_val);
+int update_frame_with_delete_raw(StringInfo frame, Oid relid, avro_value_t *key_val, avro_value_t *old_val);
+void append_frame_message(StringInfo frame, int msg_type);
+int append_nullable_value_bytes(StringInfo frame, avro_value_t *value);
 
 /* Populates a wire protocol message for a "begin transaction" event. */
-int update_frame_with_begin_txn(avro_value_t *frame_val, ReorderBufferTXN *txn) {
-    int err = 0;
-    avro_value_t msg_val, union_val, record_val, xid_val;
-
-    check(err, avro_value_get_by_index(frame_val, 0, &msg_val, NULL));
-    check(err, avro_value_append(&msg_val, &union_val, NULL));
-    check(err, avro_value_set_branch(&union_val, PROTOCOL_MSG_BEGIN_TXN, &record_val));
-    check(err, avro_value_get_by_index(&record_val, 0, &xid_val, NULL));
-    check(err, avro_value_set_long(&xid_val, txn->xid));
-    return err;
+int update_frame_with_begin_txn(StringInfo frame, ReorderBufferTXN *txn) {
+    append_frame_message(frame, PROTOCOL_MSG_BEGIN_TXN);
+    append_avro_long(frame, txn->xid);
+    return 0;
 }
 
 /* Populates a wire protocol message for a "commit transaction" event. */
-int update_frame_with_commit_txn(avro_value_t *frame_val, ReorderBufferTXN *txn,
+int update_frame_with_commit_txn(StringInfo frame, ReorderBufferTXN *txn,
         XLogRecPtr commit_lsn) {
-    int err = 0;
-    avro_value_t msg_val, union_val, record_val, xid_val, lsn_val;
-
-    check(err, avro_value_get_by_index(frame_val, 0, &msg_val, NULL));
-    check(err, avro_value_append(&msg_val, &union_val, NULL));
-    check(err, avro_value_set_branch(&union_val, PROTOCOL_MSG_COMMIT_TXN, &record_val));
-    check(err, avro_value_get_by_index(&record_val, 0, &xid_val, NULL));
-    check(err, avro_value_get_by_index(&record_val, 1, &lsn_val, NULL));
-    check(err, avro_value_set_long(&xid_val, txn->xid));
-    check(err, avro_value_set_long(&lsn_val, commit_lsn));
-    return err;
+    append_frame_message(frame, PROTOCOL_MSG_COMMIT_TXN);
+    append_avro_long(frame, txn->xid);
+    append_avro_long(frame, commit_lsn);
+    return 0;
 }
 
-/* If we're using a primary key/replica identity index for a given table, this
- * function extracts that index' columns from a row tuple, and encodes the values
- * as an Avro string using the table's key schema. */
-int extract_tuple_key(schema_cache_entry *entry, Relation rel, TupleDesc tupdesc, HeapTuple tuple, bytea **key_out) {
-    int err = 0;
-    Relation index_rel;
+/* Populates a wire protocol message containing a slice of a larger frame, which is
+ * being split because it exceeds PROTOCOL_MAX_FRAGMENT_LENGTH. last is true for the
+ * slice at the end of the larger frame. */
+void update_frame_with_fragment(StringInfo frame, const char *data, int len, bool last) {
+    append_frame_message(frame, PROTOCOL_MSG_FRAGMENT);
+    append_avro_bytes(frame, data, len);
+    appendStringInfoChar(frame, last ? 1 : 0);
+}
 
-    if (entry->key_schema) {
-        check(err, avro_value_reset(&entry->key_value));
+/* Terminates the array of messages in a frame. Must be called exactly once, after
+ * all messages have been added to the frame. */
+void close_frame(StringInfo frame) {
+    append_avro_long(frame, 0);
+}
 
-        index_rel = table_key_index(rel);
-        err = tuple_to_avro_key(&entry->key_value, tupdesc, tuple, rel, index_rel->rd_index);
-        relation_close(index_rel, AccessShareLock);
+/* Replaces the closed frame that starts at the given offset in the buffer with a frame
+ * containing one compressed message, if compression makes the frame smaller. The
+ * frame is compressed into a separate buffer before it is overwritten. Favours speed
+ * over compression ratio, since this runs for every frame we send. */
+void compress_frame(StringInfo frame, int start, int codec) {
+    uLong len = frame->len - start;
+    uLongf compressed_len;
+    Bytef *compressed;
+    int ret;
 
-        if (err) {
-            return err;
-        }
+    if (codec == PROTOCOL_CODEC_NONE || len < PROTOCOL_MIN_COMPRESS_LENGTH) return;
 
-        check(err, try_writing(key_out, &write_avro_binary, &entry->key_value));
+    if (codec != PROTOCOL_CODEC_ZLIB) {
+        elog(ERROR, "compress_frame: unknown codec %d", codec);
+    }
+
+    compressed_len = compressBound(len);
+    compressed = palloc(compressed_len);
+    ret = compress2(compressed, &compressed_len, (Bytef *) frame->data + start, len, Z_BEST_SPEED);
+    if (ret != Z_OK) {
+        elog(ERROR, "compress_frame: zlib compression failed with code %d", ret);
+    }
+
+    if (compressed_len < len) {
+        truncate_frame(frame, start);
+        append_frame_message(frame, PROTOCOL_MSG_COMPRESSED);
+        append_avro_long(frame, codec);
+        append_avro_long(frame, len);
+        append_avro_bytes(frame, (const char *) compressed, compressed_len);
+        close_frame(frame);
+    }
+    pfree(compressed);
+}
+
+/* Parses the value of the compression option of the output plugin or snapshot function
+ * (see PROTOCOL_COMPRESSION_* in protocol.h), and returns the corresponding codec. */
+int parse_compression(const char *name) {
+    if (strcmp(name, PROTOCOL_COMPRESSION_NONE) == 0) {
+        return PROTOCOL_CODEC_NONE;
+    } else if (strcmp(name, PROTOCOL_COMPRESSION_ZLIB) == 0) {
+        return PROTOCOL_CODEC_ZLIB;
+    }
+
+    ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("Unknown compression \"%s\" (expected \"%s\" or \"%s\")",
+                    name, PROTOCOL_COMPRESSION_NONE, PROTOCOL_COMPRESSION_ZLIB)));
+    return PROTOCOL_CODEC_NONE; /* not reached */
+}
+
+/* Translates a tuple into Avro, using the encode plans in the schema cache entry. The
+ * tuple is deformed once, and then the key (if key_val is non-NULL; it must use the
+ * table's key schema) and the row (if row_val is non-NULL) are both taken from the
+ * deformed values. */
+int tuple_to_avro(schema_cache_entry *entry, TupleDesc tupdesc, HeapTuple tuple,
+        avro_value_t *key_val, avro_value_t *row_val) {
+    int err = 0;
+
+    /* A snapshot result set omits dropped columns, so it never has more attributes
+     * than the table. */
+    if (tupdesc->natts > entry->row_tupdesc->natts) {
+        elog(ERROR, "tuple has %d attributes, but table has only %d",
+                tupdesc->natts, entry->row_tupdesc->natts);
+    }
+
+    heap_deform_tuple(tuple, tupdesc, entry->values, entry->isnull);
+
+    if (key_val) {
+        check(err, tuple_to_avro_record(key_val, entry->key_plan, tupdesc, entry->values, entry->isnull));
+    }
+    if (row_val) {
+        check(err, tuple_to_avro_record(row_val, entry->row_plan, tupdesc, entry->values, entry->isnull));
     }
     return err;
 }
 
-/* Updates the given frame value with a tuple inserted into a table. The table
+/* Updates the given frame with a tuple inserted into a table. The table
  * schema is automatically included in the frame if it's not in the cache. This
  * function is used both during snapshot and during stream replication.
  *
  * The TupleDesc parameter is not redundant. During stream replication, it is just
  * RelationGetDescr(rel), but during snapshot it is taken from the result set.
  * The difference is that the result set tuple has dropped (logically invisible)
- * columns omitted. */
-int update_frame_with_insert(avro_value_t *frame_val, schema_cache_t cache, Relation rel, TupleDesc tupdesc, HeapTuple newtuple) {
+ * columns omitted.
+ *
+ * If the row does not pass the table's row filter, no insert message is added to the
+ * frame (though the table schema may still be). */
+int update_frame_with_insert(StringInfo frame, schema_cache_t cache, Relation rel, TupleDesc tupdesc, HeapTuple newtuple) {
     int err = 0;
     schema_cache_entry *entry;
-    bytea *key_bin = NULL, *new_bin = NULL;
 
     int changed = schema_cache_lookup(cache, rel, &entry);
     if (changed < 0) {
         return EINVAL;
     } else if (changed) {
-        check(err, update_frame_with_table_schema(frame_val, entry));
+        check(err, update_frame_with_table_schema(frame, entry));
     }
 
-    check(err, extract_tuple_key(entry, rel, tupdesc, newtuple, &key_bin));
-    check(err, avro_value_reset(&entry->row_value));
-    check(err, tuple_to_avro_row(&entry->row_value, tupdesc, newtuple));
-    check(err, try_writing(&new_bin, &write_avro_binary, &entry->row_value));
-    check(err, update_frame_with_insert_raw(frame_val, RelationGetRelid(rel), key_bin, new_bin));
+    if (!schema_cache_row_matches(entry, tupdesc, newtuple)) return 0;
 
-    if (key_bin) pfree(key_bin);
-    pfree(new_bin);
-    return err;
+    return update_frame_with_insert_tuple(frame, entry, tupdesc, newtuple);
+}
+
+/* Adds an insert message for the given tuple to the frame, without applying the row filter. */
+int update_frame_with_insert_tuple(StringInfo frame, schema_cache_entry *entry, TupleDesc tupdesc,
+        HeapTuple newtuple) {
+    int err = 0;
+    avro_value_t *key_val = NULL;
+
+    if (entry->key_schema) key_val = &entry->key_value;
+    check(err, tuple_to_avro(entry, tupdesc, newtuple, key_val, &entry->row_value));
+    return update_frame_with_insert_raw(frame, entry->relid, key_val, &entry->row_value);
 }
 
 /* Updates the given frame with information about a table row that was modified.
- * This is used only during stream replication. */
-int update_frame_with_update(avro_value_t *frame_val, schema_cache_t cache, Relation rel, HeapTuple oldtuple, HeapTuple newtuple) {
+ * This is used only during stream replication. old_values determines how much of
+ * the old row (if known) is decoded and sent.
+ *
+ * If the table has REPLICA IDENTITY FULL, the row filter is applied to both versions
+ * of the row: an update that makes a row match the filter is sent as an insert, and
+ * one that makes it stop matching is sent as a delete. For other tables, the old row
+ * is not known in full, so the filter is only applied to the new version: an update
+ * that makes a row stop matching is not sent at all, and consumers keep the last
+ * version of the row that matched.
+ *
+ * If delta is true and the complete old row is known (i.e. the table has REPLICA
+ * IDENTITY FULL), an update delta message is sent instead, which contains only the
+ * columns whose values were changed by the update (see schema_for_update_delta()).
+ * In that case, old_values is ignored. */
+int update_frame_with_update(StringInfo frame, schema_cache_t cache, Relation rel, HeapTuple oldtuple,
+        HeapTuple newtuple, old_values_t old_values, bool delta) {
     int err = 0;
     schema_cache_entry *entry;
-    bytea *old_bin = NULL, *new_bin = NULL, *old_key_bin = NULL, *new_key_bin = NULL;
+    avro_value_t *old_key_val = NULL, *new_key_val = NULL, *old_row_val = NULL;
+    bool new_matches, use_delta;
+    TupleDesc tupdesc = RelationGetDescr(rel);
 
     int changed = schema_cache_lookup(cache, rel, &entry);
     if (changed < 0) {
         return EINVAL;
     } else if (changed) {
-        check(err, update_frame_with_table_schema(frame_val, entry));
+        check(err, update_frame_with_table_schema(frame, entry));
+    }
+
+    new_matches = schema_cache_row_matches(entry, tupdesc, newtuple);
+
+    if (entry->row_filter && oldtuple && rel->rd_rel->relreplident == REPLICA_IDENTITY_FULL) {
+        bool old_matches = schema_cache_row_matches(entry, tupdesc, oldtuple);
+
+        if (old_matches && !new_matches) {
+            return update_frame_with_delete_tuple(frame, entry, tupdesc, oldtuple, old_values);
+        } else if (!old_matches && new_matches) {
+            return update_frame_with_insert_tuple(frame, entry, tupdesc, newtuple);
+        }
     }
 
+    if (!new_matches) return 0;
+
+    use_delta = delta && oldtuple && rel->rd_rel->relreplident == REPLICA_IDENTITY_FULL;
+
+    if (use_delta) {
+        /* Keep the old values deformed, so that they can be compared to the new ones. */
+        heap_deform_tuple(oldtuple, tupdesc, entry->old_values, entry->old_isnull);
+        if (entry->key_schema) {
+            old_key_val = &entry->old_key_value;
+            check(err, tuple_to_avro_record(old_key_val, entry->key_plan, tupdesc,
+                        entry->old_values, entry->old_isnull));
+        }
+
     /* oldtuple is non-NULL when replident = FULL, or when replident = DEFAULT and there is no
-     * primary key, or replident = DEFAULT and the primary key was not modified by the update. */
-    if (oldtuple) {
-        check(err, extract_tuple_key(entry, rel, RelationGetDescr(rel), oldtuple, &old_key_bin));
-        check(err, avro_value_reset(&entry->row_value));
-        check(err, tuple_to_avro_row(&entry->row_value, RelationGetDescr(rel), oldtuple));
-        check(err, try_writing(&old_bin, &write_avro_binary, &entry->row_value));
+     * primary key, or replident = DEFAULT and the primary key was modified by the update.
+     * The old key is decoded regardless of old_values, since an update that changes the
+     * key must be sent as a delete of the old key and an insert. */
+    } else if (oldtuple) {
+        if (entry->key_schema) old_key_val = &entry->old_key_value;
+        if (old_values == OLD_VALUES_FULL) old_row_val = &entry->old_row_value;
+        if (old_key_val || old_row_val) {
+            check(err, tuple_to_avro(entry, tupdesc, oldtuple, old_key_val, old_row_val));
+        }
     }
 
-    check(err, extract_tuple_key(entry, rel, RelationGetDescr(rel), newtuple, &new_key_bin));
-    check(err, avro_value_reset(&entry->row_value));
-    check(err, tuple_to_avro_row(&entry->row_value, RelationGetDescr(rel), newtuple));
-    check(err, try_writing(&new_bin, &write_avro_binary, &entry->row_value));
+    if (entry->key_schema) new_key_val = &entry->key_value;
+    check(err, tuple_to_avro(entry, tupdesc, newtuple, new_key_val, use_delta ? NULL : &entry->row_value));
 
-    if (old_key_bin != NULL && (VARSIZE(old_key_bin) != VARSIZE(new_key_bin) ||
-            memcmp(VARDATA(old_key_bin), VARDATA(new_key_bin), VARSIZE(new_key_bin) - VARHDRSZ) != 0)) {
+    if (old_key_val && !avro_value_equal_fast(old_key_val, new_key_val)) {
         /* If the primary key changed, turn the update into a delete and an insert. */
-        check(err, update_frame_with_delete_raw(frame_val, RelationGetRelid(rel), old_key_bin, old_bin));
-        check(err, update_frame_with_insert_raw(frame_val, RelationGetRelid(rel), new_key_bin, new_bin));
+        if (use_delta) {
+            check(err, tuple_to_avro_record(&entry->row_value, entry->row_plan, tupdesc,
+                        entry->values, entry->isnull));
+        }
+        check(err, update_frame_with_delete_raw(frame, RelationGetRelid(rel), old_key_val, old_row_val));
+        check(err, update_frame_with_insert_raw(frame, RelationGetRelid(rel), new_key_val, &entry->row_value));
+    } else if (use_delta) {
+        check(err, update_frame_with_update_delta(frame, entry, RelationGetRelid(rel), tupdesc, new_key_val));
     } else {
-        check(err, update_frame_with_update_raw(frame_val, RelationGetRelid(rel), new_key_bin, old_bin, new_bin));
+        check(err, update_frame_with_update_raw(frame, RelationGetRelid(rel), new_key_val, old_row_val, &entry->row_value));
     }
-
-    if (old_key_bin) pfree(old_key_bin);
-    if (new_key_bin) pfree(new_key_bin);
-    if (old_bin) pfree(old_bin);
-    pfree(new_bin);
     return err;
 }
 
 /* Updates the given frame with information about a table row that was deleted.
- * This is used only during stream replication. */
-int update_frame_with_delete(avro_value_t *frame_val, schema_cache_t cache, Relation rel, HeapTuple oldtuple) {
+ * This is used only during stream replication. The row filter can only be applied
+ * if the table has REPLICA IDENTITY FULL, since otherwise the old tuple contains only
+ * the key columns; deletes from other tables are always passed through. The key of
+ * the deleted row is always sent, but the rest of the old row only if old_values is
+ * OLD_VALUES_FULL. */
+int update_frame_with_delete(StringInfo frame, schema_cache_t cache, Relation rel, HeapTuple oldtuple,
+        old_values_t old_values) {
     int err = 0;
     schema_cache_entry *entry;
-    bytea *key_bin = NULL, *old_bin = NULL;
 
     int changed = schema_cache_lookup(cache, rel, &entry);
     if (changed < 0) {
         return EINVAL;
     } else if (changed) {
-        check(err, update_frame_with_table_schema(frame_val, entry));
+        check(err, update_frame_with_table_schema(frame, entry));
     }
 
-    if (oldtuple) {
-        check(err, extract_tuple_key(entry, rel, RelationGetDescr(rel), oldtuple, &key_bin));
-        check(err, avro_value_reset(&entry->row_value));
-        check(err, tuple_to_avro_row(&entry->row_value, RelationGetDescr(rel), oldtuple));
-        check(err, try_writing(&old_bin, &write_avro_binary, &entry->row_value));
+    if (oldtuple && rel->rd_rel->relreplident == REPLICA_IDENTITY_FULL &&
+            !schema_cache_row_matches(entry, RelationGetDescr(rel), oldtuple)) {
+        return 0;
     }
 
-    check(err, update_frame_with_delete_raw(frame_val, RelationGetRelid(rel), key_bin, old_bin));
+    return update_frame_with_delete_tuple(frame, entry, RelationGetDescr(rel), oldtuple, old_values);
+}
 
-    if (key_bin) pfree(key_bin);
-    if (old_bin) pfree(old_bin);
-    return err;
+/* Adds a delete message for the given old tuple (which may be NULL if it is not known)
+ * to the frame, without applying the row filter. */
+int update_frame_with_delete_tuple(StringInfo frame, schema_cache_entry *entry, TupleDesc tupdesc,
+        HeapTuple oldtuple, old_values_t old_values) {
+    int err = 0;
+    avro_value_t *key_val = NULL, *old_val = NULL;
+
+    if (oldtuple) {
+        if (entry->key_schema) key_val = &entry->key_value;
+        if (old_values == OLD_VALUES_FULL) old_val = &entry->row_value;
+        if (key_val || old_val) {
+            check(err, tuple_to_avro(entry, tupdesc, oldtuple, key_val, old_val));
+        }
+    }
+
+    return update_frame_with_delete_raw(frame, entry->relid, key_val, old_val);
 }
 
 /* Sends Avro schemas for a table to the client. This is called the first time we send
  * row-level events for a table, as well as every time the schema changes. All subsequent
  * inserts/updates/deletes are assumed to be encoded with this schema. */
-int update_frame_with_table_schema(avro_value_t *frame_val, schema_cache_entry *entry) {
+int update_frame_with_table_schema(StringInfo frame, schema_cache_entry *entry) {
     int err = 0;
-    avro_value_t msg_val, union_val, record_val, relid_val, key_schema_val,
-                 row_schema_val, branch_val;
     bytea *key_schema_json = NULL, *row_schema_json = NULL;
+    table_schema_json key_table = { entry->key_schema, entry->key_tupdesc };
+    table_schema_json row_table = { entry->row_schema, entry->proj_tupdesc };
 
-    check(err, avro_value_get_by_index(frame_val, 0, &msg_val, NULL));
-    check(err, avro_value_append(&msg_val, &union_val, NULL));
-    check(err, avro_value_set_branch(&union_val, PROTOCOL_MSG_TABLE_SCHEMA, &record_val));
-    check(err, avro_value_get_by_index(&record_val, 0, &relid_val,      NULL));
-    check(err, avro_value_get_by_index(&record_val, 1, &key_schema_val, NULL));
-    check(err, avro_value_get_by_index(&record_val, 2, &row_schema_val, NULL));
-    check(err, avro_value_set_long(&relid_val, entry->relid));
-
+    /* Generate the JSON before writing anything, so that we don't leave a partial
+     * message in the frame if it fails. */
     if (entry->key_schema) {
-        check(err, try_writing(&key_schema_json, &write_schema_json, entry->key_schema));
-        check(err, avro_value_set_branch(&key_schema_val, 1, &branch_val));
-        check(err, avro_value_set_string_len(&branch_val, VARDATA(key_schema_json),
-                    VARSIZE(key_schema_json) - VARHDRSZ + 1));
+        check(err, try_writing(&key_schema_json, &write_table_schema_json, &key_table));
+    }
+    check(err, try_writing(&row_schema_json, &write_table_schema_json, &row_table));
+
+    append_frame_message(frame, PROTOCOL_MSG_TABLE_SCHEMA);
+    append_avro_long(frame, entry->relid);
+
+    if (key_schema_json) {
+        append_avro_long(frame, 1);
+        append_avro_bytes(frame, VARDATA(key_schema_json), VARSIZE(key_schema_json) - VARHDRSZ);
         pfree(key_schema_json);
     } else {
-        check(err, avro_value_set_branch(&key_schema_val, 0, NULL));
+        append_avro_long(frame, 0);
     }
 
-    check(err, try_writing(&row_schema_json, &write_schema_json, entry->row_schema));
-    check(err, avro_value_set_string_len(&row_schema_val, VARDATA(row_schema_json),
-                VARSIZE(row_schema_json) - VARHDRSZ + 1));
+    append_avro_bytes(frame, VARDATA(row_schema_json), VARSIZE(row_schema_json) - VARHDRSZ);
     pfree(row_schema_json);
     return err;
 }
 
-/* Populates a wire protocol message for an insert event. */
-int update_frame_with_insert_raw(avro_value_t *frame_val, Oid relid, bytea *key_bin, bytea *new_bin) {
-    int err = 0;
-    avro_value_t msg_val, union_val, record_val, relid_val, key_val, newrow_val, branch_val;
-
-    check(err, avro_value_get_by_index(frame_val, 0, &msg_val, NULL));
-    check(err, avro_value_append(&msg_val, &union_val, NULL));
-    check(err, avro_value_set_branch(&union_val, PROTOCOL_MSG_INSERT, &record_val));
-    check(err, avro_value_get_by_index(&record_val, 0, &relid_val,  NULL));
-    check(err, avro_value_get_by_index(&record_val, 1, &key_val,    NULL));
-    check(err, avro_value_get_by_index(&record_val, 2, &newrow_val, NULL));
-    check(err, avro_value_set_long(&relid_val, relid));
-    check(err, avro_value_set_bytes(&newrow_val, VARDATA(new_bin), VARSIZE(new_bin) - VARHDRSZ));
-
-    if (key_bin) {
-        check(err, avro_value_set_branch(&key_val, 1, &branch_val));
-        check(err, avro_value_set_bytes(&branch_val, VARDATA(key_bin), VARSIZE(key_bin) - VARHDRSZ));
-    } else {
-        check(err, avro_value_set_branch(&key_val, 0, NULL));
-    }
+/* Populates a wire protocol message for an insert event. key_val is NULL if the
+ * table is unkeyed. */
+int update_frame_with_insert_raw(StringInfo frame, Oid relid, avro_value_t *key_val, avro_value_t *new_val) {
+    int err = 0, start = frame->len;
+
+    append_frame_message(frame, PROTOCOL_MSG_INSERT);
+    append_avro_long(frame, relid);
+
+    err = append_nullable_value_bytes(frame, key_val);
+    if (!err) err = append_avro_value_bytes(frame, new_val);
+
+    if (err) truncate_frame(frame, start);
     return err;
 }
 
-/* Populates a wire protocol message for an update event. */
-int update_frame_with_update_raw(avro_value_t *frame_val, Oid relid, bytea *key_bin,
-        bytea *old_bin, bytea *new_bin) {
-    int err = 0;
-    avro_value_t msg_val, union_val, record_val, relid_val, key_val, oldrow_val, newrow_val, branch_val;
-
-    check(err, avro_value_get_by_index(frame_val, 0, &msg_val, NULL));
-    check(err, avro_value_append(&msg_val, &union_val, NULL));
-    check(err, avro_value_set_branch(&union_val, PROTOCOL_MSG_UPDATE, &record_val));
-    check(err, avro_value_get_by_index(&record_val, 0, &relid_val,  NULL));
-    check(err, avro_value_get_by_index(&record_val, 1, &key_val,    NULL));
-    check(err, avro_value_get_by_index(&record_val, 2, &oldrow_val, NULL));
-    check(err, avro_value_get_by_index(&record_val, 3, &newrow_val, NULL));
-    check(err, avro_value_set_long(&relid_val, relid));
-    check(err, avro_value_set_bytes(&newrow_val, VARDATA(new_bin), VARSIZE(new_bin) - VARHDRSZ));
-
-    if (key_bin) {
-        check(err, avro_value_set_branch(&key_val, 1, &branch_val));
-        check(err, avro_value_set_bytes(&branch_val, VARDATA(key_bin), VARSIZE(key_bin) - VARHDRSZ));
-    } else {
-        check(err, avro_value_set_branch(&key_val, 0, NULL));
+/* Populates a wire protocol message for an update event. key_val is NULL if the
+ * table is unkeyed, and old_val is NULL if the old row is not known. */
+int update_frame_with_update_raw(StringInfo frame, Oid relid, avro_value_t *key_val,
+        avro_value_t *old_val, avro_value_t *new_val) {
+    int err = 0, start = frame->len;
+
+    append_frame_message(frame, PROTOCOL_MSG_UPDATE);
+    append_avro_long(frame, relid);
+
+    err = append_nullable_value_bytes(frame, key_val);
+    if (!err) err = append_nullable_value_bytes(frame, old_val);
+    if (!err) err = append_avro_value_bytes(frame, new_val);
+
+    if (err) truncate_frame(frame, start);
+    return err;
+}
+
+/* Populates a wire protocol message for an update event in which only the changed
+ * columns are sent. The old and new versions of the row must already have been
+ * deformed into entry->old_values and entry->values respectively. Columns are
+ * compared with datumIsEqual(), i.e. by their binary representation, so a value
+ * that was rewritten with a different representation (e.g. recompressed) is
+ * reported as changed even if it is logically equal. A new value that is an on-disk
+ * TOAST pointer was not modified by the update, so it is never reported as changed
+ * (the old value, having been logged in full, would not compare equal to it). */
+int update_frame_with_update_delta(StringInfo frame, schema_cache_entry *entry, Oid relid,
+        TupleDesc tupdesc, avro_value_t *key_val) {
+    int err = 0, start = frame->len;
+    encode_plan *plan = entry->row_plan;
+    int bitmap_len = (plan->natts + 7) / 8;
+    uint8 *changed = palloc0(Max(bitmap_len, 1));
+    StringInfoData fields;
+
+    initStringInfo(&fields);
+
+    for (int field = 0; field < plan->natts && !err; field++) {
+        column_encoder *column = &plan->columns[field];
+        Form_pg_attribute attr = tupdesc->attrs[column->attnum];
+        Datum old_datum = entry->old_values[column->attnum];
+        Datum new_datum = entry->values[column->attnum];
+        bool old_null = entry->old_isnull[column->attnum];
+        bool new_null = entry->isnull[column->attnum];
+        avro_value_t field_val;
+
+        if (old_null && new_null) continue;
+        if (!new_null && attr->attlen == -1 &&
+                VARATT_IS_EXTERNAL_ONDISK(DatumGetPointer(new_datum))) continue;
+        if (!old_null && !new_null &&
+                datumIsEqual(old_datum, new_datum, attr->attbyval, attr->attlen)) continue;
+
+        changed[field / 8] |= 1 << (field % 8);
+
+        err = avro_value_get_by_index(&entry->row_value, field, &field_val, NULL);
+        if (!err) err = tuple_to_avro_field(&field_val, column, new_datum, new_null);
+        if (!err) err = append_avro_value(&fields, &field_val);
     }
 
-    if (old_bin) {
-        check(err, avro_value_set_branch(&oldrow_val, 1, &branch_val));
-        check(err, avro_value_set_bytes(&branch_val, VARDATA(old_bin), VARSIZE(old_bin) - VARHDRSZ));
-    } else {
-        check(err, avro_value_set_branch(&oldrow_val, 0, NULL));
+    if (!err) {
+        append_frame_message(frame, PROTOCOL_MSG_UPDATE_DELTA);
+        append_avro_long(frame, relid);
+        err = append_nullable_value_bytes(frame, key_val);
+    }
+    if (!err) {
+        append_avro_bytes(frame, (const char *) changed, bitmap_len);
+        append_avro_bytes(frame, fields.data, fields.len);
     }
+
+    if (err) truncate_frame(frame, start);
+    pfree(changed);
+    pfree(fields.data);
     return err;
 }
 
-/* Populates a wire protocol message for a delete event. */
-int update_frame_with_delete_raw(avro_value_t *frame_val, Oid relid, bytea *key_bin, bytea *old_bin) {
-    int err = 0;
-    avro_value_t msg_val, union_val, record_val, relid_val, key_val, oldrow_val, branch_val;
-
-    check(err, avro_value_get_by_index(frame_val, 0, &msg_val, NULL));
-    check(err, avro_value_append(&msg_val, &union_val, NULL));
-    check(err, avro_value_set_branch(&union_val, PROTOCOL_MSG_DELETE, &record_val));
-    check(err, avro_value_get_by_index(&record_val, 0, &relid_val,   NULL));
-    check(err, avro_value_get_by_index(&record_val, 1, &key_val,     NULL));
-    check(err, avro_value_get_by_index(&record_val, 2, &oldrow_val,  NULL));
-    check(err, avro_value_set_long(&relid_val, relid));
-
-    if (key_bin) {
-        check(err, avro_value_set_branch(&key_val, 1, &branch_val));
-        check(err, avro_value_set_bytes(&branch_val, VARDATA(key_bin), VARSIZE(key_bin) - VARHDRSZ));
-    } else {
-        check(err, avro_value_set_branch(&key_val, 0, NULL));
-    }
+/* Populates a wire protocol message for a delete event. key_val is NULL if the
+ * table is unkeyed, and old_val is NULL if the old row is not known. */
+int update_frame_with_delete_raw(StringInfo frame, Oid relid, avro_value_t *key_val, avro_value_t *old_val) {
+    int err = 0, start = frame->len;
+
+    append_frame_message(frame, PROTOCOL_MSG_DELETE);
+    append_avro_long(frame, relid);
+
+    err = append_nullable_value_bytes(frame, key_val);
+    if (!err) err = append_nullable_value_bytes(frame, old_val);
+
+    if (err) truncate_frame(frame, start);
+    return err;
+}
 
-    if (old_bin) {
-        check(err, avro_value_set_branch(&oldrow_val, 1, &branch_val));
-        check(err, avro_value_set_bytes(&branch_val, VARDATA(old_bin), VARSIZE(old_bin) - VARHDRSZ));
+/* Starts a new message in a frame: an array block containing one element, followed
+ * by the index of the branch of the message union that identifies the message type. */
+void append_frame_message(StringInfo frame, int msg_type) {
+    append_avro_long(frame, 1);
+    append_avro_long(frame, msg_type);
+}
+
+/* Appends a union of null and bytes, where the bytes are the binary encoding of the
+ * given value. If value is NULL, the null branch is used. */
+int append_nullable_value_bytes(StringInfo frame, avro_value_t *value) {
+    if (value) {
+        append_avro_long(frame, 1);
+        return append_avro_value_bytes(frame, value);
     } else {
-        check(err, avro_value_set_branch(&oldrow_val, 0, NULL));
+        append_avro_long(frame, 0);
+        return 0;
     }
-    return err;
+}
+
+/* Discards anything that was appended to a frame after it had the given length,
+ * e.g. a message that could only be partially written. */
+void truncate_frame(StringInfo frame, int len) {
+    frame->len = len;
+    frame->data[len] = '\0';
 }
@@ -4,12 +4,24 @@
 #include "protocol.h"
 #include "schema_cache.h"
 #include "postgres.h"
+#include "lib/stringinfo.h"
 #include "replication/output_plugin.h"
 
-int update_frame_with_begin_txn(avro_value_t *frame_val, ReorderBufferTXN *txn);
-int update_frame_with_commit_txn(avro_value_t *frame_val, ReorderBufferTXN *txn, XLogRecPtr commit_lsn);
-int update_frame_with_insert(avro_value_t *frame_val, schema_cache_t cache, Relation rel, TupleDesc tupdesc, HeapTuple newtuple);
-int update_frame_with_update(avro_value_t *frame_val, schema_cache_t cache, Relation rel, HeapTuple oldtuple, HeapTuple newtuple);
-int update_frame_with_delete(avro_value_t *frame_val, schema_cache_t cache, Relation rel, HeapTuple oldtuple);
+/* How much of the old version of a row to send (see PROTOCOL_OLD_VALUES_*) */
+typedef enum {
+    OLD_VALUES_FULL = 0,
+    OLD_VALUES_KEY
+} old_values_t;
+
+int update_frame_with_begin_txn(StringInfo frame, ReorderBufferTXN *txn);
+int update_frame_with_commit_txn(StringInfo frame, ReorderBufferTXN *txn, XLogRecPtr commit_lsn);
+int update_frame_with_insert(StringInfo frame, schema_cache_t cache, Relation rel, TupleDesc tupdesc, HeapTuple newtuple);
+int update_frame_with_update(StringInfo frame, schema_cache_t cache, Relation rel, HeapTuple oldtuple, HeapTuple newtuple, old_values_t old_values, bool delta);
+int update_frame_with_delete(StringInfo frame, schema_cache_t cache, Relation rel, HeapTuple oldtuple, old_values_t old_values);
+void update_frame_with_fragment(StringInfo frame, const char *data, int len, bool last);
+void close_frame(StringInfo frame);
+void truncate_frame(StringInfo frame, int len);
+void compress_frame(StringInfo frame, int start, int codec);
+int parse_compression(const char *name);
 
 #endif /* PROTOCOL_SERVER_H */
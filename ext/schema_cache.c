@@ -3,12 +3,69 @@
 #include "schema_cache.h"
 #include "lib/stringinfo.h"
 #include "access/heapam.h"
+#include "access/htup_details.h"
 #include "access/tupdesc.h"
+#include "executor/executor.h"
+#include "optimizer/planner.h"
+#include "parser/parse_clause.h"
+#include "parser/parse_collate.h"
+#include "parser/parse_relation.h"
+#include "parser/parser.h"
+#include "rewrite/rewriteManip.h"
+#include "utils/builtins.h"
+#include "utils/inval.h"
 #include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/syscache.h"
+
+/* Maximum number of relations whose invalidation we track individually. If more
+ * relations than this are invalidated, we forget them all and treat every cache
+ * entry as potentially stale. */
+#define MAX_INVAL_RELIDS 1024
+
+typedef struct {
+    Oid                 relid;       /* Oid of an invalidated relation. Used as hash key, so it must be first in struct */
+    uint64              epoch;       /* Value of inval_epoch when the relation was last invalidated */
+} inval_entry;
+
+typedef struct {
+    List               *table_name;  /* Name of the table, possibly schema-qualified, as a list of String */
+    char               *expr;        /* SQL boolean expression that a row must satisfy to be exported */
+} row_filter;
+
+typedef struct {
+    List               *table_name;  /* Name of the table, possibly schema-qualified, as a list of String */
+    bool                include;     /* If true, only the listed columns are exported; if false, they are omitted */
+    List               *columns;     /* Names of the columns, as a list of char * */
+} column_projection;
+
+/* Relcache invalidation callbacks are registered for the lifetime of the backend
+ * and cannot be unregistered, whereas schema caches come and go (and may not be
+ * freed cleanly if bottledwater_export is aborted). So rather than letting the
+ * callback reach into the caches, we keep a backend-wide record of when each
+ * relation was last invalidated, and each cache entry remembers the epoch at
+ * which it was last known to be valid. */
+static HTAB *inval_relids = NULL;   /* Hash table mapping Oid to inval_entry */
+static uint64 inval_epoch = 1;      /* Incremented on every invalidation */
+static uint64 inval_all_epoch = 0;  /* Epoch at which all relations were last invalidated */
 
 int schema_cache_entry_update(schema_cache_t cache, schema_cache_entry *entry, Relation rel);
+void schema_cache_entry_key_plan(schema_cache_entry *entry, TupleDesc rel_tupdesc, Form_pg_index key_index);
+void schema_cache_entry_row_plan(schema_cache_t cache, schema_cache_entry *entry);
+void schema_cache_entry_row_filter(schema_cache_t cache, schema_cache_entry *entry, Relation rel);
+bool table_name_matches(List *table_name, schema_cache_entry *entry);
+List *parse_table_spec(const char *spec, const char *rest_name, const char **rest_out);
+Node *row_filter_parse(const char *expr);
 bool schema_cache_entry_changed(schema_cache_entry *entry, Relation rel);
+bool schema_cache_entry_key_changed(schema_cache_entry *entry, Relation rel);
+bool schema_cache_entry_invalidated(schema_cache_entry *entry);
 void schema_cache_entry_decrefs(schema_cache_entry *entry);
+void schema_cache_register_callbacks(void);
+void schema_cache_relcache_callback(Datum arg, Oid relid);
+void schema_cache_namespace_callback(Datum arg, int cacheid, uint32 hashvalue);
+void schema_cache_enum_callback(Datum arg, int cacheid, uint32 hashvalue);
+void schema_cache_invalidate_all(void);
+bool schema_cache_invalidated_since(Oid relid, uint64 epoch);
 void tupdesc_debug_info(StringInfo msg, TupleDesc tupdesc);
 
 /* Creates a new schema cache. All palloc allocations for this cache will be
@@ -36,25 +93,108 @@ schema_cache_t schema_cache_new(MemoryContext context) {
 #endif
 
     MemoryContextSwitchTo(oldctx);
+    schema_cache_register_callbacks();
     return cache;
 }
 
+/* Configures a filter for the rows of a table. The spec has the form "table:expression",
+ * where the table name may be schema-qualified, and the expression is a SQL boolean
+ * expression over the table's columns, as it would appear in a WHERE clause. Only rows
+ * for which the expression is true are exported. If several filters name the same
+ * table, the first one is used.
+ *
+ * The table name is not resolved here, since the output plugin cannot look at the
+ * catalogs when it starts up. Instead, the filter is matched against the table name
+ * whenever a schema cache entry is populated. */
+void schema_cache_add_row_filter(schema_cache_t cache, const char *spec) {
+    const char *expr;
+    MemoryContext oldctx = MemoryContextSwitchTo(cache->context);
+    row_filter *filter = palloc(sizeof(row_filter));
+
+    filter->table_name = parse_table_spec(spec, "expression", &expr);
+    filter->expr = pstrdup(expr);
+    cache->row_filters = lappend(cache->row_filters, filter);
+    MemoryContextSwitchTo(oldctx);
+
+    /* Check the syntax now, rather than when the first row of the table is seen. */
+    row_filter_parse(filter->expr);
+}
+
+/* Configures a column projection for a table. The spec has the form "table:columns",
+ * where columns is a comma-separated list of column names. If include is true, only the
+ * listed columns of the table are exported; otherwise all columns except the listed ones
+ * are exported. Several projections for the same table are combined. Like row filters,
+ * projections are matched by table name when a schema cache entry is populated. */
+void schema_cache_add_projection(schema_cache_t cache, const char *spec, bool include) {
+    const char *columns;
+    MemoryContext oldctx = MemoryContextSwitchTo(cache->context);
+    column_projection *projection = palloc(sizeof(column_projection));
+
+    projection->table_name = parse_table_spec(spec, "columns", &columns);
+    projection->include = include;
+
+    if (!SplitIdentifierString(pstrdup(columns), ',', &projection->columns)) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("Column projection \"%s\" has an improper list of column names", spec)));
+    }
+
+    cache->projections = lappend(cache->projections, projection);
+    MemoryContextSwitchTo(oldctx);
+}
+
+/* Parses the table name at the start of a row filter or projection spec, which is
+ * separated from the rest of the spec by a colon. Returns the table name as a list of
+ * String (of length 2 if the name is schema-qualified), and sets *rest_out to point at
+ * the part of the spec after the colon. */
+List *parse_table_spec(const char *spec, const char *rest_name, const char **rest_out) {
+    const char *colon = strchr(spec, ':');
+    List *table_name;
+
+    if (!colon || colon == spec) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("\"%s\" is not of the form table:%s", spec, rest_name)));
+    }
+
+    table_name = stringToQualifiedNameList(pnstrdup(spec, colon - spec));
+    if (list_length(table_name) > 2) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("\"%s\" has an improper table name", spec)));
+    }
+
+    *rest_out = colon + 1;
+    return table_name;
+}
+
 /* Obtains the schema cache entry for the given relation, creating or updating it if necessary.
  * If the schema hasn't changed since the last invocation, a cached value is used and 0 is returned.
  * If the schema has changed, 1 is returned. If the schema has not been seen before, 2 is returned.
- * If an error occurred creating or updating the entry, returns a negative value. */
+ * If an error occurred creating or updating the entry, returns a negative value.
+ *
+ * This is called for every row, so in the common case (no relcache invalidation has
+ * been received for the table since we last looked) it is just a hash table probe. */
 int schema_cache_lookup(schema_cache_t cache, Relation rel, schema_cache_entry **entry_out) {
     Oid relid = RelationGetRelid(rel);
     bool found_entry=false;
+    uint64 epoch;
     int err;
     schema_cache_entry *entry = (schema_cache_entry *)
         hash_search(cache->entries, &relid, HASH_ENTER, &found_entry);
 
     if (found_entry) {
-        if (!schema_cache_entry_changed(entry, rel)) {
+        if (!schema_cache_entry_invalidated(entry)) {
             /* Schema has not changed */
             *entry_out = entry;
             return 0;
+        }
+
+        /* Invalidation messages may be processed while we look at the catalogs,
+         * so note the epoch before comparing. */
+        epoch = inval_epoch;
+        if (!schema_cache_entry_changed(entry, rel)) {
+            /* Relation was invalidated, but not in a way that affects its schema */
+            entry->valid_epoch = epoch;
+            *entry_out = entry;
+            return 0;
 
         } else {
             /* Schema has changed since we last saw it -- update the cache */
@@ -85,6 +225,7 @@ int schema_cache_entry_update(schema_cache_t cache, schema_cache_entry *entry, R
     MemoryContext oldctx;
     int err;
 
+    entry->valid_epoch = inval_epoch;
     entry->relid = RelationGetRelid(rel);
     entry->ns_id = RelationGetNamespace(rel);
     strcpy(NameStr(entry->relname), RelationGetRelationName(rel));
@@ -101,49 +242,253 @@ int schema_cache_entry_update(schema_cache_t cache, schema_cache_entry *entry, R
         entry->keyns_id = InvalidOid;
     }
 
-    /* Make a copy of the tuple descriptors in the cache's memory context */
+    /* Make a copy of the tuple descriptors, and compile the encode plans, in the
+     * cache's memory context */
     oldctx = MemoryContextSwitchTo(cache->context);
     if (index_rel) {
         entry->key_tupdesc = CreateTupleDescCopyConstr(RelationGetDescr(index_rel));
-        relation_close(index_rel, AccessShareLock);
+        schema_cache_entry_key_plan(entry, RelationGetDescr(rel), index_rel->rd_index);
     } else {
         entry->key_tupdesc = NULL;
+        entry->key_plan = NULL;
     }
     entry->row_tupdesc = CreateTupleDescCopyConstr(RelationGetDescr(rel));
+    schema_cache_entry_row_plan(cache, entry);
+    entry->type_relids = NIL;
+    if (entry->key_plan) encode_plan_type_relids(entry->key_plan, &entry->type_relids);
+    encode_plan_type_relids(entry->row_plan, &entry->type_relids);
+    entry->values = palloc(Max(entry->row_tupdesc->natts, 1) * sizeof(Datum));
+    entry->isnull = palloc(Max(entry->row_tupdesc->natts, 1) * sizeof(bool));
+    entry->old_values = palloc(Max(entry->row_tupdesc->natts, 1) * sizeof(Datum));
+    entry->old_isnull = palloc(Max(entry->row_tupdesc->natts, 1) * sizeof(bool));
     MemoryContextSwitchTo(oldctx);
 
-    err = schema_for_table_key(rel, &entry->key_schema);
-    if (err) return err;
-    err = schema_for_table_row(rel, &entry->row_schema);
+    schema_cache_entry_row_filter(cache, entry, rel);
+
+    if (index_rel) {
+        err = schema_for_table_row(index_rel, NULL, false, &entry->key_schema);
+        relation_close(index_rel, AccessShareLock);
+        if (err) return err;
+    } else {
+        entry->key_schema = NULL;
+    }
+    err = schema_for_table_row(rel, entry->proj_tupdesc, cache->unchanged_toast, &entry->row_schema);
     if (err) return err;
     entry->row_iface = avro_generic_class_from_schema(entry->row_schema);
     if (entry->row_iface == NULL) return EINVAL;
     avro_generic_value_new(entry->row_iface, &entry->row_value);
+    avro_generic_value_new(entry->row_iface, &entry->old_row_value);
 
     if (entry->key_schema) {
         entry->key_iface = avro_generic_class_from_schema(entry->key_schema);
         if (entry->key_iface == NULL) return EINVAL;
         avro_generic_value_new(entry->key_iface, &entry->key_value);
+        avro_generic_value_new(entry->key_iface, &entry->old_key_value);
     }
 
     return 0;
 }
 
+/* Compiles the plan for extracting the key from a row of the table. The plan records,
+ * for each column of the key index, where that column can be found in a row tuple of
+ * the table, both with dropped columns (as in stream replication) and without them
+ * (as in the result set of a snapshot query). Doing this once per schema version
+ * means the per-row path never needs to look at the index. */
+void schema_cache_entry_key_plan(schema_cache_entry *entry, TupleDesc rel_tupdesc,
+        Form_pg_index key_index) {
+    int key_natts = key_index->indkey.dim1;
+    AttrNumber *key_attnums = palloc(Max(key_natts, 1) * sizeof(AttrNumber));
+
+    for (int field = 0; field < key_natts; field++) {
+        key_attnums[field] = key_index->indkey.values[field] - 1;
+    }
+
+    entry->key_plan = encode_plan_new(rel_tupdesc, key_natts, key_attnums, false);
+    pfree(key_attnums);
+}
+
+/* Applies any column projections for the table to the cache entry, by making a copy
+ * of the table's tuple descriptor in which the omitted columns are marked as dropped
+ * (from which the row schema is generated), and compiling a row plan that covers only
+ * the remaining columns. Omitted columns are therefore never detoasted or encoded. */
+void schema_cache_entry_row_plan(schema_cache_t cache, schema_cache_entry *entry) {
+    TupleDesc tupdesc = CreateTupleDescCopy(entry->row_tupdesc);
+    AttrNumber *attnums = palloc(Max(tupdesc->natts, 1) * sizeof(AttrNumber));
+    int natts = 0;
+    ListCell *cell, *column;
+
+    foreach(cell, cache->projections) {
+        column_projection *projection = lfirst(cell);
+        if (!table_name_matches(projection->table_name, entry)) continue;
+
+        for (int i = 0; i < tupdesc->natts; i++) {
+            Form_pg_attribute attr = tupdesc->attrs[i];
+            bool listed = false;
+
+            foreach(column, projection->columns) {
+                if (strcmp(NameStr(attr->attname), (char *) lfirst(column)) == 0) listed = true;
+            }
+            if (listed != projection->include) attr->attisdropped = true;
+        }
+    }
+
+    for (int i = 0; i < tupdesc->natts; i++) {
+        if (!tupdesc->attrs[i]->attisdropped) attnums[natts++] = i;
+    }
+
+    entry->proj_tupdesc = tupdesc;
+    entry->row_plan = encode_plan_new(entry->row_tupdesc, natts, attnums, cache->unchanged_toast);
+    pfree(attnums);
+}
+
+/* Compiles the row filter for a table, if one is configured, into an expression that
+ * the executor can evaluate against a row of the table. Like the encode plans, this is
+ * done once per schema version, so the per-row cost is only that of evaluating the
+ * expression. */
+void schema_cache_entry_row_filter(schema_cache_t cache, schema_cache_entry *entry, Relation rel) {
+    row_filter *filter = NULL;
+    ParseState *pstate;
+    RangeTblEntry *rte;
+    Node *expr;
+    MemoryContext oldctx;
+    ListCell *cell;
+
+    entry->row_filter = NULL;
+    entry->filter_estate = NULL;
+    entry->filter_slot = NULL;
+
+    foreach(cell, cache->row_filters) {
+        if (table_name_matches(((row_filter *) lfirst(cell))->table_name, entry)) {
+            filter = lfirst(cell);
+            break;
+        }
+    }
+    if (!filter) return;
+
+    /* Resolve the column references against the table, as in SELECT ... FROM table WHERE expr */
+    pstate = make_parsestate(NULL);
+    rte = addRangeTableEntryForRelation(pstate, rel, NULL, false, false);
+    addRTEtoQuery(pstate, rte, false, true, true);
+    expr = transformWhereClause(pstate, row_filter_parse(filter->expr), EXPR_KIND_WHERE, "WHERE");
+    assign_expr_collations(pstate, expr);
+    free_parsestate(pstate);
+
+    if (checkExprHasSubLink(expr)) {
+        ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                errmsg("Row filter for table \"%s\" must not contain a subquery",
+                    NameStr(entry->relname))));
+    }
+
+    oldctx = MemoryContextSwitchTo(cache->context);
+    entry->filter_estate = CreateExecutorState();
+    MemoryContextSwitchTo(entry->filter_estate->es_query_cxt);
+    entry->row_filter = ExecInitExpr(expression_planner((Expr *) expr), NULL);
+    entry->filter_slot = MakeSingleTupleTableSlot(entry->row_tupdesc);
+    MemoryContextSwitchTo(oldctx);
+}
+
+/* Returns true if the table name of a row filter or projection refers to the table of
+ * a cache entry. An unqualified name matches a table of that name in any schema. */
+bool table_name_matches(List *table_name, schema_cache_entry *entry) {
+    if (strcmp(strVal(llast(table_name)), NameStr(entry->relname)) != 0) return false;
+    return list_length(table_name) == 1 ||
+        strcmp(strVal(linitial(table_name)), NameStr(entry->ns_name)) == 0;
+}
+
+/* Parses a row filter expression, and returns its raw parse tree. The expression is
+ * parsed as the WHERE clause of a query, and anything that would extend the query
+ * beyond that clause (such as ORDER BY, or another statement) is rejected. */
+Node *row_filter_parse(const char *expr) {
+    StringInfoData query;
+    List *parsetree;
+    SelectStmt *stmt = NULL;
+
+    initStringInfo(&query);
+    appendStringInfo(&query, "SELECT 1 WHERE %s", expr);
+    parsetree = raw_parser(query.data);
+
+    if (list_length(parsetree) == 1 && IsA(linitial(parsetree), SelectStmt)) {
+        stmt = (SelectStmt *) linitial(parsetree);
+    }
+
+    if (!stmt || stmt->op != SETOP_NONE || !stmt->whereClause ||
+            stmt->groupClause || stmt->havingClause || stmt->windowClause ||
+            stmt->sortClause || stmt->limitOffset || stmt->limitCount || stmt->lockingClause) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("Row filter \"%s\" is not a single expression", expr)));
+    }
+
+    pfree(query.data);
+    return stmt->whereClause;
+}
+
+/* Returns true if a row of the table passes the table's row filter (i.e. the filter
+ * expression evaluates to true for the row), or if the table has no row filter. This
+ * is checked before the row is encoded, so rows that are filtered out cost only the
+ * evaluation of the expression. */
+bool schema_cache_row_matches(schema_cache_entry *entry, TupleDesc tupdesc, HeapTuple tuple) {
+    TupleTableSlot *slot = entry->filter_slot;
+    ExprContext *econtext;
+    Datum result;
+    bool isnull;
+
+    if (!entry->row_filter) return true;
+
+    if (tupdesc->natts == entry->row_tupdesc->natts) {
+        ExecStoreTuple(tuple, slot, InvalidBuffer, false);
+    } else {
+        /* A snapshot result set omits dropped columns, but the filter expression refers
+         * to columns by their position in the table, so spread the values out. */
+        ExecClearTuple(slot);
+        heap_deform_tuple(tuple, tupdesc, entry->values, entry->isnull);
+
+        for (int i = 0, tup_i = 0; i < entry->row_tupdesc->natts; i++) {
+            if (entry->row_tupdesc->attrs[i]->attisdropped) {
+                slot->tts_values[i] = (Datum) 0;
+                slot->tts_isnull[i] = true;
+            } else {
+                slot->tts_values[i] = entry->values[tup_i];
+                slot->tts_isnull[i] = entry->isnull[tup_i];
+                tup_i++;
+            }
+        }
+        ExecStoreVirtualTuple(slot);
+    }
+
+    econtext = GetPerTupleExprContext(entry->filter_estate);
+    econtext->ecxt_scantuple = slot;
+    result = ExecEvalExprSwitchContext(entry->row_filter, econtext, &isnull, NULL);
+
+    ResetExprContext(econtext);
+    ExecClearTuple(slot);
+    return !isnull && DatumGetBool(result);
+}
+
 /* Returns false if the schema of the given relation matches the cache entry,
  * and returns true if it has changed. This is detected by keeping a copy of
- * the schema information in the cache entry. An alternative way of implementing
- * this might be to use event triggers:
- * http://www.postgresql.org/docs/9.4/static/event-triggers.html */
+ * the schema information in the cache entry. Since this is relatively expensive,
+ * it is only called after a relcache invalidation for the table, its key index
+ * or a composite type used by it (which is how Postgres signals DDL on them), or
+ * a change to a namespace or an enum type. */
 bool schema_cache_entry_changed(schema_cache_entry *entry, Relation rel) {
-    Relation index_rel;
-    bool changed = false;
-
     if (entry->relid != RelationGetRelid(rel)) return true;
     if (entry->ns_id != RelationGetNamespace(rel)) return true;
     if (strcmp(NameStr(entry->relname), RelationGetRelationName(rel)) != 0) return true;
     if (strcmp(NameStr(entry->ns_name), get_namespace_name(entry->ns_id)) != 0) return true;
+    if (schema_cache_entry_key_changed(entry, rel)) return true;
+    if (!equalTupleDescs(entry->row_tupdesc, RelationGetDescr(rel))) return true;
+
+    /* Columns of user-defined types may have changed without the table changing */
+    if (entry->key_plan && encode_plan_changed(entry->key_plan)) return true;
+    return encode_plan_changed(entry->row_plan);
+}
+
+/* Returns true if the primary key or replica identity index of the given relation
+ * differs from the one recorded in the cache entry. */
+bool schema_cache_entry_key_changed(schema_cache_entry *entry, Relation rel) {
+    bool changed = false;
+    Relation index_rel = table_key_index(rel);
 
-    index_rel = table_key_index(rel);
     if (index_rel && OidIsValid(entry->key_id)) {
         if (entry->key_id != RelationGetRelid(index_rel)) changed = true;
         if (entry->keyns_id != RelationGetNamespace(index_rel)) changed = true;
@@ -157,21 +502,51 @@ bool schema_cache_entry_changed(schema_cache_entry *entry, Relation rel) {
     if (index_rel) {
         relation_close(index_rel, AccessShareLock);
     }
-    if (changed) return true;
+    return changed;
+}
+
+/* Returns true if a relcache invalidation for the table, its key index, or the relation
+ * of a composite type used by its columns has been received since the cache entry was
+ * last validated. */
+bool schema_cache_entry_invalidated(schema_cache_entry *entry) {
+    ListCell *cell;
 
-    return !equalTupleDescs(entry->row_tupdesc, RelationGetDescr(rel));
+    if (entry->valid_epoch == inval_epoch) return false;
+    if (schema_cache_invalidated_since(entry->relid, entry->valid_epoch)) return true;
+    if (OidIsValid(entry->key_id) && schema_cache_invalidated_since(entry->key_id, entry->valid_epoch)) return true;
+
+    foreach(cell, entry->type_relids) {
+        if (schema_cache_invalidated_since(lfirst_oid(cell), entry->valid_epoch)) return true;
+    }
+
+    entry->valid_epoch = inval_epoch;
+    return false;
 }
 
 /* Decrements the reference counts for a schema cache entry. */
 void schema_cache_entry_decrefs(schema_cache_entry *entry) {
+    /* The slot refers to row_tupdesc, so it must be dropped first */
+    if (entry->filter_slot) ExecDropSingleTupleTableSlot(entry->filter_slot);
+    if (entry->filter_estate) FreeExecutorState(entry->filter_estate);
+
     if (entry->key_tupdesc) pfree(entry->key_tupdesc);
+    if (entry->key_plan) encode_plan_free(entry->key_plan);
     if (entry->row_tupdesc) pfree(entry->row_tupdesc);
-
+    if (entry->proj_tupdesc) pfree(entry->proj_tupdesc);
+    if (entry->row_plan) encode_plan_free(entry->row_plan);
+    list_free(entry->type_relids);
+    if (entry->values) pfree(entry->values);
+    if (entry->isnull) pfree(entry->isnull);
+    if (entry->old_values) pfree(entry->old_values);
+    if (entry->old_isnull) pfree(entry->old_isnull);
+
+    avro_value_decref(&entry->old_row_value);
     avro_value_decref(&entry->row_value);
     avro_value_iface_decref(entry->row_iface);
     avro_schema_decref(entry->row_schema);
 
     if (entry->key_schema) {
+        avro_value_decref(&entry->old_key_value);
         avro_value_decref(&entry->key_value);
         avro_value_iface_decref(entry->key_iface);
         avro_schema_decref(entry->key_schema);
@@ -194,6 +569,94 @@ void schema_cache_free(schema_cache_t cache) {
     pfree(cache);
 }
 
+/* Registers callbacks that are notified whenever a relcache entry is invalidated
+ * (e.g. because a table or index was altered), or a namespace or enum is changed
+ * (neither renaming a schema nor adding a value to an enum invalidates the relations
+ * that depend on it). This is done at most once per backend,
+ * since there is a small fixed limit on the number of callbacks that can be
+ * registered, and no way of unregistering them. */
+void schema_cache_register_callbacks() {
+    HASHCTL hash_ctl;
+    if (inval_relids) return;
+
+    memset(&hash_ctl, 0, sizeof(hash_ctl));
+    hash_ctl.keysize = sizeof(Oid);
+    hash_ctl.entrysize = sizeof(inval_entry);
+    hash_ctl.hcxt = TopMemoryContext;
+
+#ifdef HASH_BLOBS
+    /* Postgres 9.5 */
+    inval_relids = hash_create("Bottled Water invalidated relations", 32, &hash_ctl,
+            HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+#else
+    /* Postgres 9.4 */
+    hash_ctl.hash = oid_hash;
+    inval_relids = hash_create("Bottled Water invalidated relations", 32, &hash_ctl,
+            HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+#endif
+
+    CacheRegisterRelcacheCallback(schema_cache_relcache_callback, (Datum) 0);
+    CacheRegisterSyscacheCallback(NAMESPACEOID, schema_cache_namespace_callback, (Datum) 0);
+    CacheRegisterSyscacheCallback(ENUMOID, schema_cache_enum_callback, (Datum) 0);
+}
+
+/* Called by Postgres when the relcache entry for relid is invalidated, or with
+ * InvalidOid when the entire relcache is reset. This may be called at almost any
+ * time (whenever invalidation messages are processed), so it must not access the
+ * catalogs; it only records which relation was invalidated. */
+void schema_cache_relcache_callback(Datum arg, Oid relid) {
+    inval_entry *inval;
+
+    if (!OidIsValid(relid) || hash_get_num_entries(inval_relids) >= MAX_INVAL_RELIDS) {
+        schema_cache_invalidate_all();
+        return;
+    }
+
+    inval_epoch++;
+    inval = (inval_entry *) hash_search(inval_relids, &relid, HASH_ENTER, NULL);
+    inval->epoch = inval_epoch;
+}
+
+/* Called by Postgres when a pg_namespace syscache entry is invalidated. Namespace
+ * names are part of every table's schema, and schema changes are rare, so we simply
+ * treat all cache entries as potentially stale. */
+void schema_cache_namespace_callback(Datum arg, int cacheid, uint32 hashvalue) {
+    schema_cache_invalidate_all();
+}
+
+/* Called by Postgres when a pg_enum syscache entry is invalidated, e.g. by ALTER TYPE
+ * ... ADD VALUE. We don't know which tables use the enum, so like namespace changes,
+ * this marks all cache entries as potentially stale; schema_cache_entry_changed() then
+ * compares each entry's enum values with the catalog. */
+void schema_cache_enum_callback(Datum arg, int cacheid, uint32 hashvalue) {
+    schema_cache_invalidate_all();
+}
+
+/* Marks every schema cache entry (in every schema cache) as potentially stale, and
+ * forgets about individually invalidated relations. */
+void schema_cache_invalidate_all() {
+    HASH_SEQ_STATUS iterator;
+    inval_entry *inval;
+
+    inval_epoch++;
+    inval_all_epoch = inval_epoch;
+
+    hash_seq_init(&iterator, inval_relids);
+    while ((inval = (inval_entry *) hash_seq_search(&iterator)) != NULL) {
+        hash_search(inval_relids, &inval->relid, HASH_REMOVE, NULL);
+    }
+}
+
+/* Returns true if the relation with the given Oid has been invalidated after
+ * the given epoch. */
+bool schema_cache_invalidated_since(Oid relid, uint64 epoch) {
+    inval_entry *inval;
+    if (inval_all_epoch > epoch) return true;
+
+    inval = (inval_entry *) hash_search(inval_relids, &relid, HASH_FIND, NULL);
+    return inval != NULL && inval->epoch > epoch;
+}
+
 /* Append debug information about table columns to a string buffer. */
 void tupdesc_debug_info(StringInfo msg, TupleDesc tupdesc) {
     for (int i = 0; i < tupdesc->natts; i++) {
@@ -2,6 +2,7 @@
 #define SCHEMA_CACHE_H
 
 #include "oid2avro.h"
+#include "nodes/execnodes.h"
 #include "utils/hsearch.h"
 
 typedef struct {
@@ -14,24 +15,44 @@ typedef struct {
     Oid                 keyns_id;    /* Oid of the namespace of the primary key index */
     NameData            keyns_name;  /* Name of the namespace of the primary key index */
     TupleDesc           key_tupdesc; /* Postgres tuple descriptor for primary key or replica identity index */
+    uint64              valid_epoch; /* Invalidation epoch at which the entry was last known to be valid */
     TupleDesc           row_tupdesc; /* Postgres tuple descriptor for a row of this table */
+    TupleDesc           proj_tupdesc; /* Copy of row_tupdesc in which columns omitted by projection are marked as dropped */
+    encode_plan        *key_plan;    /* Plan for translating the key columns of a row into key_schema */
+    encode_plan        *row_plan;    /* Plan for translating a row into row_schema */
+    List               *type_relids; /* Oids of the relations of composite types used by the plans */
+    Datum              *values;      /* Buffer for the deformed values of one row */
+    bool               *isnull;      /* Buffer for the null flags of one row */
+    Datum              *old_values;  /* Buffer for the deformed values of the old version of a row */
+    bool               *old_isnull;  /* Buffer for the null flags of the old version of a row */
     avro_schema_t       key_schema;  /* Avro schema for the table's primary key or replica identity */
     avro_schema_t       row_schema;  /* Avro schema for one row of the table */
     avro_value_iface_t *key_iface;   /* Avro generic interface for creating key values */
     avro_value_iface_t *row_iface;   /* Avro generic interface for creating row values */
     avro_value_t        key_value;   /* Avro key value, for encoding one key */
     avro_value_t        row_value;   /* Avro row value, for encoding one row */
+    avro_value_t        old_key_value; /* Avro key value, for encoding the old key of an updated row */
+    avro_value_t        old_row_value; /* Avro row value, for encoding the old value of an updated row */
+    ExprState          *row_filter;  /* Compiled row filter expression, or NULL if all rows are exported */
+    EState             *filter_estate; /* Executor state in which row_filter is evaluated */
+    TupleTableSlot     *filter_slot; /* Slot holding the row against which row_filter is evaluated */
 } schema_cache_entry;
 
 typedef struct {
     MemoryContext context;         /* Context in which cache entries are allocated */
     HTAB *entries;                 /* Hash table mapping Oid to schema_cache_entry */
+    List *row_filters;             /* Configured row filters, as a list of row_filter */
+    List *projections;             /* Configured column projections, as a list of column_projection */
+    bool unchanged_toast;          /* If true, unmodified TOASTed values are sent as a marker (see schema_for_table_row) */
 } schema_cache;
 
 typedef schema_cache *schema_cache_t;
 
 schema_cache_t schema_cache_new(MemoryContext context);
 int schema_cache_lookup(schema_cache_t cache, Relation rel, schema_cache_entry **entry_out);
+void schema_cache_add_row_filter(schema_cache_t cache, const char *spec);
+void schema_cache_add_projection(schema_cache_t cache, const char *spec, bool include);
+bool schema_cache_row_matches(schema_cache_entry *entry, TupleDesc tupdesc, HeapTuple tuple);
 void schema_cache_free(schema_cache_t cache);
 char *schema_debug_info(Relation rel, TupleDesc tupdesc);
 
@@ -13,11 +13,18 @@
 #include "catalog/pg_type.h"
 #include "executor/spi.h"
 #include "lib/stringinfo.h"
+#include "storage/bufmgr.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/memutils.h"
+#include "utils/snapmgr.h"
+#include "utils/tqual.h"
 
 PG_MODULE_MAGIC;
 
+/* Number of arguments of bottledwater_export as declared by version 0.2 of the extension */
+#define EXPORT_NARGS 11
+
 typedef struct {
     Oid relid;
     Relation rel;
@@ -32,19 +39,32 @@ typedef struct {
     MemoryContext memcontext;
     export_table *tables;
     error_policy_t error_policy;
+    int compression;           /* codec with which frames are compressed (PROTOCOL_CODEC_*) */
+    int batch_bytes;           /* a frame is returned once it reaches this size (0 = one row per frame) */
     int num_tables, current_table;
-    avro_schema_t frame_schema;
-    avro_value_iface_t *frame_iface;
-    avro_value_t frame_value;
+    StringInfo pending_frame;  /* oversized frame that is being returned in fragments */
+    int pending_offset;        /* position in pending_frame of the next fragment */
+    StringInfoData fragment;   /* buffer for the current fragment, reused between calls */
     schema_cache_t schema_cache;
-    Portal cursor;
+    BlockNumber start_page, end_page; /* pages to export (end_page is InvalidBlockNumber for all) */
+    BlockNumber next_page, last_page; /* next page of the current table to read, and the end of its range */
+    BufferAccessStrategy strategy; /* bulk-read ring through which pages are read */
+    MemoryContext pagecontext; /* holds the rows most recently read from a page */
+    HeapTuple *rows;           /* visible rows on the page most recently read */
+    TupleDesc tupdesc;         /* descriptor of rows */
+    int num_rows, next_row;    /* number of rows, and index of the next one to format */
 } export_state;
 
 void print_tupdesc(char *title, TupleDesc tupdesc);
-void get_table_list(export_state *state, text *table_pattern, bool allow_unkeyed);
+void get_table_list(export_state *state, text *table_pattern, Oid relation, bool allow_unkeyed);
+List *text_array_to_list(ArrayType *array);
 void open_next_table(export_state *state);
 void close_current_table(export_state *state);
-bytea *format_snapshot_row(export_state *state);
+bool fetch_snapshot_rows(export_state *state);
+bool fetch_snapshot_page(export_state *state);
+bytea *format_snapshot_frame(export_state *state);
+void format_snapshot_row(export_state *state, StringInfo frame, HeapTuple tuple);
+bytea *next_snapshot_fragment(export_state *state);
 bytea *schema_for_relname(char *relname, bool get_key);
 
 
@@ -98,6 +118,10 @@ PG_FUNCTION_INFO_V1(bottledwater_export);
  * Each byte array is a frame of our wire protocol, containing schemas and/or rows of the selected
  * tables. This is a set-returning function (SRF), which means it gets called once for each row of
  * output, allowing us to stream through large datasets without loading everything into memory.
+ * Rows are read from the tables a page at a time, and each frame contains as many rows as fit
+ * in batch_bytes, so that the per-call overhead is paid once per frame rather than per row.
+ * Given a relation and a range of its pages, only the rows on those pages are exported,
+ * which lets a client split a large table into chunks and export them in parallel.
  *
  * SRF docs: http://www.postgresql.org/docs/9.4/static/xfunc-c.html#XFUNC-C-RETURN-SET */
 Datum bottledwater_export(PG_FUNCTION_ARGS) {
@@ -107,7 +131,10 @@ Datum bottledwater_export(PG_FUNCTION_ARGS) {
     int ret;
     text *table_pattern;
     bool allow_unkeyed;
+    Oid relation;
+    int64 start_page, end_page;
     bytea *result;
+    ListCell *cell;
 
     oldcontext = CurrentMemoryContext;
 
@@ -133,9 +160,16 @@ Datum bottledwater_export(PG_FUNCTION_ARGS) {
                                                   ALLOCSET_DEFAULT_MAXSIZE);
 
         state->current_table = 0;
-        state->frame_schema = schema_for_frame();
-        state->frame_iface = avro_generic_class_from_schema(state->frame_schema);
-        avro_generic_value_new(state->frame_iface, &state->frame_value);
+        state->strategy = GetAccessStrategy(BAS_BULKREAD);
+        state->pagecontext = AllocSetContextCreate(CurrentMemoryContext,
+                                                   "bottledwater_export page context",
+                                                   ALLOCSET_DEFAULT_MINSIZE,
+                                                   ALLOCSET_DEFAULT_INITSIZE,
+                                                   ALLOCSET_DEFAULT_MAXSIZE);
+        state->num_rows = 0;
+        state->next_row = 0;
+        state->pending_frame = NULL;
+        initStringInfo(&state->fragment);
         state->schema_cache = schema_cache_new(funcctx->multi_call_memory_ctx);
         funcctx->user_fctx = state;
 
@@ -143,62 +177,95 @@ Datum bottledwater_export(PG_FUNCTION_ARGS) {
         allow_unkeyed = PG_GETARG_BOOL(1);
         state->error_policy = parse_error_policy(TextDatumGetCString(PG_GETARG_TEXT_P(2)));
 
-        get_table_list(state, table_pattern, allow_unkeyed);
+        /* Version 0.1 of the extension declares only the first three arguments. If it
+         * has not been updated with ALTER EXTENSION, the remaining ones are not passed,
+         * so export as version 0.1 did: everything, one row per frame, uncompressed. */
+        if (PG_NARGS() >= EXPORT_NARGS) {
+            state->compression = parse_compression(TextDatumGetCString(PG_GETARG_TEXT_P(6)));
+            state->batch_bytes = PG_GETARG_INT32(7);
+            relation = PG_GETARG_OID(8);
+            start_page = PG_GETARG_INT64(9);
+            end_page = PG_GETARG_INT64(10);
+        } else {
+            state->compression = parse_compression(PROTOCOL_COMPRESSION_NONE);
+            state->batch_bytes = 0;
+            relation = InvalidOid;
+            start_page = 0;
+            end_page = -1;
+        }
+
+        if (state->batch_bytes < 0) {
+            elog(ERROR, "bottledwater_export: batch_bytes must not be negative");
+        }
+        if (start_page < 0 || start_page > MaxBlockNumber || end_page < -1 || end_page > MaxBlockNumber) {
+            elog(ERROR, "bottledwater_export: invalid page range " INT64_FORMAT " to " INT64_FORMAT,
+                    start_page, end_page);
+        }
+        if ((start_page > 0 || end_page >= 0) && !OidIsValid(relation)) {
+            elog(ERROR, "bottledwater_export: a page range can only be exported for a single relation");
+        }
+        state->start_page = (BlockNumber) start_page;
+        state->end_page = (end_page < 0) ? InvalidBlockNumber : (BlockNumber) end_page;
+
+        if (PG_NARGS() >= EXPORT_NARGS) {
+            foreach(cell, text_array_to_list(PG_GETARG_ARRAYTYPE_P(3))) {
+                schema_cache_add_row_filter(state->schema_cache, lfirst(cell));
+            }
+            foreach(cell, text_array_to_list(PG_GETARG_ARRAYTYPE_P(4))) {
+                schema_cache_add_projection(state->schema_cache, lfirst(cell), true);
+            }
+            foreach(cell, text_array_to_list(PG_GETARG_ARRAYTYPE_P(5))) {
+                schema_cache_add_projection(state->schema_cache, lfirst(cell), false);
+            }
+        }
+
+        get_table_list(state, table_pattern, relation, allow_unkeyed);
         if (state->num_tables > 0) open_next_table(state);
     }
 
-    /* On every call of the function, try to fetch one row from the current cursor,
-     * and process it. If the current cursor has no more rows, move on to the next
-     * table. */
+    /* On every call of the function, encode rows into a frame until it is full, moving
+     * on to the next table when the current one has no more pages. */
     funcctx = SRF_PERCALL_SETUP();
     state = (export_state *) funcctx->user_fctx;
 
-    while (state->current_table < state->num_tables) {
-        SPI_cursor_fetch(state->cursor, true, 1);
-
-        if (SPI_processed == 0) {
-            close_current_table(state);
-            state->current_table++;
-            if (state->current_table < state->num_tables) open_next_table(state);
-        } else {
-            /* SPI_cursor_fetch() leaves us in the SPI mem. context */
-            MemoryContextSwitchTo(state->memcontext);
-
-            /* clear any prior tuple result memory */
-            MemoryContextReset(state->memcontext);
+    /* If the previous frame was too large to return in one go, return its remaining
+     * fragments before encoding any more rows. */
+    if (state->pending_frame) {
+        result = next_snapshot_fragment(state);
+        SRF_RETURN_NEXT(funcctx, PointerGetDatum(result));
+    }
 
-            result = format_snapshot_row(state);
+    /* clear any prior frame memory */
+    MemoryContextReset(state->memcontext);
+    MemoryContextSwitchTo(state->memcontext);
 
-            MemoryContextSwitchTo(oldcontext);
+    result = format_snapshot_frame(state);
 
-            /* don't forget to clear the SPI temp context */
-            SPI_freetuptable(SPI_tuptable);
+    MemoryContextSwitchTo(oldcontext);
 
-            if (result != NULL) {
-                SRF_RETURN_NEXT(funcctx, PointerGetDatum(result));
-            }
-        }
+    if (result != NULL) {
+        SRF_RETURN_NEXT(funcctx, PointerGetDatum(result));
     }
 
     schema_cache_free(state->schema_cache);
-    avro_value_decref(&state->frame_value);
-    avro_value_iface_decref(state->frame_iface);
-    avro_schema_decref(state->frame_schema);
+    FreeAccessStrategy(state->strategy);
     SPI_finish();
     SRF_RETURN_DONE(funcctx);
 }
 
 /* Queries the PG catalog to get a list of tables (matching the given table name pattern)
  * that we should export. The pattern is given to the LIKE operator, so "%" means any
- * table. Selects only ordinary tables (no views, foreign tables, etc) and excludes any
- * PG system tables. Updates export_state with the list of tables.
+ * table. If relation is a valid oid, only that table is selected; the client uses this to
+ * export tables in parallel over several connections. Selects only ordinary tables (no
+ * views, foreign tables, etc) and excludes any PG system tables. Updates export_state with
+ * the list of tables.
  *
  * Also takes a shared lock on all the tables we're going to export, to make sure they
  * aren't dropped or schema-altered before we get around to reading them. (Ordinary
  * writes to the table, i.e. insert/update/delete, are not affected.) */
-void get_table_list(export_state *state, text *table_pattern, bool allow_unkeyed) {
-    Oid argtypes[] = { TEXTOID };
-    Datum args[] = { PointerGetDatum(table_pattern) };
+void get_table_list(export_state *state, text *table_pattern, Oid relation, bool allow_unkeyed) {
+    Oid argtypes[] = { TEXTOID, OIDOID };
+    Datum args[] = { PointerGetDatum(table_pattern), ObjectIdGetDatum(relation) };
     StringInfoData errors;
 
     int ret = SPI_execute_with_args(
@@ -222,11 +289,11 @@ void get_table_list(export_state *state, text *table_pattern, bool allow_unkeyed
             "LEFT JOIN pg_catalog.pg_class ic ON i.indexrelid = ic.oid "
 
             // Select only ordinary tables ('r' == RELKIND_RELATION) matching the required name pattern
-            "WHERE c.relkind = 'r' AND c.relname LIKE $1 AND "
+            "WHERE c.relkind = 'r' AND c.relname LIKE $1 AND ($2 = 0 OR c.oid = $2) AND "
             "n.nspname NOT LIKE 'pg_%' AND n.nspname != 'information_schema' AND " // not a system table
             "c.relpersistence = 'p'", // 'p' == RELPERSISTENCE_PERMANENT (not unlogged or temporary)
 
-            1, argtypes, args, NULL, true, 0);
+            2, argtypes, args, NULL, true, 0);
 
     if (ret != SPI_OK_SELECT) {
         elog(ERROR, "Could not fetch table list: SPI_execute_with_args returned %d", ret);
@@ -297,63 +364,184 @@ void get_table_list(export_state *state, text *table_pattern, bool allow_unkeyed
     }
 }
 
-/* Starts a query to dump all the rows from state->tables[state->current_table].
- * Updates the state accordingly. */
-void open_next_table(export_state *state) {
-    export_table *table = &state->tables[state->current_table];
-    SPIPlanPtr plan;
+/* Returns the non-null elements of a text array as a list of C strings. Used for the
+ * row_filters, include_columns and exclude_columns arguments of bottledwater_export,
+ * each element of which has the form "table:..." (see schema_cache.c). */
+List *text_array_to_list(ArrayType *array) {
+    List *list = NIL;
+    Datum *elems;
+    bool *nulls;
+    int count;
 
-    StringInfoData query;
-    initStringInfo(&query);
-    appendStringInfo(&query, "SELECT * FROM %s",
-            quote_qualified_identifier(table->namespace, table->rel_name));
+    deconstruct_array(array, TEXTOID, -1, false, 'i', &elems, &nulls, &count);
 
-    plan = SPI_prepare_cursor(query.data, 0, NULL, CURSOR_OPT_NO_SCROLL);
-    if (!plan) {
-        elog(ERROR, "bottledwater_export: SPI_prepare_cursor failed with error %d", SPI_result);
+    for (int i = 0; i < count; i++) {
+        if (!nulls[i]) list = lappend(list, TextDatumGetCString(elems[i]));
     }
-    state->cursor = SPI_cursor_open(NULL, plan, NULL, NULL, true);
+    return list;
+}
+
+/* Prepares to read the pages of state->tables[state->current_table] that are to be
+ * exported (normally all of them). Pages added after the export started only contain
+ * rows that are invisible to its snapshot, so the number of pages is fixed here. */
+void open_next_table(export_state *state) {
+    export_table *table = &state->tables[state->current_table];
+
+    state->next_page = state->start_page;
+    state->last_page = Min(state->end_page, RelationGetNumberOfBlocks(table->rel));
+    state->tupdesc = RelationGetDescr(table->rel);
 }
 
-/* When the current cursor has no more rows to return, this function closes it,
- * frees the associated resources, and releases the table lock. */
+/* When the current table has no more pages to read, this function frees the rows
+ * read from its last page, and releases the table lock. */
 void close_current_table(export_state *state) {
     export_table *table = &state->tables[state->current_table];
     relation_close(table->rel, AccessShareLock);
+    MemoryContextReset(state->pagecontext);
+}
 
-    SPI_cursor_close(state->cursor);
-    SPI_freetuptable(SPI_tuptable);
+/* Frees the previous batch of rows, and reads the next page of the current table that
+ * has any visible rows on it into state->rows. If the table has no more pages, closes
+ * it, opens the next table (if any) and returns false. */
+bool fetch_snapshot_rows(export_state *state) {
+    state->num_rows = 0;
+    state->next_row = 0;
+
+    while (state->num_rows == 0 && fetch_snapshot_page(state));
+    if (state->num_rows > 0) return true;
+
+    close_current_table(state);
+    state->current_table++;
+    if (state->current_table < state->num_tables) open_next_table(state);
+    return false;
 }
 
-/* Call this when SPI_tuptable contains one row of a table, fetched from a cursor.
- * This function encodes that tuple as Avro and returns it as a byte array. */
-bytea *format_snapshot_row(export_state *state) {
+/* Reads the next page of the current table, and copies the tuples on it that are visible
+ * to the active snapshot into state->rows. This does what a sequential scan does for
+ * each page, without the overhead of going through SPI and the executor for every row,
+ * and it can be limited to a range of pages, which lets a client export one large table
+ * in chunks over several connections. The pages are read through a bulk-read ring
+ * buffer, so that the export doesn't evict other data from shared buffers. Returns
+ * false if there are no more pages to read. */
+bool fetch_snapshot_page(export_state *state) {
     export_table *table = &state->tables[state->current_table];
-    bytea *output=NULL;
+    Snapshot snapshot = GetActiveSnapshot();
+    MemoryContext oldcontext;
+    Buffer buffer;
+    Page page;
+    OffsetNumber offnum, maxoff;
+
+    MemoryContextReset(state->pagecontext);
+    if (state->next_page >= state->last_page) return false;
+
+    CHECK_FOR_INTERRUPTS();
+    oldcontext = MemoryContextSwitchTo(state->pagecontext);
+
+    buffer = ReadBufferExtended(table->rel, MAIN_FORKNUM, state->next_page, RBM_NORMAL, state->strategy);
+    LockBuffer(buffer, BUFFER_LOCK_SHARE);
 
-    if (SPI_processed != 1) {
-        elog(ERROR, "Expected exactly 1 row from cursor, but got %d rows", SPI_processed);
+    page = BufferGetPage(buffer);
+    maxoff = PageGetMaxOffsetNumber(page);
+    state->rows = palloc(Max(maxoff, 1) * sizeof(HeapTuple));
+
+    for (offnum = FirstOffsetNumber; offnum <= maxoff; offnum = OffsetNumberNext(offnum)) {
+        ItemId itemid = PageGetItemId(page, offnum);
+        HeapTupleData tuple;
+
+        if (!ItemIdIsNormal(itemid)) continue;
+
+        tuple.t_data = (HeapTupleHeader) PageGetItem(page, itemid);
+        tuple.t_len = ItemIdGetLength(itemid);
+        tuple.t_tableOid = RelationGetRelid(table->rel);
+        ItemPointerSet(&tuple.t_self, state->next_page, offnum);
+
+        if (HeapTupleSatisfiesVisibility(&tuple, snapshot, buffer)) {
+            state->rows[state->num_rows++] = heap_copytuple(&tuple);
+        }
+    }
+
+    UnlockReleaseBuffer(buffer);
+    state->next_page++;
+
+    MemoryContextSwitchTo(oldcontext);
+    return true;
+}
+
+/* Encodes rows into a frame until it reaches state->batch_bytes, or all tables have
+ * been exported. The frame is encoded directly into the buffer that becomes the
+ * returned bytea, so rows are not copied again after encoding. Returns NULL if there
+ * is nothing left to send (including when the remaining rows were all rejected by
+ * row filters). */
+bytea *format_snapshot_frame(export_state *state) {
+    StringInfoData frame;
+
+    initStringInfo(&frame);
+    appendStringInfoSpaces(&frame, VARHDRSZ); /* space for the bytea length header */
+
+    while (state->current_table < state->num_tables) {
+        if (state->next_row >= state->num_rows && !fetch_snapshot_rows(state)) continue;
+
+        format_snapshot_row(state, &frame, state->rows[state->next_row++]);
+        if (frame.len > VARHDRSZ && frame.len - VARHDRSZ >= state->batch_bytes) break;
     }
-    if (avro_value_reset(&state->frame_value)) {
-        elog(ERROR, "Avro value reset failed: %s", avro_strerror());
+
+    if (frame.len == VARHDRSZ) {
+        pfree(frame.data);
+        return NULL;
     }
 
-    if (update_frame_with_insert(&state->frame_value, state->schema_cache, table->rel,
-            SPI_tuptable->tupdesc, SPI_tuptable->vals[0])) {
-        elog(INFO, "Failed tuptable: %s", schema_debug_info(table->rel, SPI_tuptable->tupdesc));
+    close_frame(&frame);
+    compress_frame(&frame, VARHDRSZ, state->compression);
+
+    if (frame.len - VARHDRSZ > PROTOCOL_MAX_FRAGMENT_LENGTH) {
+        state->pending_frame = palloc(sizeof(StringInfoData));
+        *state->pending_frame = frame;
+        state->pending_offset = VARHDRSZ;
+        return next_snapshot_fragment(state);
+    }
+
+    SET_VARSIZE(frame.data, frame.len);
+    return (bytea *) frame.data;
+}
+
+/* Encodes one row of the current table, taken from state->rows, as an insert
+ * message appended to the frame. Nothing is appended if the row was rejected by the
+ * table's row filter. */
+void format_snapshot_row(export_state *state, StringInfo frame, HeapTuple tuple) {
+    export_table *table = &state->tables[state->current_table];
+    TupleDesc tupdesc = state->tupdesc;
+
+    int err = update_frame_with_insert(frame, state->schema_cache, table->rel, tupdesc, tuple);
+
+    if (err) {
+        elog(INFO, "Failed tuptable: %s", schema_debug_info(table->rel, tupdesc));
         elog(INFO, "Failed relation: %s", schema_debug_info(table->rel, RelationGetDescr(table->rel)));
         error_policy_handle(state->error_policy, "bottledwater_export: Avro conversion failed", avro_strerror());
         /* if handling the error didn't exit early, it should be safe to fall
-         * through, because we'll just write the frame without the message that
-         * failed (so potentially it'll be an empty frame)
+         * through, because the message that failed was removed from the frame,
+         * and we just carry on with the next row
          */
     }
-    if (try_writing(&output, &write_avro_binary, &state->frame_value)) {
-        error_policy_handle(state->error_policy, "bottledwater_export: writing Avro binary failed", avro_strerror());
-        /* if we didn't exit early, then output remains uninitialised */
-        return NULL;
-    }
-    return output;
+}
+
+/* Returns the next fragment of an oversized frame, as a frame in its own right. The
+ * pending frame lives in the per-tuple memory context, which is not reset until the
+ * last fragment has been returned. The fragment itself is built in a buffer that is
+ * reused for every fragment, so that memory use stays proportional to the row size. */
+bytea *next_snapshot_fragment(export_state *state) {
+    StringInfo pending = state->pending_frame;
+    int len = Min(pending->len - state->pending_offset, PROTOCOL_MAX_FRAGMENT_LENGTH);
+    bool last = (state->pending_offset + len == pending->len);
+
+    resetStringInfo(&state->fragment);
+    appendStringInfoSpaces(&state->fragment, VARHDRSZ);
+    update_frame_with_fragment(&state->fragment, pending->data + state->pending_offset, len, last);
+    close_frame(&state->fragment);
+    SET_VARSIZE(state->fragment.data, state->fragment.len);
+
+    state->pending_offset += len;
+    if (last) state->pending_frame = NULL;
+    return (bytea *) state->fragment.data;
 }
 
 /* Given the name of a table (relation), generates an Avro schema for either the rows
@@ -361,26 +549,36 @@ bytea *format_snapshot_row(export_state *state) {
 bytea *schema_for_relname(char *relname, bool get_key) {
     int err;
     bytea *json=NULL;
-    avro_schema_t schema;
+    table_schema_json table = { NULL, NULL };
     List *relname_list = stringToQualifiedNameList(relname);
     RangeVar *relvar = makeRangeVarFromNameList(relname_list);
     Relation rel = relation_openrv(relvar, AccessShareLock);
+    Relation schema_rel = rel;
 
-    if (get_key) {
-        err = schema_for_table_key(rel, &schema);
+    /* The key schema is generated from the replica identity index */
+    if (get_key) schema_rel = table_key_index(rel);
+
+    if (schema_rel) {
+        err = schema_for_table_row(schema_rel, NULL, false, &table.schema);
+        table.tupdesc = RelationGetDescr(schema_rel);
     } else {
-        err = schema_for_table_row(rel, &schema);
+        err = 0;
     }
 
-    relation_close(rel, AccessShareLock);
     if (err) {
+        if (schema_rel != rel) relation_close(schema_rel, AccessShareLock);
+        relation_close(rel, AccessShareLock);
         elog(ERROR, "bottledwater_table_schema: Could not get schema for relname %s: %s",
                 relname, avro_strerror());
     }
-    if (!schema) return NULL;
 
-    err = try_writing(&json, &write_schema_json, schema);
-    avro_schema_decref(schema);
+    if (table.schema) {
+        err = try_writing(&json, &write_table_schema_json, &table);
+        avro_schema_decref(table.schema);
+    }
+
+    if (schema_rel && schema_rel != rel) relation_close(schema_rel, AccessShareLock);
+    relation_close(rel, AccessShareLock);
 
     if (err) {
         elog(ERROR, "bottledwater_table_schema: Could not encode schema as JSON: %s",
@@ -120,6 +120,7 @@ typedef struct {
     uint64_t wal_pos;
     Oid relid;
     transaction_info *xact;
+    snapshot_chunk *chunk;  /* Snapshot chunk that the message belongs to, if any */
 } msg_envelope;
 
 typedef msg_envelope *msg_envelope_t;
@@ -132,6 +133,9 @@ static char pidfile[MAXPGPATH];	/* k4m : pid file */
 void usage(int exit_status);
 void parse_options(producer_context_t context, int argc, char **argv);
 char *parse_config_option(char *option);
+int parse_batch_option(const char *option, char *value);
+void add_table_option(const char *option, char *value, int *count, char ***list);
+void set_compression(producer_context_t context, char *compression);
 void init_schema_registry(producer_context_t context, char *url);
 const char* output_format_name(format_t format);
 void set_output_format(producer_context_t context, char *format);
@@ -203,6 +207,37 @@ void usage(int exit_status) {
             "                          database contents and just start streaming any new\n"
             "                          updates.  (Ignored if the replication slot already\n"
             "                          exists.)\n"
+            "  --batch-bytes=bytes     Have the server send row changes in frames of up to\n"
+            "                          roughly this many bytes, rather than one frame per\n"
+            "                          row. Frames are always sent at the end of a\n"
+            "                          transaction. Also sets the size of snapshot frames\n"
+            "                          (default for the snapshot: 65536).\n"
+            "  --batch-rows=rows       Have the server send row changes in frames of up to\n"
+            "                          this many rows, rather than one frame per row.\n"
+            "  --row-filter=table:expression\n"
+            "                          Only export rows of the table for which the SQL\n"
+            "                          expression is true, e.g. --row-filter='users:active'.\n"
+            "                          May be given once for each table.\n"
+            "  --include-columns=table:column,...\n"
+            "                          Only export the listed columns of the table.\n"
+            "  --exclude-columns=table:column,...\n"
+            "                          Export all columns of the table except those listed.\n"
+            "  --compression=[none|zlib]   (default: none)\n"
+            "                          Have the server compress the frames it sends, for\n"
+            "                          both the snapshot and the stream of changes.\n"
+            "  --snapshot-connections=n   (default: 1)\n"
+            "                          Export the initial snapshot over this many database\n"
+            "                          connections in parallel, one table per connection\n"
+            "                          at a time.\n"
+            "  --snapshot-chunk-pages=pages   (default: 131072)\n"
+            "                          With --snapshot-connections, split tables larger than\n"
+            "                          this many pages into chunks of this many pages, which\n"
+            "                          are exported in parallel like separate tables.\n"
+            "  --snapshot-state-file=path\n"
+            "                          Record the progress of the snapshot in this file. If\n"
+            "                          the snapshot fails, the replication slot is kept, and\n"
+            "                          the next run resumes the snapshot, skipping the tables\n"
+            "                          and chunks that were already written to Kafka.\n"
             "  -C, --kafka-config property=value\n"
             "                          Set global configuration property for Kafka producer\n"
             "                          (see --config-help for list of properties).\n"
@@ -238,6 +273,15 @@ void parse_options(producer_context_t context, int argc, char **argv) {
         {"kafka-config",    required_argument, NULL, 'C'},
         {"topic-config",    required_argument, NULL, 'T'},
         {"config-help",     no_argument,       NULL,  1 },
+        {"batch-bytes",     required_argument, NULL,  2 },
+        {"batch-rows",      required_argument, NULL,  3 },
+        {"row-filter",      required_argument, NULL,  4 },
+        {"include-columns", required_argument, NULL,  5 },
+        {"exclude-columns", required_argument, NULL,  6 },
+        {"compression",     required_argument, NULL,  7 },
+        {"snapshot-connections", required_argument, NULL, 8 },
+        {"snapshot-chunk-pages", required_argument, NULL, 9 },
+        {"snapshot-state-file", required_argument, NULL, 10 },
         {"help",            no_argument,       NULL, 'h'},
         {NULL,              0,                 NULL,  0 }
     };
@@ -287,6 +331,36 @@ void parse_options(producer_context_t context, int argc, char **argv) {
                 rd_kafka_conf_properties_show(stderr);
                 exit(0);
                 break;
+            case 2:
+                context->client->repl.batch_bytes = parse_batch_option("batch-bytes", optarg);
+                break;
+            case 3:
+                context->client->repl.batch_rows = parse_batch_option("batch-rows", optarg);
+                break;
+            case 4:
+                add_table_option("row-filter", optarg,
+                        &context->client->repl.num_row_filters, &context->client->repl.row_filters);
+                break;
+            case 5:
+                add_table_option("include-columns", optarg,
+                        &context->client->repl.num_include_columns, &context->client->repl.include_columns);
+                break;
+            case 6:
+                add_table_option("exclude-columns", optarg,
+                        &context->client->repl.num_exclude_columns, &context->client->repl.exclude_columns);
+                break;
+            case 7:
+                set_compression(context, optarg);
+                break;
+            case 8:
+                context->client->snapshot_connections = parse_batch_option("snapshot-connections", optarg);
+                break;
+            case 9:
+                context->client->snapshot_chunk_pages = parse_batch_option("snapshot-chunk-pages", optarg);
+                break;
+            case 10:
+                context->client->snapshot_state_file = strdup(optarg);
+                break;
             case 'h':
                 usage(0);
             default:
@@ -321,6 +395,51 @@ char *parse_config_option(char *option) {
     return equals + 1;
 }
 
+/* Parses the value of --batch-bytes, --batch-rows, --snapshot-connections or
+ * --snapshot-chunk-pages, which must be a positive integer. */
+int parse_batch_option(const char *option, char *value) {
+    char *end;
+    long parsed = strtol(value, &end, 10);
+
+    if (*value == '\0' || *end != '\0' || parsed <= 0 || parsed > INT32_MAX) {
+        config_error("%s: invalid value for --%s (expected a positive integer): %s",
+                progname, option, value);
+        exit(1);
+    }
+    return (int) parsed;
+}
+
+/* Adds the value of a --row-filter, --include-columns or --exclude-columns option to
+ * the list of such options that are sent to the server (which checks their syntax). */
+void add_table_option(const char *option, char *value, int *count, char ***list) {
+    if (!strchr(value, ':')) {
+        config_error("%s: invalid value for --%s (expected table:...): %s",
+                progname, option, value);
+        exit(1);
+    }
+
+    *list = realloc(*list, (*count + 1) * sizeof(char *));
+    if (!*list) {
+        config_error("%s: out of memory", progname);
+        exit(1);
+    }
+    (*list)[(*count)++] = strdup(value);
+}
+
+/* Sets the compression of frames sent by the server. "none" leaves the option unset,
+ * so that we still work with servers that predate it. */
+void set_compression(producer_context_t context, char *compression) {
+    if (!strcmp(PROTOCOL_COMPRESSION_NONE, compression)) {
+        context->client->repl.compression = NULL;
+    } else if (!strcmp(PROTOCOL_COMPRESSION_ZLIB, compression)) {
+        context->client->repl.compression = PROTOCOL_COMPRESSION_ZLIB;
+    } else {
+        config_error("invalid compression (expected %s or %s): %s",
+                PROTOCOL_COMPRESSION_NONE, PROTOCOL_COMPRESSION_ZLIB, compression);
+        exit(1);
+    }
+}
+
 void init_schema_registry(producer_context_t context, char *url) {
     context->registry = schema_registry_new(url);
 
@@ -450,8 +569,13 @@ static int on_begin_txn(void *ctx, uint64_t wal_pos, uint32_t xid) {
             fatal_error(context, "Expected snapshot to be the first transaction.");
         }
 
-        log_info("Created replication slot \"%s\", capturing consistent snapshot \"%s\".",
-                 stream->slot_name, stream->snapshot_name);
+        if (context->client->slot_created) {
+            log_info("Created replication slot \"%s\", capturing consistent snapshot \"%s\".",
+                     stream->slot_name, stream->snapshot_name);
+        } else {
+            log_info("Resuming incomplete snapshot of replication slot \"%s\" with snapshot \"%s\".",
+                     stream->slot_name, stream->snapshot_name);
+        }
     }
 
     // If the circular buffer is full, we have to block and wait for some transactions
@@ -592,6 +716,11 @@ int send_kafka_msg(producer_context_t context, uint64_t wal_pos, Oid relid,
     envelope->relid = relid;
     envelope->xact = xact;
 
+    // Rows of the snapshot are counted against their chunk, which is complete once they
+    // have all been acknowledged
+    envelope->chunk = context->client->current_chunk;
+    if (envelope->chunk) envelope->chunk->pending_rows++;
+
     void *key = NULL, *val = NULL;
     size_t key_encoded_len, val_encoded_len;
     table_metadata_t table = table_mapper_lookup(context->mapper, relid);
@@ -686,6 +815,9 @@ static void on_deliver_msg(rd_kafka_t *kafka, const rd_kafka_message_t *msg, voi
 
     if (!err) {
         envelope->xact->pending_events--;
+        if (envelope->chunk) {
+            ensure(envelope->context, db_client_snapshot_row_written(envelope->context->client, envelope->chunk));
+        }
         maybe_checkpoint(envelope->context);
     }
     free(envelope);
@@ -775,6 +907,8 @@ client_context_t init_client() {
     client->app_name = strdup(APP_NAME);
     db_client_set_error_policy(client, DEFAULT_ERROR_POLICY_NAME);
     client->allow_unkeyed = false;
+    client->repl.filter_tables = true; /* only tables in MAP_TABLE are decoded by the server */
+    client->repl.old_values = PROTOCOL_OLD_VALUES_KEY; /* old rows are not written to Kafka */
     client->repl.slot_name = strdup(DEFAULT_REPLICATION_SLOT);
     client->repl.output_plugin = strdup(OUTPUT_PLUGIN);
     client->repl.frame_reader = frame_reader;
@@ -862,7 +996,11 @@ void start_producer(producer_context_t context) {
 void exit_nicely(producer_context_t context, int status) {
     // If a snapshot was in progress and not yet complete, and an error occurred, try to
     // drop the replication slot, so that the snapshot is retried when the user tries again.
-    if (context->client->taking_snapshot && status != 0) {
+    // With a snapshot state file, the slot is kept instead, and the snapshot is resumed.
+    if (context->client->taking_snapshot && status != 0 && context->client->snapshot_state_file) {
+        log_info("Keeping replication slot so that the snapshot can be resumed from %s.",
+                 context->client->snapshot_state_file);
+    } else if (context->client->taking_snapshot && status != 0) {
         log_info("Dropping replication slot since the snapshot did not complete successfully.");
         if (replication_slot_drop(&context->client->repl) != 0) {
             log_error("%s: %s", progname, context->client->repl.error);
@@ -943,16 +1081,18 @@ int main(int argc, char **argv) {
 
     replication_stream_t stream = &context->client->repl;
 
-    if (!context->client->slot_created) {
+    if (context->client->taking_snapshot) {
+        // a new or resumed snapshot is logged by on_begin_txn
+        assert(context->client->slot_created || context->client->snapshot_state_file);
+    } else if (!context->client->slot_created) {
         log_info("Replication slot \"%s\" exists, streaming changes from %X/%X.",
                  stream->slot_name,
                  (uint32) (stream->start_lsn >> 32), (uint32) stream->start_lsn);
-    } else if (context->client->skip_snapshot) {
+    } else {
+        assert(context->client->skip_snapshot);
         log_info("Created replication slot \"%s\", skipping snapshot and streaming changes from %X/%X.",
                  stream->slot_name,
                  (uint32) (stream->start_lsn >> 32), (uint32) stream->start_lsn);
-    } else {
-        assert(context->client->taking_snapshot);
     }
 
 	received_reload_signal = 1; /* k4m: in order to get mapping table info when the process start */
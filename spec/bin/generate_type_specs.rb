@@ -196,7 +196,7 @@ def print_examples(level, type)
     iputs level,     %(include_examples #{name.inspect}, #{genvalue(value)})
   when 'I' # inet
     raise "Please specify custom literal for inet type #{name}" if value.nil?
-    iputs level,     %(include_examples 'roundtrip type', #{name.inspect}, #{genvalue(value)})
+    iputs level,     %(include_examples 'inet type', #{name.inspect}, #{genvalue(value)})
   when 'R' # range
     raise "Please specify custom literal for range type #{name}" if value.nil?
     iputs level,     %(include_examples 'roundtrip type', #{name.inspect}, #{genvalue(value)})
@@ -227,7 +227,7 @@ def print_examples(level, type)
     when 'pg_lsn'
       iputs level,   %(include_examples 'roundtrip type', #{name.inspect}, '42/BEEFCAFE')
     when 'uuid'
-      iputs level,   %(include_examples 'roundtrip type', #{name.inspect}, 'a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11')
+      iputs level,   %(include_examples 'uuid type', #{name.inspect}, 'a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11')
     when 'bytea'
       iputs level,   %(include_examples 'binary type', #{name.inspect})
     when 'hstore'
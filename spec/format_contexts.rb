@@ -22,6 +22,16 @@ shared_context 'JSON format', format: :json do
     unicode_encoded.codepoints.pack('C*')
   end
 
+  def fetch_fixed(object, name)
+    # fixed values are encoded like bytes (see fetch_bytes), but tagged with
+    # the name of the fixed type rather than 'bytes'
+    object.fetch(name).values.first.codepoints.pack('C*')
+  end
+
+  def fetch_array(object, name)
+    object.fetch(name).fetch('array').map {|item| item && item.values.first }
+  end
+
   def fetch_any(object, name)
     object.fetch(name).values.first
   end
@@ -48,5 +58,7 @@ shared_context 'Avro format', format: :avro do
   alias fetch_int fetch_entry
   alias fetch_string fetch_entry
   alias fetch_bytes fetch_entry
+  alias fetch_fixed fetch_entry
+  alias fetch_array fetch_entry
   alias fetch_any fetch_entry
 end
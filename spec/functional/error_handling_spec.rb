@@ -51,6 +51,17 @@ describe 'error handling', functional: true, format: :json do
       end
     end
 
+    example 'an enum whose labels map to the same Avro symbol crashes Bottled Water' do
+      TEST_CLUSTER.start
+
+      postgres.exec(%{CREATE TYPE clash AS ENUM ('-', '_2d_')})
+      postgres.exec('CREATE TABLE clashes (id SERIAL PRIMARY KEY, value clash)')
+      postgres.exec(%{INSERT INTO clashes (value) VALUES ('-')})
+      sleep 5
+
+      expect(TEST_CLUSTER.bottledwater_running?).to be_falsy
+    end
+
     example 'writing a large value crashes Bottled Water' do
       TEST_CLUSTER.start
 
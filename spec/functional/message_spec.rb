@@ -75,6 +75,20 @@ shared_examples 'publishing messages' do |format, postgres_version, valgrind|
       expect(fetch_string(new_value, 'gadget')).to eq('Goodbye')
     end
 
+    example 'changing the primary key of a row should publish a delete of the old key and the new row' do
+      postgres.exec('CREATE TABLE gizmos (id INTEGER PRIMARY KEY, gizmo TEXT)')
+      postgres.exec_params('INSERT INTO gizmos (id, gizmo) VALUES (1, $1)', ['Hello'])
+      postgres.exec('UPDATE gizmos SET id = 2 WHERE id = 1')
+      sleep 1
+
+      messages = kafka_take_messages('gizmos', 3)
+      ids = messages.map {|message| fetch_int(decode_key(message.key), 'id') }
+
+      expect(ids).to eq([1, 1, 2])
+      expect(messages[1].value).to be_nil
+      expect(fetch_string(decode_value(messages[2].value), 'gizmo')).to eq('Hello')
+    end
+
     describe 'initial database snapshot' do
       # uses the table that was prepopulated in the before hook above
 
@@ -0,0 +1,142 @@
+require 'spec_helper'
+require 'format_contexts'
+require 'securerandom'
+require 'test_cluster'
+
+# These examples look at the change stream as the client library decodes it,
+# using bwtest rather than Kafka, so that they aren't limited by the maximum
+# size of a Kafka message.
+describe 'decoded change stream', functional: true, format: :json do
+  let(:postgres) { TEST_CLUSTER.postgres }
+  let(:slot) { 'bwtest_protocol' }
+
+  before(:context) do
+    TEST_CLUSTER.start
+  end
+
+  after(:context) do
+    TEST_CLUSTER.stop
+  end
+
+  after(:example) do
+    postgres.exec_params('SELECT pg_drop_replication_slot($1) FROM pg_replication_slots WHERE slot_name = $1', [slot])
+  end
+
+  # Extracts the string values of the given column from the rows that bwtest
+  # printed for the given kind of change to the given table.
+  def printed_values(output, change, table, column)
+    output.lines.grep(/^#{change} (to|from) #{table}:/).map do |line|
+      line.scan(/"#{column}":\s*\{"string":\s*"([^"]*)"\}/).last.first
+    end
+  end
+
+  example 'values of several megabytes arrive intact, in the snapshot and ongoing' do
+    postgres.exec('CREATE TABLE blobs (id SERIAL PRIMARY KEY, value TEXT)')
+    snapshot_value, inserted_value, updated_value = 3.times.map { SecureRandom.hex(1_500_000) }
+    postgres.exec_params('INSERT INTO blobs (value) VALUES ($1)', [snapshot_value])
+
+    output = TEST_CLUSTER.bwtest(slot: slot, seconds: 10)
+    expect(printed_values(output, 'insert', 'blobs', 'value')).to eq([snapshot_value])
+
+    postgres.exec_params('INSERT INTO blobs (value) VALUES ($1)', [inserted_value])
+    postgres.exec_params('UPDATE blobs SET value = $1 WHERE id = 1', [updated_value])
+
+    output = TEST_CLUSTER.bwtest(slot: slot, seconds: 10)
+    expect(printed_values(output, 'insert', 'blobs', 'value')).to eq([inserted_value])
+    expect(printed_values(output, 'update', 'blobs', 'value')).to eq([updated_value])
+  end
+
+  example 'with old_values=full, updates and deletes of REPLICA IDENTITY FULL tables carry the old row' do
+    postgres.exec('CREATE TABLE accounts (id SERIAL PRIMARY KEY, owner TEXT)')
+    postgres.exec('ALTER TABLE accounts REPLICA IDENTITY FULL')
+    postgres.exec(%{INSERT INTO accounts (owner) VALUES ('alice')})
+    TEST_CLUSTER.bwtest(slot: slot, options: ['--old-values=full'])
+
+    postgres.exec(%{UPDATE accounts SET owner = 'bob' WHERE id = 1})
+    postgres.exec('DELETE FROM accounts WHERE id = 1')
+
+    output = TEST_CLUSTER.bwtest(slot: slot, options: ['--old-values=full'])
+    updates = output.lines.grep(/^update to accounts:/)
+    deletes = output.lines.grep(/^delete from accounts:/)
+
+    expect(updates.size).to eq(1)
+    expect(updates.first).to match(/"owner":\s*\{"string":\s*"alice"\}.* --> .*"owner":\s*\{"string":\s*"bob"\}/)
+    expect(deletes.size).to eq(1)
+    expect(deletes.first).to match(/\(was: .*"owner":\s*\{"string":\s*"bob"\}/)
+  end
+
+  example 'with old_values=key, updates and deletes of REPLICA IDENTITY FULL tables carry only the key' do
+    postgres.exec('CREATE TABLE members (id SERIAL PRIMARY KEY, owner TEXT)')
+    postgres.exec('ALTER TABLE members REPLICA IDENTITY FULL')
+    postgres.exec(%{INSERT INTO members (owner) VALUES ('alice')})
+    TEST_CLUSTER.bwtest(slot: slot, options: ['--old-values=key'])
+
+    postgres.exec(%{UPDATE members SET owner = 'bob' WHERE id = 1})
+    postgres.exec('DELETE FROM members WHERE id = 1')
+
+    output = TEST_CLUSTER.bwtest(slot: slot, options: ['--old-values=key'])
+    updates = output.lines.grep(/^update to members:/)
+    deletes = output.lines.grep(/^delete from relid \d+:/)
+
+    expect(updates.size).to eq(1)
+    expect(updates.first).to match(/"owner":\s*\{"string":\s*"bob"\}/)
+    expect(updates.first).not_to match(/alice|-->/)
+    expect(deletes.size).to eq(1)
+    expect(deletes.first).to match(/"id":\s*\{"int":\s*1\}/)
+    expect(output).not_to match(/\(was:/)
+  end
+
+  example 'with --delta-updates, updates of REPLICA IDENTITY FULL tables carry only the changed columns' do
+    postgres.exec('CREATE TABLE orders (id SERIAL PRIMARY KEY, customer TEXT, status TEXT)')
+    postgres.exec('ALTER TABLE orders REPLICA IDENTITY FULL')
+    postgres.exec(%{INSERT INTO orders (customer, status) VALUES ('alice', 'new')})
+    TEST_CLUSTER.bwtest(slot: slot, options: ['--delta-updates'])
+
+    postgres.exec(%{UPDATE orders SET status = 'shipped' WHERE id = 1})
+
+    output = TEST_CLUSTER.bwtest(slot: slot, options: ['--delta-updates'])
+    updates = output.lines.grep(/^update to orders:/)
+
+    expect(updates.size).to eq(1)
+    expect(updates.first).to match(/ status=\{"string":\s*"shipped"\}/)
+    expect(updates.first).not_to match(/ (id|customer)=/)
+  end
+
+  example 'with --unchanged-toast, updates carry a marker for out-of-line values they did not modify' do
+    postgres.exec('CREATE TABLE documents (id SERIAL PRIMARY KEY, title TEXT, notes TEXT)')
+    postgres.exec('ALTER TABLE documents ALTER COLUMN notes SET STORAGE EXTERNAL')
+    postgres.exec(%{INSERT INTO documents (title, notes) VALUES ('draft', repeat('x', 10000))})
+    TEST_CLUSTER.bwtest(slot: slot, options: ['--unchanged-toast'])
+
+    postgres.exec(%{UPDATE documents SET title = 'final' WHERE id = 1})
+    postgres.exec(%{UPDATE documents SET notes = repeat('y', 10000) WHERE id = 1})
+
+    output = TEST_CLUSTER.bwtest(slot: slot, options: ['--unchanged-toast'])
+    updates = output.lines.grep(/^update to documents:/)
+
+    expect(updates.size).to eq(2)
+    expect(updates[0]).to match(/"title":\s*\{"string":\s*"final"\}/)
+    expect(updates[0]).to match(/"notes":\s*\{"[\w.]*UnchangedToast":\s*"unchanged"\}/)
+    expect(printed_values(updates[1], 'update', 'documents', 'notes')).to eq(['y' * 10000])
+  end
+
+  example 'transactions that only touch excluded tables produce no output, but are consumed' do
+    postgres.exec('CREATE TABLE included (id SERIAL PRIMARY KEY)')
+    postgres.exec('CREATE TABLE excluded (id SERIAL PRIMARY KEY)')
+    relids = postgres.exec(%{SELECT 'included'::regclass::oid AS oid}).first['oid']
+    postgres.exec_params(%{SELECT pg_create_logical_replication_slot($1, 'bottledwater')}, [slot])
+
+    get_changes = %{SELECT count(*) FROM pg_logical_slot_get_binary_changes($1, NULL, NULL, 'include_relids', $2)}
+    peek_all_changes = %{SELECT count(*) FROM pg_logical_slot_peek_binary_changes($1, NULL, NULL)}
+
+    postgres.exec('INSERT INTO excluded DEFAULT VALUES')
+    expect(postgres.exec_params(get_changes, [slot, relids]).first['count'].to_i).to eq(0)
+
+    # The slot moved past the omitted transaction, so it is not decoded again
+    # even without the filter.
+    expect(postgres.exec_params(peek_all_changes, [slot]).first['count'].to_i).to eq(0)
+
+    postgres.exec('INSERT INTO included DEFAULT VALUES')
+    expect(postgres.exec_params(get_changes, [slot, relids]).first['count'].to_i).to be > 0
+  end
+end
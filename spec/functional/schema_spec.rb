@@ -1,5 +1,6 @@
 require 'spec_helper'
 require 'format_contexts'
+require 'ipaddr'
 require File.join(File.dirname(__FILE__), 'type_specs')
 
 
@@ -66,6 +67,14 @@ shared_examples 'database schema support' do |format|
     sleep 0.1
   end
 
+  # Avro decimals are the two's-complement big-endian unscaled value,
+  # e.g. -1234567 -> "\xED\x29\x79"
+  def decode_decimal(bytestring, scale)
+    unscaled = bytestring.bytes.reduce(0) {|acc, byte| (acc << 8) | byte }
+    unscaled -= 1 << (8 * bytestring.bytesize) if bytestring.bytes.first >= 0x80
+    Rational(unscaled, 10 ** scale)
+  end
+
   def retrieve_roundtrip_message(
       type, value_str,
       as_key: false, length: nil,
@@ -291,6 +300,46 @@ shared_examples 'database schema support' do |format|
     include_examples 'roundtrip type', type, value, as_key: false
   end
 
+  shared_examples 'inet type' do |type, value|
+    # address in network byte order, followed by the netmask length
+    def encode_inet(value)
+      address, bits = value.split('/')
+      IPAddr.new(address).hton + [bits.to_i].pack('C')
+    end
+
+    example 'retrieve address and netmask from Kafka as bytes' do
+      message = retrieve_roundtrip_message(type, value)
+
+      row = decode_value(message.value)
+      expect(fetch_bytes(row, 'value')).to eq(encode_inet(value))
+    end
+
+    example 'retrieve address and netmask from Kafka message key as bytes' do
+      message = retrieve_roundtrip_message(type, value, as_key: true)
+
+      key = decode_key(message.key)
+      expect(fetch_bytes(key, 'value')).to eq(encode_inet(value))
+    end
+  end
+
+  shared_examples 'uuid type' do |type, value|
+    let(:uuid_bytes) { [value.delete('-')].pack('H*') }
+
+    example 'retrieve same UUID from Kafka as 16 raw bytes' do
+      message = retrieve_roundtrip_message(type, value)
+
+      row = decode_value(message.value)
+      expect(fetch_fixed(row, 'value')).to eq(uuid_bytes)
+    end
+
+    example 'retrieve same UUID from Kafka message key as 16 raw bytes' do
+      message = retrieve_roundtrip_message(type, value, as_key: true)
+
+      key = decode_key(message.key)
+      expect(fetch_fixed(key, 'value')).to eq(uuid_bytes)
+    end
+  end
+
   shared_examples 'JSON type' do |type, value|
     # JSON types can't be in a primary key because they don't support a default
     # operator class
@@ -347,11 +396,221 @@ shared_examples 'database schema support' do |format|
 
 
   describe 'array types' do
+    shared_examples 'array type' do |name, type, value, elements|
+      example 'retrieve array elements from Kafka' do
+        message = retrieve_roundtrip_message(type, value, table_name: "test_value_#{name}")
+
+        row = decode_value(message.value)
+        expect(fetch_array(row, 'value')).to eq(elements)
+      end
+
+      example 'retrieve array elements from Kafka message key' do
+        message = retrieve_roundtrip_message(type, value, as_key: true, table_name: "test_key_#{name}")
+
+        key = decode_key(message.key)
+        expect(fetch_array(key, 'value')).to eq(elements)
+      end
+    end
+
     describe 'int[]' do
-      include_examples 'roundtrip type', 'int[]', '{1,2,3,4}'
+      include_examples 'array type', 'int_array', 'int[]', '{1,2,3,4}', [1, 2, 3, 4]
+    end
+    describe 'int[] with nulls' do
+      include_examples 'array type', 'int_array_nulls', 'int[]', '{1,NULL,3}', [1, nil, 3]
     end
     describe 'text[]' do
-      include_examples 'roundtrip type', 'text[]', '{1,two,"three, four"}'
+      include_examples 'array type', 'text_array', 'text[]', '{1,two,"three, four"}', ['1', 'two', 'three, four']
+    end
+
+    # An Avro array can only represent arrays with one dimension whose subscripts
+    # start at 1, so anything else is sent as the array's text representation.
+    example 'retrieve a multi-dimensional array as a string' do
+      message = retrieve_roundtrip_message('int[][]', '{{1,2},{3,4}}', table_name: 'test_value_int_array_2d')
+
+      row = decode_value(message.value)
+      expect(fetch_string(row, 'value')).to eq('{{1,2},{3,4}}')
+    end
+
+    example 'retrieve an array with a lower bound other than 1 as a string' do
+      message = retrieve_roundtrip_message('int[]', '[0:3]={1,2,3,4}', table_name: 'test_value_int_array_lbound')
+
+      row = decode_value(message.value)
+      expect(fetch_string(row, 'value')).to eq('[0:3]={1,2,3,4}')
+    end
+  end
+
+
+  describe 'enum types' do
+    before(:example) do
+      # 'meh' is added out of order, so its position in the sort order differs
+      # from the order in which the values were created
+      postgres.exec(%{DO $$ BEGIN CREATE TYPE mood AS ENUM ('sad', 'ok', 'happy');
+                      EXCEPTION WHEN duplicate_object THEN NULL; END $$})
+      postgres.exec(%{ALTER TYPE mood ADD VALUE IF NOT EXISTS 'meh' BEFORE 'ok'})
+    end
+
+    example 'retrieve enum label from Kafka' do
+      message = retrieve_roundtrip_message('mood', 'happy')
+
+      row = decode_value(message.value)
+      expect(fetch_any(row, 'value')).to eq('happy')
+    end
+
+    example 'retrieve enum label from Kafka message key' do
+      message = retrieve_roundtrip_message('mood', 'meh', as_key: true)
+
+      key = decode_key(message.key)
+      expect(fetch_any(key, 'value')).to eq('meh')
+    end
+
+    example 'retrieve a label that was added to the enum after the table was first seen' do
+      postgres.exec(%{DO $$ BEGIN CREATE TYPE weather AS ENUM ('sunny', 'rainy');
+                      EXCEPTION WHEN duplicate_object THEN NULL; END $$})
+      create_topic('test_value_weather')
+      postgres.exec('CREATE TABLE test_value_weather (id SERIAL PRIMARY KEY, value weather NOT NULL)')
+      postgres.exec(%{INSERT INTO test_value_weather (value) VALUES ('sunny')})
+      sleep 1
+      postgres.exec(%{ALTER TYPE weather ADD VALUE IF NOT EXISTS 'foggy' BEFORE 'rainy'})
+      postgres.exec(%{INSERT INTO test_value_weather (value) VALUES ('foggy')})
+
+      messages = kafka_take_messages('test_value_weather', 2)
+      values = messages.map {|message| fetch_any(decode_value(message.value), 'value') }
+      expect(values).to eq(%w(sunny foggy))
+    end
+
+    example 'retrieve labels made only of punctuation or non-ASCII characters as escaped symbols' do
+      postgres.exec(%{DO $$ BEGIN CREATE TYPE mark AS ENUM ('-', '?', '€', '✓');
+                      EXCEPTION WHEN duplicate_object THEN NULL; END $$})
+      create_topic('test_value_mark')
+      postgres.exec('CREATE TABLE test_value_mark (id SERIAL PRIMARY KEY, value mark NOT NULL)')
+      postgres.exec(%{INSERT INTO test_value_mark (value) VALUES ('-'), ('?'), ('€'), ('✓')})
+
+      messages = kafka_take_messages('test_value_mark', 4)
+      values = messages.map {|message| fetch_any(decode_value(message.value), 'value') }
+      expect(values).to eq(%w(_2d_ _3f_ _e2__82__ac_ _e2__9c__93_))
+    end
+  end
+
+
+  describe 'composite types' do
+    before(:example) do
+      postgres.exec(%{DO $$ BEGIN
+                        CREATE TYPE address AS (street text, zip int, tags text[]);
+                      EXCEPTION WHEN duplicate_object THEN NULL; END $$})
+    end
+
+    example 'retrieve composite value from Kafka as a nested record' do
+      message = retrieve_roundtrip_message('address', '("1 Main St",12345,"{a,b}")')
+
+      row = decode_value(message.value)
+      address = fetch_any(row, 'value')
+      expect(fetch_string(address, 'street')).to eq('1 Main St')
+      expect(fetch_int(address, 'zip')).to eq(12345)
+      expect(fetch_array(address, 'tags')).to eq(%w(a b))
+    end
+
+    example 'retrieve composite value with null attributes' do
+      message = retrieve_roundtrip_message('address', '(,42,)',
+          table_name: 'test_value_address_nulls')
+
+      row = decode_value(message.value)
+      address = fetch_any(row, 'value')
+      expect(address.fetch('street')).to be_nil
+      expect(fetch_int(address, 'zip')).to eq(42)
+    end
+
+    example 'retrieve an attribute that was added to the type after the table was first seen' do
+      postgres.exec(%{DO $$ BEGIN CREATE TYPE dimensions AS (width int, height int);
+                      EXCEPTION WHEN duplicate_object THEN NULL; END $$})
+      create_topic('test_value_dimensions')
+      postgres.exec('CREATE TABLE test_value_dimensions (id SERIAL PRIMARY KEY, value dimensions NOT NULL)')
+      postgres.exec(%{INSERT INTO test_value_dimensions (value) VALUES ('(1,2)')})
+      sleep 1
+      postgres.exec('ALTER TYPE dimensions ADD ATTRIBUTE depth int CASCADE')
+      postgres.exec(%{INSERT INTO test_value_dimensions (value) VALUES ('(3,4,5)')})
+
+      messages = kafka_take_messages('test_value_dimensions', 2)
+      dimensions = fetch_any(decode_value(messages.last.value), 'value')
+      expect(fetch_int(dimensions, 'width')).to eq(3)
+      expect(fetch_int(dimensions, 'depth')).to eq(5)
+    end
+  end
+
+
+  describe 'domain types' do
+    before(:example) do
+      postgres.exec(%{DO $$ BEGIN
+                        CREATE DOMAIN positive_int AS int CHECK (VALUE > 0);
+                        CREATE DOMAIN price AS numeric(10,2);
+                      EXCEPTION WHEN duplicate_object THEN NULL; END $$})
+    end
+
+    example 'encodes a domain over int like an int' do
+      message = retrieve_roundtrip_message('positive_int', 42)
+
+      row = decode_value(message.value)
+      expect(fetch_int(row, 'value')).to eq(42)
+    end
+
+    example 'encodes a domain over numeric(10,2) as a decimal' do
+      message = retrieve_roundtrip_message('price', '12.34')
+
+      row = decode_value(message.value)
+      expect(decode_decimal(fetch_bytes(row, 'value'), 2)).to eq(Rational('12.34'))
+    end
+  end
+
+
+  describe 'decimal types' do
+    ['12345.67', '-12345.67', '0.05', '-0.50', '0.00'].each do |value|
+      example "retrieve #{value} as an Avro decimal with the column's scale" do
+        message = retrieve_roundtrip_message('numeric(10,2)', value,
+            table_name: "test_value_decimal_#{value.gsub(/\W/, '_')}")
+
+        row = decode_value(message.value)
+        expect(decode_decimal(fetch_bytes(row, 'value'), 2)).to eq(Rational(value))
+      end
+    end
+
+    example 'retrieve a decimal with a scale that is not a multiple of four digits' do
+      message = retrieve_roundtrip_message('numeric(20,5)', '-123456789012.34567')
+
+      row = decode_value(message.value)
+      expect(decode_decimal(fetch_bytes(row, 'value'), 5)).to eq(Rational('-123456789012.34567'))
+    end
+
+    # numeric values are read from numeric_send(), which hides whether a value is
+    # stored with the short or the long on-disk header (the latter if the scale is
+    # above 63 or the weight is large), so cover both, with several magnitudes.
+    [['numeric(12,10)', '0.0001234000', 10],                # negative weight
+     ['numeric(12,10)', '-0.0000000001', 10],
+     ['numeric(40,10)', '123456789012345678901234567890.0123456789', 10],
+     ['numeric(40,10)', '-123456789012345678901234567890.0123456789', 10],
+     ['numeric(80,70)', '1234567890.' + '0123456789' * 7, 70], # long header
+     ['numeric(80,70)', '-0.' + '0' * 60 + '1234567891', 70],
+     ['numeric(300,0)', '-' + '9' * 300, 0]                   # long header (weight 74)
+    ].each do |type, value, scale|
+      example "retrieve #{value[0, 30]}#{'...' if value.size > 30} from a #{type} column" do
+        message = retrieve_roundtrip_message(type, value,
+            table_name: "test_value_decimal_#{type.gsub(/\W/, '_')}_#{value.sum}")
+
+        row = decode_value(message.value)
+        expect(decode_decimal(fetch_bytes(row, 'value'), scale)).to eq(Rational(value))
+      end
+    end
+
+    example 'retrieve a decimal from the message key' do
+      message = retrieve_roundtrip_message('numeric(10,2)', '42.42', as_key: true)
+
+      key = decode_key(message.key)
+      expect(decode_decimal(fetch_bytes(key, 'value'), 2)).to eq(Rational('42.42'))
+    end
+
+    example 'retrieve NaN as a string, since it has no decimal representation' do
+      message = retrieve_roundtrip_message('numeric(10,2)', 'NaN')
+
+      row = decode_value(message.value)
+      expect(fetch_string(row, 'value')).to eq('NaN')
     end
   end
 
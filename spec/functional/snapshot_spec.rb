@@ -59,4 +59,226 @@ describe 'initial database snapshot', functional: true, format: :json do
       expect(fetch_string(value, 'username')).to eq('user11')
     end
   end
+
+  describe 'with --row-filter' do
+    before(:example) do
+      TEST_CLUSTER.bottledwater_row_filter = 'users:id % 2 = 0'
+      TEST_CLUSTER.start
+    end
+
+    example 'only publishes rows matching the filter, in the snapshot and ongoing' do
+      postgres.exec(%{INSERT INTO users (id, username) VALUES (11, 'user11'), (12, 'user12')})
+
+      messages = kafka_take_messages('users', 6)
+      ids = messages.map {|message| fetch_int(decode_key(message.key), 'id') }
+
+      expect(ids).to eq([2, 4, 6, 8, 10, 12])
+      expect(fetch_string(decode_value(messages.last.value), 'username')).to eq('user12')
+    end
+
+    example 'sends updates moving a row across the filter as deletes and inserts with REPLICA IDENTITY FULL' do
+      postgres.exec('ALTER TABLE users REPLICA IDENTITY FULL')
+      postgres.exec('UPDATE users SET id = 13 WHERE id = 2')
+      postgres.exec('UPDATE users SET id = 14 WHERE id = 1')
+
+      messages = kafka_take_messages('users', 7)
+      ids = messages.map {|message| fetch_int(decode_key(message.key), 'id') }
+
+      expect(ids).to eq([2, 4, 6, 8, 10, 2, 14])
+      expect(messages[5].value).to be_nil
+      expect(fetch_string(decode_value(messages[6].value), 'username')).to eq('user1')
+    end
+
+    example 'acknowledges transactions in which every row was filtered out' do
+      postgres.exec(%{INSERT INTO users (id, username) VALUES (11, 'user11')})
+      lsn = postgres.exec('SELECT pg_current_xlog_location() AS lsn').first['lsn']
+
+      acknowledged = 20.times.any? do
+        sleep 0.5
+        postgres.exec_params('SELECT count(*) FROM pg_stat_replication WHERE flush_location >= $1::pg_lsn',
+                             [lsn]).first['count'].to_i > 0
+      end
+      expect(acknowledged).to be true
+
+      postgres.exec(%{INSERT INTO users (id, username) VALUES (12, 'user12')})
+      messages = kafka_take_messages('users', 6)
+      expect(fetch_int(decode_key(messages.last.key), 'id')).to eq(12)
+    end
+  end
+
+  describe 'with --exclude-columns' do
+    before(:example) do
+      TEST_CLUSTER.bottledwater_exclude_columns = 'users:username'
+      TEST_CLUSTER.start
+    end
+
+    example 'omits the excluded columns, in the snapshot and ongoing' do
+      postgres.exec(%{INSERT INTO users (username) VALUES('user11')})
+
+      messages = kafka_take_messages('users', 11)
+
+      messages.each_with_index do |message, index|
+        value = decode_value message.value
+        expect(value.keys).to eq(['id'])
+        expect(fetch_int(value, 'id')).to eq(index + 1)
+      end
+    end
+  end
+
+  describe 'with --compression=zlib' do
+    before(:example) do
+      TEST_CLUSTER.bottledwater_compression = 'zlib'
+      TEST_CLUSTER.start
+    end
+
+    example 'publishes the snapshot and ongoing inserts as usual' do
+      long_name = 'user11' + 'x' * 1000
+      postgres.exec(%{INSERT INTO users (username) VALUES('#{long_name}')})
+
+      messages = kafka_take_messages('users', 11)
+
+      expect(fetch_string(decode_value(messages.first.value), 'username')).to eq('user1')
+      expect(fetch_string(decode_value(messages.last.value), 'username')).to eq(long_name)
+    end
+  end
+
+  describe 'with --batch-rows' do
+    before(:example) do
+      TEST_CLUSTER.bottledwater_batch_rows = 3
+      TEST_CLUSTER.start
+    end
+
+    example 'publishes a multi-row transaction intact, including batches flushed mid-transaction' do
+      long_name = 'user12' + 'x' * 100_000 # larger than the batch buffer that is kept between batches
+      postgres.transaction do |conn|
+        conn.exec(%{INSERT INTO users (username) VALUES ('user11')})
+        conn.exec_params('INSERT INTO users (username) VALUES ($1)', [long_name])
+        conn.exec(%{INSERT INTO users (username) SELECT 'user' || num FROM generate_series(13, 17) AS num})
+      end
+      postgres.exec(%{INSERT INTO users (username) VALUES ('user18')})
+
+      messages = kafka_take_messages('users', 18)
+      ids = messages.map {|message| fetch_int(decode_key(message.key), 'id') }
+      usernames = messages.map {|message| fetch_string(decode_value(message.value), 'username') }
+
+      expect(ids).to eq((1..18).to_a)
+      expect(usernames[11]).to eq(long_name)
+      expect(usernames.values_at(10, 12..17)).to eq(%w(user11) + (13..18).map {|num| "user#{num}" })
+    end
+  end
+
+  describe 'with --batch-bytes' do
+    before(:example) do
+      TEST_CLUSTER.bottledwater_batch_bytes = 200
+      TEST_CLUSTER.start
+    end
+
+    example 'publishes a multi-row transaction intact' do
+      postgres.exec(%{INSERT INTO users (username) SELECT 'user' || num FROM generate_series(11, 40) AS num})
+
+      messages = kafka_take_messages('users', 40)
+      usernames = messages.map {|message| fetch_string(decode_value(message.value), 'username') }
+
+      expect(usernames).to eq((1..40).map {|num| "user#{num}" })
+    end
+  end
+
+  describe 'with --snapshot-connections' do
+    before(:example) do
+      TEST_CLUSTER.before_service(TEST_CLUSTER.bottledwater_service, 'Prepopulating accounts table') do
+        postgres.exec('CREATE TABLE accounts (id SERIAL PRIMARY KEY, owner TEXT)')
+        postgres.exec(%{INSERT INTO accounts (owner) SELECT 'owner' || num FROM generate_series(1, 5) AS num})
+      end
+      TEST_CLUSTER.bottledwater_snapshot_connections = 3
+      TEST_CLUSTER.start
+    end
+
+    example 'publishes every table of the snapshot in order, then ongoing inserts' do
+      postgres.exec(%{INSERT INTO users (username) VALUES('user11')})
+
+      users = kafka_take_messages('users', 11)
+      accounts = kafka_take_messages('accounts', 5)
+
+      user_ids = users.map {|message| fetch_int(decode_key(message.key), 'id') }
+      account_ids = accounts.map {|message| fetch_int(decode_key(message.key), 'id') }
+
+      expect(user_ids).to eq((1..11).to_a)
+      expect(account_ids).to eq((1..5).to_a)
+    end
+  end
+
+  describe 'with --snapshot-chunk-pages' do
+    before(:example) do
+      TEST_CLUSTER.before_service(TEST_CLUSTER.bottledwater_service, 'Prepopulating events table') do
+        postgres.exec('CREATE TABLE events (id SERIAL PRIMARY KEY, payload TEXT)')
+        postgres.exec(%{INSERT INTO events (payload) SELECT repeat('x', 100) FROM generate_series(1, 1000)})
+        postgres.exec('DELETE FROM events WHERE id % 10 = 0')
+        postgres.exec('ANALYZE events') # updates relpages, on which the chunks are based
+      end
+      TEST_CLUSTER.bottledwater_snapshot_connections = 3
+      TEST_CLUSTER.bottledwater_snapshot_chunk_pages = 2
+      TEST_CLUSTER.start
+    end
+
+    example 'publishes each visible row of a chunked table exactly once' do
+      messages = kafka_take_messages('events', 900)
+      ids = messages.map {|message| fetch_int(decode_key(message.key), 'id') }
+
+      expect(ids.sort).to eq((1..1000).reject {|id| id % 10 == 0 })
+    end
+  end
+
+  describe 'with --snapshot-state-file' do
+    before(:example) do
+      TEST_CLUSTER.bottledwater_snapshot_state_file = '/tmp/bottledwater-snapshot.state'
+    end
+
+    example 'publishes the snapshot table by table, then ongoing inserts' do
+      TEST_CLUSTER.start
+      postgres.exec(%{INSERT INTO users (username) VALUES('user11')})
+
+      messages = kafka_take_messages('users', 11)
+      ids = messages.map {|message| fetch_int(decode_key(message.key), 'id') }
+
+      expect(ids).to eq((1..11).to_a)
+    end
+
+    example 'resumes an interrupted snapshot, exporting only the tables not yet published' do
+      # Tables are exported largest first, so events is published before users.
+      # Without its topic, delivery of the users rows fails, and Bottled Water
+      # exits once events has been completely published.
+      TEST_CLUSTER.kafka_auto_create_topics_enable = false
+      TEST_CLUSTER.bottledwater_snapshot_chunk_pages = 2
+      TEST_CLUSTER.before_service(TEST_CLUSTER.bottledwater_service, 'Prepopulating events table') do |cluster|
+        cluster.postgres.exec('CREATE TABLE events (id SERIAL PRIMARY KEY, payload TEXT)')
+        cluster.postgres.exec(%{INSERT INTO events (payload) SELECT repeat('x', 100) FROM generate_series(1, 1000)})
+        cluster.postgres.exec('ANALYZE events')
+        cluster.kazoo.create_topic('events', partitions: 1, replication_factor: 1)
+      end
+      TEST_CLUSTER.start
+
+      stopped = 20.times.any? { sleep 0.5; !TEST_CLUSTER.bottledwater_running? }
+      expect(stopped).to be true
+
+      slots = postgres.exec('SELECT count(*) FROM pg_replication_slots').first['count'].to_i
+      expect(slots).to eq(1)
+
+      TEST_CLUSTER.kazoo.create_topic('users', partitions: 1, replication_factor: 1)
+      postgres.exec(%{INSERT INTO users (username) VALUES('user11')})
+      TEST_CLUSTER.restart_bottledwater
+
+      users = kafka_take_messages('users', 11, wait: 15)
+      user_ids = users.map {|message| fetch_int(decode_key(message.key), 'id') }
+      expect(user_ids.uniq.sort).to eq((1..11).to_a)
+
+      # The events table was completed before the interruption, so it is not
+      # published again.
+      events = kafka_take_messages('events', 1000)
+      expect(events.map {|message| fetch_int(decode_key(message.key), 'id') }.sort).to eq((1..1000).to_a)
+      expect { kafka_take_messages('events', 1001, wait: 3) }.to raise_error(/only saw 1000/)
+
+      expect(TEST_CLUSTER.bottledwater_running?).to be true
+      expect(TEST_CLUSTER.bottledwater_file_exists?('/tmp/bottledwater-snapshot.state')).to be false
+    end
+  end
 end
@@ -0,0 +1,45 @@
+require 'spec_helper'
+require 'format_contexts'
+require 'test_cluster'
+
+describe 'table mapping', functional: true, format: :json do
+  let(:postgres) { TEST_CLUSTER.postgres }
+
+  before(:example) do
+    TEST_CLUSTER.before_service(TEST_CLUSTER.bottledwater_service, 'Mapping the alpha table') do |cluster|
+      cluster.postgres.exec('CREATE TABLE tbl_mapps (reloid OID PRIMARY KEY, table_name TEXT)')
+      cluster.postgres.exec('CREATE TABLE alpha (id SERIAL PRIMARY KEY, name TEXT)')
+      cluster.postgres.exec('CREATE TABLE beta (id SERIAL PRIMARY KEY, name TEXT)')
+      cluster.postgres.exec(%{INSERT INTO tbl_mapps VALUES ('alpha'::regclass, 'alpha')})
+    end
+    TEST_CLUSTER.start
+  end
+
+  after(:example) do
+    TEST_CLUSTER.stop
+  end
+
+  def names(messages)
+    messages.map {|message| fetch_string(decode_value(message.value), 'name') }
+  end
+
+  example 'a table added to the mapping is streamed from then on, without repeating other tables' do
+    postgres.exec(%{INSERT INTO beta (name) VALUES ('b1')})
+    postgres.exec(%{INSERT INTO alpha (name) VALUES ('a1')})
+    expect(names(kafka_take_messages('alpha', 1))).to eq(%w(a1))
+
+    # Restarts the replication stream with beta included
+    postgres.exec(%{INSERT INTO tbl_mapps VALUES ('beta'::regclass, 'beta')})
+    TEST_CLUSTER.signal_bottledwater('QUIT')
+    sleep 2
+
+    postgres.exec(%{INSERT INTO alpha (name) VALUES ('a2')})
+    postgres.exec(%{INSERT INTO beta (name) VALUES ('b2')})
+
+    expect(names(kafka_take_messages('alpha', 2))).to eq(%w(a1 a2))
+    expect(names(kafka_take_messages('beta', 1))).to eq(%w(b2))
+
+    expect { kafka_take_messages('alpha', 3, wait: 3) }.to raise_error(/only saw 2/)
+    expect { kafka_take_messages('beta', 2, wait: 3) }.to raise_error(/only saw 1/)
+  end
+end
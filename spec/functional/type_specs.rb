@@ -69,7 +69,7 @@ shared_examples 'type specs' do
   end
 
   describe 'cidr' do
-    include_examples 'roundtrip type', "cidr", "192.168.1.0/24"
+    include_examples 'inet type', "cidr", "192.168.1.0/24"
   end
 
   describe 'circle' do
@@ -101,7 +101,7 @@ shared_examples 'type specs' do
   end
 
   describe 'inet' do
-    include_examples 'roundtrip type', "inet", "192.168.1.1/24"
+    include_examples 'inet type', "inet", "192.168.1.1/24"
   end
 
   describe 'int2vector' do
@@ -311,7 +311,7 @@ shared_examples 'type specs' do
   end
 
   describe 'uuid' do
-    include_examples 'roundtrip type', "uuid", 'a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11'
+    include_examples 'uuid type', "uuid", 'a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11'
   end
 
   describe 'xid' do
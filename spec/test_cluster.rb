@@ -45,6 +45,14 @@ class TestCluster
     self.bottledwater_on_error = :exit
     self.bottledwater_skip_snapshot = false
     self.bottledwater_topic_prefix = nil
+    self.bottledwater_row_filter = nil
+    self.bottledwater_exclude_columns = nil
+    self.bottledwater_compression = nil
+    self.bottledwater_batch_bytes = nil
+    self.bottledwater_batch_rows = nil
+    self.bottledwater_snapshot_connections = nil
+    self.bottledwater_snapshot_chunk_pages = nil
+    self.bottledwater_snapshot_state_file = nil
 
     self.valgrind = false
 
@@ -154,6 +162,38 @@ class TestCluster
     ENV['BOTTLED_WATER_TOPIC_PREFIX'] = prefix.to_s
   end
 
+  def bottledwater_row_filter=(filter)
+    ENV['BOTTLED_WATER_ROW_FILTER'] = filter.to_s
+  end
+
+  def bottledwater_exclude_columns=(projection)
+    ENV['BOTTLED_WATER_EXCLUDE_COLUMNS'] = projection.to_s
+  end
+
+  def bottledwater_compression=(compression)
+    ENV['BOTTLED_WATER_COMPRESSION'] = compression.to_s
+  end
+
+  def bottledwater_batch_bytes=(bytes)
+    ENV['BOTTLED_WATER_BATCH_BYTES'] = bytes.to_s
+  end
+
+  def bottledwater_batch_rows=(rows)
+    ENV['BOTTLED_WATER_BATCH_ROWS'] = rows.to_s
+  end
+
+  def bottledwater_snapshot_connections=(connections)
+    ENV['BOTTLED_WATER_SNAPSHOT_CONNECTIONS'] = connections.to_s
+  end
+
+  def bottledwater_snapshot_chunk_pages=(pages)
+    ENV['BOTTLED_WATER_SNAPSHOT_CHUNK_PAGES'] = pages.to_s
+  end
+
+  def bottledwater_snapshot_state_file=(path)
+    ENV['BOTTLED_WATER_SNAPSHOT_STATE_FILE'] = path.to_s
+  end
+
   def valgrind=(enabled)
     if enabled
       @valgrind = true
@@ -243,6 +283,42 @@ class TestCluster
     start
   end
 
+  # Starts the Bottled Water container again after Bottled Water exited.
+  # Unlike restart, this keeps the container, and therefore its filesystem.
+  def restart_bottledwater
+    @compose.run!(:start, bottledwater_service)
+    wait_for_container(bottledwater_service)
+  end
+
+  # Sends a signal to Bottled Water, e.g. 'QUIT' to make it reload the table
+  # mapping.
+  def signal_bottledwater(signal)
+    bottledwater = container_for_service(bottledwater_service)
+    @docker.run!(:kill, "--signal=#{signal}", bottledwater.id)
+  end
+
+  # Checks whether the given path exists inside the Bottled Water container,
+  # which must be running.
+  def bottledwater_file_exists?(path)
+    bottledwater = container_for_service(bottledwater_service)
+    command = @docker.shell.run(:docker, :exec, bottledwater.id, 'test', '-e', path).join
+    command.status.success?
+  end
+
+  # Runs the bwtest client from inside the Bottled Water container for the
+  # given number of seconds, and returns what it printed to stdout.  If the
+  # replication slot doesn't exist yet, bwtest creates it and prints the
+  # snapshot before streaming changes.
+  def bwtest(slot:, options: [], seconds: 5)
+    bottledwater = container_for_service(bottledwater_service)
+    command = @docker.shell.run(:docker, :exec, bottledwater.id,
+                                'timeout', seconds.to_s, 'stdbuf', '-oL',
+                                '/usr/local/bin/bwtest',
+                                '--postgres=host=postgres port=5432 dbname=postgres user=postgres',
+                                "--slot=#{slot}", *options).join
+    command.captured_output
+  end
+
   private
   def detect_docker_host_ip
     ip_output = @docker.run!(:run, '--rm', 'debian:latest', 'ip', 'route').split("\n")